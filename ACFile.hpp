@@ -117,7 +117,8 @@ void ACFile::read(char *&buffer)
 	buffer = (char *)malloc(fileLength+1);
 	
 	// load file
-	fread(buffer, fileLength, 1, f);	
+	fread(buffer, fileLength, 1, f);
+	buffer[fileLength] = 0; // the buffer is used as a C string
 }
 
 void ACFile::save(const std::string fileName, char *&buffer, unsigned int length)
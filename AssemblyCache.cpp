@@ -0,0 +1,259 @@
+/*
+ *  AssemblyCache.cpp
+ *  6502assembler
+ *
+ *  Results of earlier assemblies kept on disk.
+ *
+ */
+
+#include "AssemblyCache.h"
+#include "Hash.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * The format of an entry, all numbers little endian:
+ *
+ *     "BAC4"
+ *     u64 key                      (the hash the entry is named after)
+ *     u32 files, for each:         u64 hash of the contents, u16 name length, canonical name
+ *     u32 blocks, for each:        u16 start address, u32 length, the bytes
+ *     u32 labels, for each:        u16 address, u8 defined, u16 name length, name
+ *     u32 report length, the report text
+ *     u64 hash of everything before
+ */
+#define CACHE_MAGIC "BAC4"
+
+// ----------------------------------------------------------------------------
+static void put(string &out, uint64_t value, int bytes)
+{
+    for(int i=0; i<bytes; i++)
+        out += (char)(value >> (i*8));
+}
+
+static void putName(string &out, const string &name)
+{
+    put(out, name.size(), 2);
+    out += name;
+}
+
+/*
+ * EntryReader
+ *
+ * Reads the fields of an entry. Reading past the end clears 'ok' and gives
+ * zeros from then on, so the fields can be read without checking each one.
+ */
+struct EntryReader
+{
+    const char *p, *end;
+    bool ok;
+
+    EntryReader(string_view data) : p(data.data()), end(data.data() + data.size()), ok(true) {}
+
+    const char *bytes(size_t count)
+    {
+        if(!ok || ((size_t)(end-p)<count))
+        {
+            ok = false;
+            return end;
+        }
+        const char *start = p;
+        p += count;
+        return start;
+    }
+
+    uint64_t number(int count)
+    {
+        const unsigned char *start = (const unsigned char *)bytes(count);
+        uint64_t value = 0;
+        for(int i=count-1; ok && (i>=0); i--)
+            value = (value << 8) | start[i];
+        return value;
+    }
+
+    string_view name()
+    {
+        size_t length = (size_t)number(2);
+        return string_view(bytes(length), ok ? length : 0);
+    }
+};
+
+// ----------------------------------------------------------------------------
+static string canonicalName(const string &fileName)
+{
+    char *canonical = realpath(fileName.c_str(), NULL);
+    if(canonical==NULL)
+        return "";
+    string result = canonical;
+    free(canonical);
+    return result;
+}
+
+// ----------------------------------------------------------------------------
+AssemblyCache::AssemblyCache(const string &directory)
+{
+    this->directory = directory;
+    key = 0;
+}
+
+// ----------------------------------------------------------------------------
+int AssemblyCache::lookup(const char *fileName, string_view text, const string &options)
+{
+    entry.close();
+    blocks.clear();
+    labelData = reportText = string_view();
+    entryName.clear();
+
+    if(directory.empty() || (strcmp(fileName, "-")==0)) // stdin has no name to be canonical about
+        return 1;
+
+    string path = canonicalName(fileName);
+    if(path.empty())
+        return 1;
+
+    // the version is in the key, so an entry of another assembler is never even opened
+    const char *version = CACHE_MAGIC BASSEMBLER_VERSION;
+    key = contentHash(version, strlen(version));
+    key = contentHash(options.data(), options.size() + 1, key); // with the terminator, so it can't run into the path
+    key = contentHash(path.data(), path.size(), key);
+    key = contentHash(text.data(), text.size(), key);
+
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.bac", (unsigned long long)key);
+    entryName = directory + name;
+
+    if((entry.open(entryName.c_str())==-1) || (read()==-1))
+    {
+        entry.close();
+        blocks.clear();
+        labelData = reportText = string_view();
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * read()
+ *
+ * Checks the mapped entry: it must be complete, it must belong to the key,
+ * and the files it lists must still have the same contents. Then its blocks
+ * are taken as they are, pointing right into the mapping.
+ * Returns 0, or -1 if it can't be used.
+ */
+int AssemblyCache::read()
+{
+    string_view data = entry.text();
+    if((data.size()<4+8+8) || (memcmp(data.data(), CACHE_MAGIC, 4)!=0))
+        return -1;
+
+    EntryReader trailer(data.substr(data.size()-8));
+    if(trailer.number(8)!=contentHash(data.data(), data.size()-8)) // torn or damaged
+        return -1;
+
+    EntryReader in(data.substr(4, data.size()-4-8));
+    if(in.number(8)!=key)
+        return -1;
+
+    unsigned int files = (unsigned int)in.number(4);
+    for(unsigned int i=0; (i<files) && in.ok; i++)
+    {
+        uint64_t hash = in.number(8);
+        string_view name = in.name();
+        SourceFile file;
+        if(!in.ok || (file.open(string(name).c_str())==-1))
+            return -1;
+        if(contentHash(file.text().data(), file.text().size())!=hash)
+            return -1;
+    }
+
+    unsigned int count = (unsigned int)in.number(4);
+    for(unsigned int i=0; (i<count) && in.ok; i++)
+    {
+        MemChunk chunk;
+        chunk.startAddress = (word)in.number(2);
+        chunk.length = (unsigned int)in.number(4);
+        chunk.data = (byte *)in.bytes(chunk.length); // the mapping is read only, nobody writes a finished block
+        blocks.push_back(chunk);
+    }
+
+    // the labels are only skipped here, see loadLabels()
+    const char *labelStart = in.p;
+    unsigned int labels = (unsigned int)in.number(4);
+    for(unsigned int i=0; (i<labels) && in.ok; i++)
+    {
+        in.bytes(2+1);
+        in.name();
+    }
+    labelData = string_view(labelStart, in.ok ? in.p-labelStart : 0);
+
+    size_t length = (size_t)in.number(4);
+    reportText = string_view(in.bytes(length), in.ok ? length : 0);
+    return (in.ok && (in.p==in.end)) ? 0 : -1;
+}
+
+// ----------------------------------------------------------------------------
+void AssemblyCache::loadLabels(SymbolTable &labels) const
+{
+    EntryReader in(labelData);
+    unsigned int count = (unsigned int)in.number(4);
+    for(unsigned int i=0; (i<count) && in.ok; i++)
+    {
+        word address = (word)in.number(2);
+        bool defined = in.number(1)!=0;
+        string_view name = in.name();
+        if(!in.ok)
+            break;
+        SymbolId id = labels.intern(name.data(), (int)name.size());
+        if(defined)
+            labels.define(id, address);
+    }
+}
+
+// ----------------------------------------------------------------------------
+int AssemblyCache::store(const BASSembler6502 &assembler, const vector<MemChunk> &chunks, const string &report)
+{
+    if(entryName.empty())
+        return 0;
+
+    string out = CACHE_MAGIC;
+    put(out, key, 8);
+
+    // the contents the assembler actually read are hashed, not what the files hold by now
+    vector<string> fileNames;
+    vector<string_view> texts;
+    assembler.sourceFiles(fileNames, texts);
+    put(out, fileNames.size(), 4);
+    for(size_t i=0; i<fileNames.size(); i++)
+    {
+        string name = canonicalName(fileNames[i]);
+        if(name.empty()) // gone already, the entry would never be used
+            return 0;
+        put(out, contentHash(texts[i].data(), texts[i].size()), 8);
+        putName(out, name);
+    }
+
+    put(out, chunks.size(), 4);
+    for(size_t i=0; i<chunks.size(); i++)
+    {
+        put(out, chunks[i].startAddress, 2);
+        put(out, chunks[i].length, 4);
+        out.append((const char *)chunks[i].data, chunks[i].length);
+    }
+
+    const SymbolTable &labels = assembler.labels();
+    put(out, labels.size(), 4);
+    for(SymbolId id=0; id<labels.size(); id++)
+    {
+        put(out, labels.address(id), 2);
+        put(out, labels.isDefined(id) ? 1 : 0, 1);
+        putName(out, labels.name(id));
+    }
+
+    put(out, report.size(), 4);
+    out += report;
+
+    put(out, contentHash(out.data(), out.size()), 8);
+
+    return writeFileAtomically(entryName, out);
+}
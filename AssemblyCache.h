@@ -0,0 +1,70 @@
+/*
+ *  AssemblyCache.h
+ *  6502assembler
+ *
+ *  Results of earlier assemblies kept on disk.
+ *
+ */
+
+#ifndef ASSEMBLYCACHE_H
+#define ASSEMBLYCACHE_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <stdint.h>
+#include "BASSembler6502.h"
+
+/*
+ * AssemblyCache
+ *
+ * One file per assembled source in the cache directory, named after the
+ * hash of the assembler version, the options that change the code (like
+ * -O), the canonical path and the text of the main source. The entry lists
+ * every other file the assembly read, with the hash of its contents, and
+ * it is only used if none of them changed. Then the blocks are taken right
+ * from the mapped entry and nothing is assembled.
+ *
+ * An entry holds the blocks, the labels and the text of the reports on
+ * the assembly (-O, --timing), so a hit prints the same as the assembly
+ * did. A failed assembly is not stored: its error may be about a file that
+ * doesn't exist yet.
+ *
+ * Entries are written to a temporary file and renamed into place, so a
+ * reader never sees half of an entry. Parallel jobs storing the same entry
+ * write the same bytes, whichever rename comes last wins.
+ */
+class AssemblyCache
+{
+    string directory;
+    string entryName;           // the entry of the source last looked up, empty if it can't be cached
+    uint64_t key;
+    SourceFile entry;           // mapped
+    vector<MemChunk> blocks;    // point into 'entry'
+    string_view labelData;      // the labels in 'entry', decoded by loadLabels()
+    string_view reportText;     // in 'entry'
+
+    int read();
+
+public:
+    // an empty directory disables the cache
+    AssemblyCache(const string &directory);
+
+    // Looks up the result for 'text', the main source read from 'fileName'
+    // and assembled with 'options'.
+    // Returns 0 if it was found (see chunks()), 1 if it has to be assembled.
+    int lookup(const char *fileName, string_view text, const string &options = "");
+
+    // Stores the result of assembling the source of the last lookup(), with
+    // the text of its reports. The options given to lookup() must say which
+    // reports those are.
+    // Returns 0, or -1 if the entry couldn't be written (errno is set).
+    int store(const BASSembler6502 &assembler, const vector<MemChunk> &chunks, const string &report = "");
+
+    // the result found by lookup(), valid until the next lookup()
+    const vector<MemChunk> &chunks() const { return blocks; }
+    string_view report() const { return reportText; }
+    void loadLabels(SymbolTable &labels) const;
+};
+
+#endif // ASSEMBLYCACHE_H
@@ -8,104 +8,738 @@
  */
 
 #include "BASSembler6502.h"
-#include <sstream> // istringstream
+#include "IncrementalAssembler.h"
+#include "SegmentAssembler.h"
+#include "OpcodeTable.h"
+#include <sstream> // stringstream
 #include <locale> // toupper()
+#include <algorithm> // sort()
+#include <string.h> // strerror(), memcpy()
+#include <errno.h>
+#include <stdlib.h> // realpath()
+
+using std::stringstream;
+using std::hex;
+
+/*
+ * Statistics
+ *
+ * STATS_TIME() charges the rest of the enclosing block to a time of
+ * AssemblyStats, and hands it back to the step that was timed before when
+ * the block is left. STATS_COUNT() adds to a counter. Without
+ * BASSEMBLER_STATS both are empty, so there's not even a test of 'stats'.
+ */
+#ifdef BASSEMBLER_STATS
+#include <chrono>
+
+static uint64_t nanoseconds()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class StatsTimer
+{
+	AssemblyStats *stats;
+	uint64_t *previous;
+
+public:
+	StatsTimer(AssemblyStats *stats, uint64_t AssemblyStats::*time) : stats(stats), previous(NULL)
+	{
+		if(stats==NULL)
+			return;
+		uint64_t now = nanoseconds();
+		*stats->timing += now - stats->timingSince;
+		previous = stats->timing;
+		stats->timing = &(stats->*time);
+		stats->timingSince = now;
+	}
+
+	~StatsTimer()
+	{
+		if(stats==NULL)
+			return;
+		uint64_t now = nanoseconds();
+		*stats->timing += now - stats->timingSince;
+		stats->timing = previous;
+		stats->timingSince = now;
+	}
+};
+
+#define STATS_TIME(time) StatsTimer statsTimer(stats, &AssemblyStats::time)
+#define STATS_COUNT(counter, n) do { if(stats!=NULL) stats->counter += (n); } while(0)
+#else
+#define STATS_TIME(time)
+#define STATS_COUNT(counter, n)
+#endif
 
 /*
  * assemble()
  *
  * The one and only public method of the class.
  *
- * Input: char *source: the 6502 assembly source code in C string format
+ * Input: string_view source: the 6502 assembly source code. It is not copied,
+ *        so it must stay valid until assemble() returns.
  * Output: vector<MemChunk> *&chunks: an array of MemChunks
  *
  * Description: a MemChunk contains a block of machine code for at a given memory address.
  */
 int BASSembler6502::assemble(char *source, vector<MemChunk> *&chunks) // source = input, chunks = output
 {
-	asmError.lineContent = asmError.errorString = asmError.errorStringVerbose = "";
+	return assemble(string_view(source), chunks);
+}
+
+int BASSembler6502::assemble(string_view source, vector<MemChunk> *&chunks, const string &fileName, AssemblyStats *stats) // source = input, chunks = output
+{
+	reset();
+
+#ifdef BASSEMBLER_STATS
+	this->stats = stats;
+	if(stats!=NULL)
+	{
+		memset(stats, 0, sizeof(AssemblyStats));
+		stats->timing = &stats->otherTime;
+		stats->timingSince = nanoseconds();
+	}
+#else
+	(void)stats;
+#endif
+
+	// the main source is unit #0. it is not cached, the caller owns it
+	if(units.empty())
+		units.push_back(new SourceUnit());
+	units[0]->name = fileName;
+	units[0]->text = source;
+	units[0]->file = NULL;
+	units[0]->tokenized = false;
+	for(int i=0; i<(int)units.size(); i++) // an earlier failed assembly might have left them set
+		units[i]->active = false;
+	actUnit = 0;
+
+	// the .pc segments on several threads, if there are any worth it (statistics, the tracker, the instruction log, external labels and the optimizer want the serial passes)
+	int result = 1;
+	if((threads!=1) && (tracker==NULL) && (this->stats==NULL) && (instructionLog==NULL) && !externalLabels && !optimize)
+	{
+		SegmentAssembler segments(*this, threads);
+		result = segments.assemble();
+		if(result==1) // serially from scratch, that also gives the exact error message
+			reset();
+	}
+	if(result==1)
+		result = assembleSource();
+
+#ifdef BASSEMBLER_STATS
+	if(stats!=NULL)
+	{
+		*stats->timing += nanoseconds() - stats->timingSince;
+		stats->timing = NULL;
+		stats->fixups = (unsigned int)fixups.size();
+		stats->relaxSites = (unsigned int)sites.size();
+		stats->chunks = (unsigned int)this->chunks.size();
+		for(int i=0; i<(int)this->chunks.size(); i++)
+			stats->bytes += this->chunks[i].length;
+	}
+	this->stats = NULL; // the caller's object, it's gone after the call
+#endif
+
+	if(result==-1)
+		return -1;
+
+    // assembly's done, preparing to return the binary data in the correct form.
+	// we make a new vector of chunks with the copy of the local vector
+	chunks = new vector<MemChunk>(this->chunks);
+	return 0;
+}
+
+/*
+ * assembleSource()
+ *
+ * The passes over the main source, then the forward references.
+ */
+int BASSembler6502::assembleSource()
+{
+	if(assemblePass()==-1)
+		return -1;
+
+	// if forward references to zero page were found, everything is assembled once more with the final sizes
+	if(!sites.empty() && relaxLayout())
+	{
+		startPass();
+		finalPass = true;
+		if(assemblePass()==-1)
+			return -1;
+	}
+    
+    return resolveFixups(); // handle unresolved labels
+}
+
+/*
+ * assemblePass()
+ *
+ * Assembles the main source from its first line to its last.
+ */
+int BASSembler6502::assemblePass()
+{
+	STATS_COUNT(passes, 1);
+	if(assembleUnit(0)==-1)
+		return -1;
+
+	if((actChunk!=NULL) && (closeChunk()==-1)) // close last chunk
+	{
+		string_view source = units[0]->text;
+		unsigned int lastLine = (unsigned int)std::count(source.begin(), source.end(), '\n');
+		if(!source.empty() && (source.back()!='\n'))
+			lastLine++;
+		setErrorLine(0, lastLine, sourceLine(0, lastLine));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * reset()
+ *
+ * Brings the assembler back to its initial state, so one instance can be
+ * reused for any number of sources. Buffers keep their capacity and the
+ * memory image is kept. Cached include files are dropped, as they might
+ * have changed since. Chunks returned by an earlier assemble() point into
+ * the memory image, so they are only valid until the next assemble().
+ */
+void BASSembler6502::reset()
+{
+	asmError.lineContent = asmError.errorString = asmError.errorStringVerbose = asmError.fileName = "";
 	asmError.errorLineNumber = 0;
-	
-	istringstream src(source); // we slice up the source with this line by line
-	string line;
 
-	unsigned int actLine = 1;
-	while(getline(src,line)) // step through the source code and process each line
+	if(memory==NULL)
+		memory = new byte[MEMORY_SIZE + MEMORY_SLACK];
+
+	startPass();
+	sites.clear();
+	siteTerms.clear();
+	labelFirstSite.clear();
+	labelSite.clear();
+	finalPass = false;
+
+	for(int i=1; i<(int)units.size(); i++) // unit #0 is the main source, it's reused
 	{
-		remove_leading_space->GlobalReplace("\\1", &line);
-		remove_trailing_space->GlobalReplace("", &line);
-		
-		lines.push_back( line );
+		delete units[i]->file;
+		delete units[i];
+	}
+	if(units.size()>1)
+		units.resize(1);
+	unitCache.clear();
+	actUnit = 0;
+}
 
-        int dirResult = checkDirectives(line);
-        int labResult = detectLabelDefinition(line);
-        int asmResult = assembleLine(line, actLine);
+/*
+ * startPass()
+ *
+ * Clears everything a pass builds up. Loaded files are kept, so a second
+ * pass doesn't read or tokenize them again.
+ */
+void BASSembler6502::startPass()
+{
+	chunks.clear();
+	actChunk = NULL;
+	actAddress = 0;
+	charset = &asciiCharset;
+	symbols.clear();
+	fixups.clear();
+	exprTerms.clear();
+	siteCount = 0;
+	chunkFirstSite = 0;
+	actUnit = 0;
+	labelCount = 0;
+	if(instructionLog!=NULL)
+		instructionLog->clear();
+	peephole = Peephole();
+	rewrites.clear();
+	clearMacros(); // they are defined again as the pass goes
+}
 
-		if((dirResult==1) && (asmResult==1) && (labResult==1)) // return value of 1 means no related content detected
-        {
-            asmError.errorString = "Syntax error";
-            asmError.errorLineNumber = actLine;
-            asmError.lineContent = line;
-            return -1;
-        }
-        
-		if((dirResult==-1) || (asmResult==-1) || (labResult==-1)) // return value of -1 means error during assembly
+/*
+ * assembleUnit()
+ *
+ * Assembles a source unit line by line. The main source is sliced and
+ * tokenized on the fly, included files use the lines and tokens cached
+ * by tokenizeUnit(). .include calls this recursively.
+ */
+int BASSembler6502::assembleUnit(unsigned int unit)
+{
+	SourceUnit *source = units[unit]; // 'units' may grow during an .include, but the units themselves don't move
+	unsigned int callerUnit = actUnit;
+	actUnit = unit;
+	source->active = true;
+
+	size_t pos = 0;
+	unsigned int actLine = 1;
+	while(source->tokenized ? (actLine<=source->lines.size()) : (pos<source->text.size())) // step through the source code and process each line
+	{
+		string_view line;
+		if(source->tokenized)
 		{
-			asmError.errorLineNumber = actLine;
-			asmError.lineContent = line;
-			return -1;
+			STATS_TIME(splitTime);
+			line = source->lines[actLine-1];
+			tokens.assign(source->tokens.begin() + source->lineTokens[actLine-1], source->tokens.begin() + source->lineTokens[actLine]);
 		}
+		else
+		{
+			STATS_TIME(splitTime);
+			// slice the next line out of the source, no copying involved
+			size_t end = source->text.find('\n', pos);
+			if(end==string_view::npos)
+				end = source->text.size();
+			line = source->text.substr(pos, end-pos);
+			pos = end+1;
+
+			trimLine(line); // remove leading and trailing white space
+			Lexer6502::tokenizeLine(line, tokens); // the line is scanned once, all further processing works on the tokens
+		}
+
+		if((tracker!=NULL) && (unit==0))
+			tracker->lineStarted(line, actLine);
+
+		if(assembleStatement(line, actLine)==-1)
+			return -1;
+
+		if((tracker!=NULL) && (unit==0))
+			tracker->lineDone(actLine);
 
 		actLine++;
 	}
 
-	actChunk->finalize(); // close last chunk
-	this->chunks.push_back(*actChunk);
-    
-    // handle unresolved labels
-    map<string, UnresolvedLabel>::iterator iter;    
-    for(iter = unresolvedLabels.begin(); iter != unresolvedLabels.end(); iter++)
-    {
-        // now loop through of all occurrences of the unknown label references
-        string addressStr; // variables to hold extracted data
-        UnresolvedLabel uLabel;
-        word resolvedAddress;
-        int size = (int)iter->second.addresses.size();
-        for(int i=0; i<size; i++)
+	if((recording!=NULL) && (recordingUnit==unit) && (recordingNesting==expansionNesting)) // a block must end in its own file
+	{
+		asmError.errorString = recordingName.empty() ? "Missing .endr" : "Missing .endm";
+		asmError.errorStringVerbose = "The block is still open at the end of the file.";
+		setErrorLine(unit, recordingLine, sourceLine(unit, recordingLine));
+		return -1;
+	}
+
+	source->active = false;
+	actUnit = callerUnit;
+	return 0;
+}
+
+/*
+ * assembleStatement()
+ *
+ * Assembles a single line whose tokens are in 'tokens'. The line comes from
+ * a source file or from a macro expansion, errors are reported for the given
+ * line number of the current unit.
+ */
+int BASSembler6502::assembleStatement(string_view &line, unsigned int lineNumber)
+{
+	if(recording!=NULL) // inside a .macro or .rept block the lines are only collected
+	{
+		int result = recordLine(line);
+		if((result==-1) && (asmError.errorLineNumber==0))
+			setErrorLine(actUnit, lineNumber, line);
+		return result;
+	}
+
+	STATS_COUNT(lines, 1);
+	STATS_COUNT(tokens, (unsigned int)tokens.size());
+
+	int dirResult = checkDirectives(line, lineNumber);
+	int labResult = 1;
+	int asmResult = 1;
+	STATS_COUNT(directives, (dirResult==0) ? 1 : 0);
+	if(dirResult==1) // a directive line can't hold anything else (and .include overwrites 'tokens')
+	{
+		labResult = detectLabelDefinition(line);
+		asmResult = assembleLine(line, lineNumber);
+	}
+
+	if((dirResult==1) && (asmResult==1) && (labResult==1)) // return value of 1 means no related content detected
+	{
+		asmError.errorString = "Syntax error";
+		setErrorLine(actUnit, lineNumber, line);
+		return -1;
+	}
+
+	if((dirResult==-1) || (asmResult==-1) || (labResult==-1)) // return value of -1 means error during assembly
+	{
+		if(asmError.errorLineNumber==0) // not yet set by an included file or a macro expansion
+			setErrorLine(actUnit, lineNumber, line);
+		return -1;
+	}
+
+	if((actChunk!=NULL) && (actChunk->endAddress() > MEMORY_SIZE)) // the chunk ran past the end of the memory
+	{
+		asmError.errorString = "Address out of range";
+		asmError.errorStringVerbose = "The code must not run past $FFFF.";
+		setErrorLine(actUnit, lineNumber, line);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * loadUnit()
+ *
+ * Returns the unit of a file for .include and .incbin. Relative names are
+ * resolved against the directory of the including file. Every file is
+ * loaded (memory-mapped) only once, later requests are served from the cache.
+ */
+int BASSembler6502::loadUnit(string_view fileName, unsigned int &unit)
+{
+	string path(fileName);
+	const string &includer = units[actUnit]->name;
+	size_t slash = includer.rfind('/');
+	if((path[0]!='/') && (slash!=string::npos))
+		path = includer.substr(0, slash+1) + path;
+
+	// the cache is keyed by the canonical path, so "a/../b.asm" and "b.asm" are the same file
+	string key = path;
+	char *canonical = realpath(path.c_str(), NULL);
+	if(canonical!=NULL)
+	{
+		key = canonical;
+		free(canonical);
+	}
+
+	map<string, unsigned int>::iterator it = unitCache.find(key);
+	if(it!=unitCache.end())
+	{
+		unit = it->second;
+		return 0;
+	}
+
+	SourceFile *file = new SourceFile();
+	if(file->open(path.c_str())==-1)
+	{
+		asmError.errorString = "Cannot open file \"" + path + "\": " + strerror(errno);
+		delete file;
+		return -1;
+	}
+
+	SourceUnit *source = new SourceUnit();
+	source->name = path;
+	source->text = file->text();
+	source->file = file;
+	source->tokenized = false;
+	source->active = false;
+
+	unit = (unsigned int)units.size();
+	units.push_back(source);
+	unitCache[key] = unit;
+	return 0;
+}
+
+/*
+ * tokenizeUnit()
+ *
+ * Splits an included file into trimmed lines and tokenizes all of them
+ * into one flat token array, so including it again costs no scanning.
+ */
+void BASSembler6502::tokenizeUnit(SourceUnit *unit)
+{
+	STATS_TIME(splitTime);
+	string_view text = unit->text;
+	size_t pos = 0;
+	while(pos<text.size())
+	{
+		size_t end = text.find('\n', pos);
+		if(end==string_view::npos)
+			end = text.size();
+		string_view line = text.substr(pos, end-pos);
+		pos = end+1;
+
+		trimLine(line);
+		Lexer6502::tokenizeLine(line, tokens);
+
+		unit->lines.push_back(line);
+		unit->lineTokens.push_back((unsigned int)unit->tokens.size());
+		unit->tokens.insert(unit->tokens.end(), tokens.begin(), tokens.end());
+	}
+	unit->lineTokens.push_back((unsigned int)unit->tokens.size());
+	unit->tokenized = true;
+}
+
+/*
+ * resolveFixups()
+ *
+ * Patches every forward reference with the final value of its expression.
+ * The fixups are sorted by chunk and address (they are mostly generated in
+ * this order anyway), so each chunk's buffer is written front to back in a
+ * single pass. Errors are reported for the line of the offending reference.
+ * If external labels are allowed (see allowExternals()), a reference to a
+ * label that is not defined anywhere is kept in 'externals' instead.
+ */
+int BASSembler6502::resolveFixups()
+{
+    STATS_TIME(fixupTime);
+
+    std::sort(fixups.begin(), fixups.end());
+    externals.clear();
+
+    int size = (int)fixups.size();
+    for(int i=0; i<size; i++)
+    {
+        const Fixup &fixup = fixups[i];
+
+        if(externalLabels && refersToUndefined(fixup))
+        {
+            externals.push_back(fixup);
+            continue;
+        }
+
+        int value;
+        if((Expression::evaluate(&exprTerms[fixup.expr], fixup.terms, symbols, value, asmError.errorString)==-1) || // e.g. a label is not found
+           (applyFixup(chunks[fixup.chunk], fixup.kind, fixup.address, value, asmError)==-1))
         {
-            addressStr = iter->first;
-            uLabel = iter->second;
-            resolvedAddress = labels[addressStr];
-                        
-            if(uLabel.addresses[i].isOneByteAddr) // LDA #<LABEL or LDA #>LABEL
+            setErrorLine(fixup.unit, fixup.line, sourceLine(fixup.unit, fixup.line));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+bool BASSembler6502::refersToUndefined(const Fixup &fixup) const
+{
+    for(unsigned int t=0; t<fixup.terms; t++)
+    {
+        const ExprTerm &term = exprTerms[fixup.expr + t];
+        if((term.op==EXPR_SYMBOL) && !symbols.isDefined((SymbolId)term.value))
+            return true;
+    }
+    return false;
+}
+
+/*
+ * applyFixup()
+ *
+ * Writes the value of a reference into its chunk, as the kind of the
+ * reference (see FixupKind) wants it. Returns 0, or -1 if the value doesn't
+ * fit (the error strings are set, the line is up to the caller).
+ */
+int BASSembler6502::applyFixup(MemChunk &chunk, byte kind, word address, int value, AssemblyError &error)
+{
+    switch(kind)
+    {
+        case FIXUP_LOW: // LDA #<LABEL
+            chunk.rewriteByteAtAddress((byte)(value&0xff), address);
+            break;
+
+        case FIXUP_HIGH: // LDA #>LABEL
+            chunk.rewriteByteAtAddress((byte)((value&0xff00)>>8), address);
+            break;
+
+        case FIXUP_BRANCH: // branching values are relative to the next instruction
+        {
+            int diff = value - address - 1;
+            if(abs(diff) > 127)
             {
-                if(uLabel.addresses[i].isLowPart)
-                    uLabel.addresses[i].memChunk->rewriteByteAtAddress((byte)(resolvedAddress&0xff), uLabel.addresses[i].address);
-                else
-                    uLabel.addresses[i].memChunk->rewriteByteAtAddress((byte)((resolvedAddress&0xff00)>>8), uLabel.addresses[i].address);                
+                error.errorString = "Branch out of range";
+                error.errorStringVerbose = "You can only jump +/-127 bytes with a branch instruction.";
+                return -1;
             }
-            else
+            chunk.rewriteByteAtAddress((byte)(diff&0xff), address);
+            break;
+        }
+
+        case FIXUP_BYTE:
+            if((value<0) || (value>0xff))
             {
-                if(uLabel.addresses[i].isBranch == true) // branching values are handled differently
-                    uLabel.addresses[i].memChunk->rewriteByteAtAddress((byte)(resolvedAddress-uLabel.addresses[i].address-1), uLabel.addresses[i].address);
-                else // normal 16bit addresses are simply overwritten with the resoloved addresses
-                    uLabel.addresses[i].memChunk->rewriteWordAtAddress(labels[addressStr], uLabel.addresses[i].address);
+                stringstream ss;
+                ss << "Value out of range (" << value << "/$" << hex << value << ")";
+                error.errorString = ss.str();
+                error.errorStringVerbose = "Value must fall between 0 and 255/$ff.";
+                return -1;
             }
+            chunk.rewriteByteAtAddress((byte)value, address);
+            break;
+
+        default: // normal 16bit addresses are simply overwritten with the resolved addresses
+            if((value<0) || (value>0xffff))
+            {
+                stringstream ss;
+                ss << "Value out of range (" << value << "/$" << hex << value << ")";
+                error.errorString = ss.str();
+                error.errorStringVerbose = "Address value must fall between 0 and 65535/$ffff.";
+                return -1;
+            }
+            chunk.rewriteWordAtAddress((word)value, address);
+            break;
+    }
+    return 0;
+}
+
+/*
+ * relaxLayout()
+ *
+ * Decides which relaxation sites (see RelaxSite) can be assembled as zero
+ * page. The first pass assembled all of them as absolute, so its label
+ * addresses are the starting point: a label moves down by one byte for each
+ * site before it (in its own chunk) that shrinks.
+ *
+ * Iterates to a fixed point. Each round evaluates only the sites that refer
+ * to a label that moved in the previous round (at first all of them). A site
+ * whose value fits into a byte shrinks, a zero page site whose value has
+ * grown past $FF goes back to absolute and is pinned there. Since a site can
+ * change at most twice, this always ends. The label addresses in the symbol
+ * table are updated as the layout changes.
+ *
+ * Returns true if any site ended up as zero page, that is, if the first
+ * pass has to be redone.
+ */
+bool BASSembler6502::relaxLayout()
+{
+    unsigned int siteTotal = (unsigned int)sites.size();
+    unsigned int symbolTotal = symbols.size();
+    labelFirstSite.resize(symbolTotal); // labels that were only referenced have no entry yet
+    labelSite.resize(symbolTotal);
+
+    // the labels that can move, with their first pass addresses
+    vector<SymbolId> movable;
+    vector<word> firstAddress(symbolTotal);
+    for(SymbolId id=0; id<symbolTotal; id++)
+    {
+        if(symbols.isDefined(id) && (labelSite[id]>labelFirstSite[id]))
+        {
+            movable.push_back(id);
+            firstAddress[id] = symbols.address(id);
         }
-        
-        if( labels[iter->first] == 0 ) // if searched label is not found...
+    }
+
+    // which sites refer to which label: one flat array, sliced by label
+    vector<unsigned int> dependentStart(symbolTotal+1, 0);
+    for(unsigned int i=0; i<siteTotal; i++)
+        for(unsigned int t=0; t<sites[i].terms; t++)
+            if(siteTerms[sites[i].expr+t].op==EXPR_SYMBOL)
+                dependentStart[siteTerms[sites[i].expr+t].value+1]++;
+    for(SymbolId id=0; id<symbolTotal; id++)
+        dependentStart[id+1] += dependentStart[id];
+
+    vector<unsigned int> dependents(dependentStart[symbolTotal]);
+    vector<unsigned int> fill(dependentStart.begin(), dependentStart.end()-1);
+    for(unsigned int i=0; i<siteTotal; i++)
+        for(unsigned int t=0; t<sites[i].terms; t++)
+            if(siteTerms[sites[i].expr+t].op==EXPR_SYMBOL)
+                dependents[fill[siteTerms[sites[i].expr+t].value]++] = i;
+
+    vector<unsigned int> work(siteTotal), next;
+    vector<bool> queued(siteTotal, false);
+    for(unsigned int i=0; i<siteTotal; i++)
+        work[i] = i;
+
+    vector<unsigned int> shrunk(siteTotal+1); // number of zero page sites before each site
+    bool anyZeroPage = false;
+    while(!work.empty())
+    {
+        bool changed = false;
+        for(unsigned int w=0; w<work.size(); w++)
+        {
+            RelaxSite &site = sites[work[w]];
+            queued[work[w]] = false;
+            if(site.pinned)
+                continue;
+
+            int value;
+            string error;
+            if(Expression::evaluate(&siteTerms[site.expr], site.terms, symbols, value, error)==-1)
+            {
+                site.pinned = true; // stays absolute, the error is reported when the fixups are resolved
+                continue;
+            }
+
+            bool fits = (value>=0) && (value<0x100);
+            if(!site.zeroPage && fits)
+            {
+                site.zeroPage = true;
+                changed = true;
+            }
+            else if(site.zeroPage && !fits)
+            {
+                site.zeroPage = false;
+                site.pinned = true;
+                changed = true;
+            }
+        }
+        if(!changed)
+            break;
+
+        // move the labels, and queue the sites that refer to the ones that moved
+        anyZeroPage = false;
+        shrunk[0] = 0;
+        for(unsigned int i=0; i<siteTotal; i++)
+        {
+            shrunk[i+1] = shrunk[i] + (sites[i].zeroPage ? 1 : 0);
+            anyZeroPage |= sites[i].zeroPage;
+        }
+
+        next.clear();
+        for(unsigned int m=0; m<movable.size(); m++)
+        {
+            SymbolId id = movable[m];
+            word address = firstAddress[id] - (word)(shrunk[labelSite[id]] - shrunk[labelFirstSite[id]]);
+            if(address==symbols.address(id))
+                continue;
+
+            symbols.define(id, address);
+            for(unsigned int d=dependentStart[id]; d<dependentStart[id+1]; d++)
+            {
+                if(!queued[dependents[d]])
+                {
+                    queued[dependents[d]] = true;
+                    next.push_back(dependents[d]);
+                }
+            }
+        }
+        work.swap(next);
+    }
+
+    return anyZeroPage;
+}
+
+/*
+ * closeChunk()
+ *
+ * Called when the current chunk is finished (new .pc or end of source).
+ * Since every chunk lives in the same memory image, a chunk that overlaps
+ * an earlier one would overwrite its content, so this is an error.
+ */
+int BASSembler6502::closeChunk()
+{
+    int size = (int)chunks.size()-1; // the last chunk is the current one
+    for(int i=0; i<size; i++)
+    {
+        const MemChunk &chunk = chunks[i];
+        if((chunk.length==0) || (actChunk->length==0))
+            continue;
+
+        if((actChunk->startAddress < chunk.endAddress()) && (chunk.startAddress < actChunk->endAddress()))
         {
-            asmError.errorString = "Unresolved label definition '" + iter->first + "'";
-            asmError.errorLineNumber = iter->second.line;
-            asmError.lineContent = lines[iter->second.line-1];
+            stringstream ss;
+            ss << "Overlapping memory blocks: $" << hex << actChunk->startAddress << "-$" << actChunk->endAddress()-1
+               << " and $" << chunk.startAddress << "-$" << chunk.endAddress()-1;
+            asmError.errorString = ss.str();
+            asmError.errorStringVerbose = "Each .pc block must occupy its own address range.";
             return -1;
         }
     }
- 
-    // assembly's done, preparing to return the binary data in the correct form.
-	// we make a new vector of chunks with the copy of the local vector
-	chunks = new vector<MemChunk>(this->chunks);
-	return 0;
+
+    return 0;
+}
+
+/*
+ * checkRoom()
+ *
+ * Checks if 'bytes' more bytes fit in the current chunk before $FFFF.
+ * Instructions rely on the per line check in assemble() instead.
+ */
+int BASSembler6502::checkRoom(unsigned int bytes)
+{
+    if(actChunk->endAddress() + bytes > MEMORY_SIZE)
+    {
+        asmError.errorString = "Address out of range";
+        asmError.errorStringVerbose = "The code must not run past $FFFF.";
+        return -1;
+    }
+    return 0;
 }
 
 /*
@@ -113,20 +747,23 @@ int BASSembler6502::assemble(char *source, vector<MemChunk> *&chunks) // source
  * and executes the command associated for the given directive.
  *
  */
-int BASSembler6502::checkDirectives(string &line)
+int BASSembler6502::checkDirectives(string_view &line, unsigned int lineNumber)
 {
-	if(!searchDirective->FullMatch(line)) // check string against our regex
+	STATS_TIME(directiveTime);
+
+	bool isDot = (tokens[0].type==TOK_OPERATOR) && (tokens[0].op=='.');
+	if((tokens[0].type!=TOK_DIRECTIVE) && !isDot)
 		return 1; // no directive found
 	
-	string keyword;
-	if(!extractKeyword->FullMatch(line, &keyword))
+	if(isDot)
 	{
 		asmError.errorString = "Syntax error";
 		asmError.errorStringVerbose = "'.' must be followed by a valid keyword.\n"
-									  "Valid keywords are: .pc, .byte, .word, .text, .ascii, .petscii, .screen";
+									  "Valid keywords are: .pc, .byte, .word, .text, .ascii, .petscii, .screen, .fill, .res, .include, .incbin, .charset, .macro, .rept";
 		return -1;
 	}
 	
+	string keyword(line.substr(tokens[0].start, tokens[0].length));
     std::transform(keyword.begin(), keyword.end(), keyword.begin(), ::tolower);
     
     // ----------------------------------------------------------------------------
@@ -134,9 +771,11 @@ int BASSembler6502::checkDirectives(string &line)
     // ----------------------------------------------------------------------------
 	if(keyword=="text") // what about a '.text0'? actually it can be easily simulated...
 	{
-        // get whole line after directive excluding optional white space and quotation marks
-		string dataString;
-		if(!getDataElements2->FullMatch(line, &dataString))
+        // get whole line after directive excluding white space and quotation marks:
+        // the text runs from the first quotation mark to the last one, which has to end the line
+		string_view quoted = line.substr(tokens[0].start + tokens[0].length);
+		size_t quote = quoted.find_first_not_of(" \t\r\v\f");
+		if((quote==0) || (quote==string_view::npos) || (quoted[quote]!='"') || (quoted.size()-quote<2) || (quoted.back()!='"'))
 		{
 			asmError.errorString = "Syntax error";
 			asmError.errorStringVerbose = "Valid syntax for .text directive: .text \"your text here\"\n"
@@ -144,6 +783,7 @@ int BASSembler6502::checkDirectives(string &line)
             "Note: comments are not allowed after a .text directive.";
 			return -1;
 		}
+		string dataString(quoted.substr(quote+1, quoted.size()-quote-2));
 		
 		string cleanString;
 		int size = (int)dataString.length();
@@ -185,24 +825,33 @@ int BASSembler6502::checkDirectives(string &line)
         }
         
 		size = (int)cleanString.size();
-		for(int s=0; s<size; s++)
+		if(checkRoom(size)==-1)
+			return -1;
+
+		byte *dest = actChunk->reserve(size);
+		if(charset->translate((const byte *)cleanString.data(), dest, size))
 		{
-			if( charset == SCREENSCII )
-				actChunk->addByte((byte)findChar(screenChars, cleanString[s]));
-			else if( charset == PETSCII )
-				actChunk->addByte((byte)findChar(petsciiChars, cleanString[s]));
-			else if( charset == ASCII )
-				actChunk->addByte(cleanString[s]);
-			actAddress++;
+			// look for the first character that has no code, only to report it
+			int s = 0;
+			while(!charset->unmappable[(byte)cleanString[s]])
+				s++;
+
+			stringstream ss;
+			ss << "Character cannot be converted to " << charset->name << ": '" << cleanString[s]
+			   << "' ($" << hex << (int)(byte)cleanString[s] << ")";
+			asmError.errorString = ss.str();
+			asmError.errorStringVerbose = "Switch character sets with .ascii, .petscii, .screen or load your own with .charset \"file\"";
+			return -1;
 		}
-		
+		actAddress += size;
+
 		return 0;
 	}
 // ----------------------------------------------------------------------------
 	if(keyword=="ascii")
 	{
 		//cout << "Switching to ASCII" << endl;
-		charset = ASCII;
+		charset = &asciiCharset;
         
 		return 0;		
 	}
@@ -210,27 +859,135 @@ int BASSembler6502::checkDirectives(string &line)
 	if(keyword=="petscii")
 	{
 		//cout << "Switching to PETSCII" << endl;
-		charset = PETSCII;
+		charset = &petsciiCharset;
 		
 		return 0;		
 	}
 // ----------------------------------------------------------------------------
 	if(keyword=="screen")
 	{
-		//cout << "Switching to PETSCII" << endl;
-		charset = SCREENSCII;
+		//cout << "Switching to screen codes" << endl;
+		charset = &screenCharset;
 		
 		return 0;
 	}
 
-    remove_comments->GlobalReplace("", &line); // at this point it's safe to remove comments.
+    line = line.substr(0, tokens.back().start); // at this point it's safe to remove comments (the end token marks where they begin)
+    trimLine(line);
+// ----------------------------------------------------------------------------
+// .INCLUDE found
+// ----------------------------------------------------------------------------
+	if(keyword == "include")
+	{
+		if(!((tokens[1].type==TOK_STRING) && (tokens[1].length>0) && (tokens[2].type==TOK_END)))
+		{
+			asmError.errorString = "Syntax error";
+			asmError.errorStringVerbose = "correct .include format: .include \"file.asm\"";
+			return -1;
+		}
+
+		unsigned int unit;
+		if(loadUnit(line.substr(tokens[1].start, tokens[1].length), unit)==-1)
+			return -1;
+
+		if(units[unit]->active)
+		{
+			asmError.errorString = "Recursive include: " + units[unit]->name;
+			return -1;
+		}
+
+		if(!units[unit]->tokenized)
+			tokenizeUnit(units[unit]);
+
+		return assembleUnit(unit);
+	}
+
+// ----------------------------------------------------------------------------
+// .INCBIN found
+// ----------------------------------------------------------------------------
+	if(keyword == "incbin")
+	{
+		// .incbin "file" or .incbin "file", offset or .incbin "file", offset, length
+		bool hasFile = (tokens[1].type==TOK_STRING) && (tokens[1].length>0); // checked first, so we never look past the end token
+		bool hasOffset = hasFile && (tokens[2].type==TOK_OPERATOR) && (tokens[2].op==',') && (tokens[3].type==TOK_NUMBER);
+		bool hasLength = hasOffset && (tokens[4].type==TOK_OPERATOR) && (tokens[4].op==',') && (tokens[5].type==TOK_NUMBER);
+		int end = hasLength ? 6 : (hasOffset ? 4 : 2);
+		if(!(hasFile && (tokens[end].type==TOK_END)))
+		{
+			asmError.errorString = "Syntax error";
+			asmError.errorStringVerbose = "correct .incbin format: .incbin \"file.bin\"[, offset[, length]]";
+			return -1;
+		}
+
+        if(actChunk==NULL)
+        {
+            asmError.errorString = "Instruction reached without address specification";
+            asmError.errorStringVerbose = "Specify a starting address with the .pc directive.";
+            return -1;
+        }
+
+		unsigned int unit;
+		if(loadUnit(line.substr(tokens[1].start, tokens[1].length), unit)==-1)
+			return -1;
+
+		string_view data = units[unit]->text;
+		size_t offset = hasOffset ? (size_t)tokens[3].value : 0;
+		if(offset>data.size())
+		{
+			asmError.errorString = "Offset out of range: " + string(line.substr(tokens[3].start, tokens[3].length));
+			asmError.errorStringVerbose = "The offset must not be larger than the size of the file.";
+			return -1;
+		}
+
+		size_t length = hasLength ? (size_t)tokens[5].value : data.size() - offset;
+		if(length>data.size()-offset)
+		{
+			asmError.errorString = "Length out of range: " + string(line.substr(tokens[5].start, tokens[5].length));
+			asmError.errorStringVerbose = "The included range must fit into the file.";
+			return -1;
+		}
+
+		if(checkRoom((length>MEMORY_SIZE) ? MEMORY_SIZE+1 : (unsigned int)length)==-1)
+			return -1;
+
+		actChunk->addBytes((const byte *)data.data() + offset, (unsigned int)length); // straight from the mapping into the image
+		actAddress += (word)length;
+		return 0;
+	}
+
+// ----------------------------------------------------------------------------
+// .CHARSET found
+// ----------------------------------------------------------------------------
+	if(keyword == "charset")
+	{
+		if(!((tokens[1].type==TOK_STRING) && (tokens[1].length>0) && (tokens[2].type==TOK_END)))
+		{
+			asmError.errorString = "Syntax error";
+			asmError.errorStringVerbose = "correct .charset format: .charset \"file\"";
+			return -1;
+		}
+
+		unsigned int unit;
+		if(loadUnit(line.substr(tokens[1].start, tokens[1].length), unit)==-1)
+			return -1;
+
+		string error;
+		if(userCharset.load(units[unit]->text, error)==-1)
+		{
+			asmError.errorString = error + " (" + units[unit]->name + ")";
+			return -1;
+		}
+
+		charset = &userCharset;
+		return 0;
+	}
+
 // ----------------------------------------------------------------------------
 // .PC found
 // ----------------------------------------------------------------------------
 	if(keyword == "pc")
 	{
-		string address;
-		if(!extractMemoryAddress->FullMatch(line, &address))
+		if(!((tokens[1].type==TOK_OPERATOR) && (tokens[1].op=='=') && (tokens[2].type==TOK_NUMBER) && (tokens[3].type==TOK_END)))
 		{
 			asmError.errorString = "Syntax error";
 			asmError.errorStringVerbose =	"correct .pc format: .pc = ${Addr}, "
@@ -239,13 +996,11 @@ int BASSembler6502::checkDirectives(string &line)
 			return -1;
 		}
 		
-		unsigned int addressNum;
-        // TODO: convert regex to class member variable!
-		pcrecpp::RE("(.+)").FullMatch("0x"+address, pcrecpp::Hex(&addressNum)); // convert hex to dec
+		int addressNum = tokens[2].value; // the lexer has already converted the number
 		
 		if(addressNum>65535) // check if a valid (<64K) address was specified
 		{
-			asmError.errorString = "Address out of range: $" + address;
+			asmError.errorString = "Address out of range: " + string(line.substr(tokens[2].start, tokens[2].length));
 			asmError.errorStringVerbose = "Address must be in range $0-$FFFF.";
 			return -1;
 		}
@@ -253,22 +1008,14 @@ int BASSembler6502::checkDirectives(string &line)
 		// at this point the directive syntax is processed, executing action
 		actAddress = (word)addressNum;
 
-		// in case this is the first time we set .pc and the actChunk is still non-existent,
-		// then we don't need to push it into the chunks vector.
-		if(actChunk==NULL) // begin new chunk
-		{
-            //cout << "first chunk created..." << endl;
-			actChunk = new MemChunk();
-			actChunk->startAddress = actAddress;
-			return 0;
-		}
+		// finish old chunk (if any)
+		if((actChunk!=NULL) && (closeChunk()==-1))
+			return -1;
 
-		// finish old chunk
-		actChunk->finalize(); // it's important not to forget this
-		chunks.push_back(*actChunk); // TODO: i hope that the vector keeps a COPY of the pointer to this object...
-		actChunk = new MemChunk();
-		actChunk->startAddress = actAddress;
-        //cout << "new chunk created..." << endl;
+		// begin new chunk
+		chunks.push_back(MemChunk(memory, actAddress));
+		actChunk = &chunks.back(); // only the last element is pointed to, so reallocating the vector does no harm
+		chunkFirstSite = siteCount;
 		
 		return 0;
 	}
@@ -278,41 +1025,30 @@ int BASSembler6502::checkDirectives(string &line)
 // ----------------------------------------------------------------------------
 	if((keyword == "byte") || (keyword == "word"))
 	{
-		string dataString;
-		getDataElements->FullMatch(line, &dataString);
-		
-		pcrecpp::StringPiece input(dataString);
-		vector<string> values;
-		string actValue;
-		while(getSingleElement->Consume(&input, &actValue)) // loop through all values in row
-			values.push_back(actValue);
+        if(actChunk==NULL)
+        {
+            asmError.errorString = "Instruction reached without address specification";
+            asmError.errorStringVerbose = "Specify a starting address with the .pc directive.";
+            return -1;
+        }
 
-		// this is not a mistake. it's here to check the _last_ element, after which a ',' is not accepted
-		if(getLastElement->Consume(&input, &actValue))
-			values.push_back(actValue);
+		// the values are scanned straight from the line, everything after the keyword
+		return assembleData(line.substr(tokens[0].start + tokens[0].length), (keyword=="word") ? 2 : 1);
+	}
 
-		// error check: see if the number of commas+1 is equal to the number of extracted data elements.
-		if((countChars(line, ',')+1) != (int)values.size()) // if not, there was a processing error
+// ----------------------------------------------------------------------------
+// .FILL or .RES found
+// ----------------------------------------------------------------------------
+	if((keyword == "fill") || (keyword == "res"))
+	{
+		// .fill count or .fill count, value (the same for .res)
+		bool hasCount = (tokens[1].type==TOK_NUMBER);
+		bool hasValue = hasCount && (tokens[2].type==TOK_OPERATOR) && (tokens[2].op==',') && (tokens[3].type==TOK_NUMBER);
+		int end = hasValue ? 4 : 2;
+		if(!(hasCount && (tokens[end].type==TOK_END)))
 		{
-			asmError.errorString = "Invalid number format";
-			asmError.errorStringVerbose = "Data must be in one of the following three formats:\n";
-
-			if(keyword=="byte")
-			{
-				asmError.errorStringVerbose += "- decimal: {X}, {X}=>[0,255] (no leading character before numerical characters)\n";
-				asmError.errorStringVerbose += "- hexadecimal: ${Y}, Y=>[0,FF] (leading '$')\n";			
-				asmError.errorStringVerbose += "- binary: %{ZZZZZZZZ}, {Z}=>[0,1], value in decimal must be in [0,255], (leading '%')";
-			}
-			if(keyword=="word")
-			{
-				asmError.errorStringVerbose += "- decimal: {X}, {X}=>[0,65535] (no extra leading character before numerical characters)\n";
-				asmError.errorStringVerbose += "- hexadecimal: ${Y}, Y=>[0,FFFF] (leading '$')\n";			
-				asmError.errorStringVerbose += "- binary: %{ZZZZZZZZZZZZZZZZ}, {Z}=>[0,1], value in decimal must be in [0,65535], "
-												"(leading '%')";
-			}
-			
-			asmError.errorStringVerbose += "Different data formats are allowed on a single line. "
-											"Comma as delimiting character is obligatory.";
+			asmError.errorString = "Syntax error";
+			asmError.errorStringVerbose = "correct ." + keyword + " format: ." + keyword + " count[, value]";
 			return -1;
 		}
 
@@ -323,129 +1059,596 @@ int BASSembler6502::checkDirectives(string &line)
             return -1;
         }
 
-		// at this point we have all the data elements stored in string format in a <vector>.
-		// we need to convert them into decimal format (if needed) and store them into "memory"
-		int size = (int)values.size();
-		int valueInDecimal;
-		string tempValue = "";
-		
-		for(int i=0; i<size; i++) // TODO: you SHOULD convert these RegExps into member variables
-		{   
-			if(pcrecpp::RE("\\d+\\d*").FullMatch(values[i])) // check if decimal
-			{
-				valueInDecimal = atoi(values[i].c_str());
-			}
-			else if( pcrecpp::RE( "\\$([0-9a-f]+)" ).FullMatch(values[i], &tempValue) ) // check if hexa
-			{
-				valueInDecimal = (int)strtol(tempValue.c_str(), NULL, 16);
-			}
-			else if ( pcrecpp::RE( "%([0|1]+)" ).FullMatch(values[i], &tempValue) ) // check if binary
-			{
-				valueInDecimal = (int)strtol(tempValue.c_str(), NULL, 2);
-			}
-			else // should not get here ever, but to be sure, here's an error message
-			{
-				asmError.errorString = "Internal error (1)";
-				return -1;
-			}
+		int value = hasValue ? tokens[3].value : 0;
+		if(value>255)
+		{
+			asmError.errorString = "Value out of range: " + string(line.substr(tokens[3].start, tokens[3].length));
+			asmError.errorStringVerbose = "Value must fit into 8 bits. $0-$FF or 0-255 or %0-%11111111.";
+			return -1;
+		}
 
-			// range checks
-			if(keyword=="byte")
-			{
-				if((valueInDecimal > 255) || (valueInDecimal < 0)) // check range
-				{
-					asmError.errorString = "Value out of range: " + values[i];
-					asmError.errorStringVerbose = "Value must fit into 8 bits. $0-$FF or 0-255 or %0-%11111111.";
-					return -1;
-				}
-				actChunk->addByte((byte)valueInDecimal);
-				actAddress++;
-			}
-			if(keyword=="word")
-			{
-				if((valueInDecimal > 65535) || (valueInDecimal < 0)) // check range
-				{
-					asmError.errorString = "Value out of range: " + values[i];
-					asmError.errorStringVerbose = "Value must fit into 16 bits. $0-$FFFF or 0-65535 or %0-%1111111111111111.";
-					return -1;
-				}
-				actChunk->addWord((byte)valueInDecimal);
-				actAddress+=2;
-			}
-		}		
+		unsigned int count = (unsigned int)tokens[1].value; // the lexer saturates, so this can't wrap around
+		if(checkRoom(count)==-1)
+			return -1;
 
+		memset(actChunk->reserve(count), value, count);
+		actAddress += (word)count;
 		return 0;
 	}
-	
+
+// ----------------------------------------------------------------------------
+// .MACRO or .REPT found
+// ----------------------------------------------------------------------------
+	if((keyword == "macro") || (keyword == "rept"))
+		return startRecording(line, lineNumber, keyword);
+
+	if((keyword == "endm") || (keyword == "endr"))
+	{
+		asmError.errorString = "'." + keyword + "' without " + ((keyword=="endm") ? "'.macro'" : "'.rept'");
+		return -1;
+	}
+
 // ----------------------------------------------------------------------------
 	asmError.errorString = "Unrecognized directive '." + keyword + "'";
-	asmError.errorStringVerbose = "Recognized keywords: .pc, .byte, .word, .text, .ascii, .petscii, .screen";
+	asmError.errorStringVerbose = "Recognized keywords: .pc, .byte, .word, .text, .ascii, .petscii, .screen, .fill, .res, .include, .incbin, .charset, .macro, .rept";
 	return -1;
 }
 
 // ----------------------------------------------------------------------------
-int BASSembler6502::detectLabelDefinition(string line) // 7815772, 821250366 <- kathrin's numbers
+// value of a hexadecimal digit, 16 if it's not a digit at all
+static inline int digitValue(char c)
 {
-    remove_comments->GlobalReplace("", &line);
-    
-    if(isEmptyLine->FullMatch(line))  // without any processing
+	if((c>='0') && (c<='9'))
+		return c - '0';
+	if((c>='a') && (c<='f'))
+		return c - 'a' + 10;
+	if((c>='A') && (c<='F'))
+		return c - 'A' + 10;
+	return 16;
+}
+
+/*
+ * assembleData()
+ *
+ * Assembles the values of a .byte (size 1) or .word (size 2) line. The
+ * numbers are scanned in place, one pass over the text, and each value is
+ * written straight into the memory image behind the current chunk. The
+ * chunk only grows once the whole line turned out to be valid.
+ */
+int BASSembler6502::assembleData(string_view data, int size)
+{
+	const char *text = data.data();
+	int length = (int)data.length();
+	int maxValue = (size==2) ? 0xffff : 0xff;
+	unsigned int room = MEMORY_SIZE - actChunk->endAddress();
+	byte *dest = actChunk->data + actChunk->length;
+	unsigned int count = 0;
+
+	int i = 0;
+	for(;;)
+	{
+		while((i<length) && isspace((unsigned char)text[i]))
+			i++;
+
+		int start = i;
+		int base = 10;
+		if((i<length) && (text[i]=='$'))
+		{
+			base = 16;
+			i++;
+		}
+		else if((i<length) && (text[i]=='%'))
+		{
+			base = 2;
+			i++;
+		}
+
+		int value = 0;
+		int digitStart = i;
+		int digit;
+		while((i<length) && ((digit = digitValue(text[i])) < base))
+		{
+			if(value<=maxValue) // stop accumulating once it's out of range anyway
+				value = value*base + digit;
+			i++;
+		}
+
+		if(i==digitStart) // no number here
+			break;
+
+		if(value>maxValue)
+		{
+			asmError.errorString = "Value out of range: " + string(data.substr(start, i-start));
+			asmError.errorStringVerbose = (size==2) ?
+				"Value must fit into 16 bits. $0-$FFFF or 0-65535 or %0-%1111111111111111." :
+				"Value must fit into 8 bits. $0-$FF or 0-255 or %0-%11111111.";
+			return -1;
+		}
+
+		if(count+size > room)
+			return checkRoom(count+size); // sets the error
+
+		dest[count] = (byte)value;
+		if(size==2)
+			dest[count+1] = (byte)(value>>8);
+		count += size;
+
+		while((i<length) && isspace((unsigned char)text[i]))
+			i++;
+
+		if(i==length) // all values done
+		{
+			actChunk->reserve(count);
+			actAddress += (word)count;
+			return 0;
+		}
+
+		if(text[i]!=',')
+			break;
+		i++;
+	}
+
+	asmError.errorString = "Invalid number format";
+	asmError.errorStringVerbose = "Data must be in one of the following three formats:\n";
+	if(size==1)
+	{
+		asmError.errorStringVerbose += "- decimal: {X}, {X}=>[0,255] (no leading character before numerical characters)\n";
+		asmError.errorStringVerbose += "- hexadecimal: ${Y}, Y=>[0,FF] (leading '$')\n";
+		asmError.errorStringVerbose += "- binary: %{ZZZZZZZZ}, {Z}=>[0,1], value in decimal must be in [0,255], (leading '%')\n";
+	}
+	else
+	{
+		asmError.errorStringVerbose += "- decimal: {X}, {X}=>[0,65535] (no extra leading character before numerical characters)\n";
+		asmError.errorStringVerbose += "- hexadecimal: ${Y}, Y=>[0,FFFF] (leading '$')\n";
+		asmError.errorStringVerbose += "- binary: %{ZZZZZZZZZZZZZZZZ}, {Z}=>[0,1], value in decimal must be in [0,65535], "
+										"(leading '%')\n";
+	}
+	asmError.errorStringVerbose += "Different data formats are allowed on a single line. "
+									"Comma as delimiting character is obligatory.";
+	return -1;
+}
+
+// ----------------------------------------------------------------------------
+int BASSembler6502::detectLabelDefinition(string_view line) // 7815772, 821250366 <- kathrin's numbers
+{
+    STATS_TIME(labelTime);
+
+    if(tokens[0].type==TOK_END)  // empty line or comment only
         return 0;
     
-    // convert whole line into upper case
-    std::transform(line.begin(), line.end(), line.begin(), ::toupper);
-    
     // handle label definition
-    string labelCandidate;
-    string textAfterLabel;
-	if (detectLabelDef->FullMatch(line, &labelCandidate, &textAfterLabel)) // check if there's a : in the line.
-    {                                                    // that indicates a label definition
-        string label;
-        if (detectLabelDefCorrectness->FullMatch(line, &label))             // if yes, register it
-        {                                                
-            //cout << "label detected: " << label << endl;
-            if( labels[label] != 0 )
-            {
-                asmError.errorString = "Label already defined: " + label;
-                return -1;
-            }
-            labels[label] = actAddress;
-            if(textAfterLabel=="")
+	if (tokens[0].type==TOK_LABELDEF) // the lexer found a legal label followed by a colon
+    {
+        SymbolId label = symbols.intern(line.data() + tokens[0].start, tokens[0].length);
+        //cout << "label detected: " << symbols.name(label) << endl;
+        if( symbols.isDefined(label) )
+        {
+            asmError.errorString = "Label already defined: " + symbols.name(label);
+            return -1;
+        }
+        if(optimize)
+            dropJumpTo(label);
+        symbols.define(label, actAddress);
+        if(!finalPass) // remember which sites come before the label in its chunk
+        {
+            if(labelSite.size()<symbols.size())
             {
-                return 0;
+                labelFirstSite.resize(symbols.size());
+                labelSite.resize(symbols.size());
             }
-            else
-                return 1; // return value of 1 means no related content detected
+            labelFirstSite[label] = chunkFirstSite;
+            labelSite[label] = siteCount;
         }
-        else // label definition was found, but label was defined incorrectly 
+        labelCount++;
+        STATS_COUNT(labels, 1);
+        if(tokens[1].type==TOK_END)
         {
-            asmError.errorString = "Incorrect label definition: " + labelCandidate;
-            asmError.errorStringVerbose = "Labels must start with an alphanumeric character. "
-            "See documentation for detailed rules.";
-            return -1;
+            return 0;
         }
+        else
+            return 1; // return value of 1 means no related content detected
+    }
+    
+    // a colon within the first word indicates a label definition, but the label was defined incorrectly
+    int wordEnd = 0, colon = -1;
+    int commentStart = tokens.back().start;
+    while((wordEnd<commentStart) && !isspace((unsigned char)line[wordEnd]))
+    {
+        if(line[wordEnd]==':')
+            colon = wordEnd;
+        wordEnd++;
+    }
+    if(colon>=0)
+    {
+        asmError.errorString = "Incorrect label definition: " + upperCase(line.substr(0, colon));
+        asmError.errorStringVerbose = "Labels must start with an alphanumeric character. "
+        "See documentation for detailed rules.";
+        return -1;
     }
     
     return 1; // return value of 1 means no related content detected
 }
 
 // ----------------------------------------------------------------------------
-int BASSembler6502::assembleLine(string line, unsigned int lineNumber) // 7815772, 821250366 <- kathrin's numbers
+// the text of a token as it is in the line: with the dot of a directive and the quotes of a string
+static inline int tokenBegin(const Token &token)
+{
+	return ((token.type==TOK_DIRECTIVE) || (token.type==TOK_STRING)) ? token.start-1 : token.start;
+}
+
+static inline int tokenEnd(const Token &token)
+{
+	return (token.type==TOK_STRING) ? token.start+token.length+1 : token.start+token.length;
+}
+
+/*
+ * startRecording()
+ *
+ * Opens a .macro or .rept block. The lines up to the matching .endm or .endr
+ * are collected by recordLine() instead of being assembled.
+ *
+ *     .macro name[ param[, param...]]      .rept count
+ *     ...                                  ...
+ *     .endm                                .endr
+ */
+int BASSembler6502::startRecording(string_view line, unsigned int lineNumber, const string &keyword)
+{
+	recordingName.clear();
+	recordingParams.clear();
+	recordingCount = 0;
+
+	if(keyword=="rept")
+	{
+		if(!((tokens[1].type==TOK_NUMBER) && (tokens[2].type==TOK_END)))
+		{
+			asmError.errorString = "Syntax error";
+			asmError.errorStringVerbose = "correct .rept format: .rept count, the lines to repeat, then .endr";
+			return -1;
+		}
+		if(tokens[1].value>REPT_MAX_COUNT)
+		{
+			asmError.errorString = "Repeat count out of range: " + string(line.substr(tokens[1].start, tokens[1].length));
+			asmError.errorStringVerbose = "The count must be between 0 and 65536.";
+			return -1;
+		}
+		recordingCount = tokens[1].value;
+	}
+	else
+	{
+		bool valid = (tokens[1].type==TOK_LABEL);
+		int t = 2;
+		while(valid && (tokens[t].type!=TOK_END))
+		{
+			if((t>2) && !isOperator(tokens[t++], ','))
+				valid = false;
+			else if(tokens[t].type!=TOK_LABEL)
+				valid = false;
+			else
+			{
+				recordingParams.push_back(upperCase(line.substr(tokens[t].start, tokens[t].length)));
+				t++;
+			}
+		}
+		if(!valid)
+		{
+			asmError.errorString = "Syntax error";
+			asmError.errorStringVerbose = "correct .macro format: .macro name[ param[, param...]], the body, then .endm";
+			return -1;
+		}
+
+		recordingName = upperCase(line.substr(tokens[1].start, tokens[1].length));
+		if(findOpcode(recordingName.data(), (int)recordingName.length()).name[0]!=0)
+		{
+			asmError.errorString = "Macro name is an instruction: " + recordingName;
+			return -1;
+		}
+		if(macroNames.count(recordingName))
+		{
+			asmError.errorString = "Macro already defined: " + recordingName;
+			return -1;
+		}
+		if(recordingParams.size()>MACRO_MAX_PARAMS)
+		{
+			asmError.errorString = "Too many macro parameters";
+			asmError.errorStringVerbose = "A macro can have up to 32 parameters.";
+			return -1;
+		}
+		for(size_t i=0; i<recordingParams.size(); i++)
+		{
+			if((recordingParams[i]=="X") || (recordingParams[i]=="Y"))
+			{
+				asmError.errorString = "Invalid macro parameter: " + recordingParams[i];
+				asmError.errorStringVerbose = "X and Y are the index registers.";
+				return -1;
+			}
+			for(size_t j=0; j<i; j++)
+			{
+				if(recordingParams[i]==recordingParams[j])
+				{
+					asmError.errorString = "Duplicate macro parameter: " + recordingParams[i];
+					return -1;
+				}
+			}
+		}
+	}
+
+	recording = new Macro();
+	recording->paramCount = (unsigned int)recordingParams.size();
+	recording->lineStart.push_back(0);
+	recording->lineTokens.push_back(0);
+	recordingDepth = 0;
+	recordingUnit = actUnit;
+	recordingLine = lineNumber;
+	recordingNesting = expansionNesting;
+	return 0;
+}
+
+/*
+ * recordLine()
+ *
+ * Adds a line to the block being read, or closes the block if it is the
+ * matching .endm or .endr. Blocks inside the block are only counted, they
+ * are opened when the body is expanded.
+ */
+int BASSembler6502::recordLine(string_view line)
+{
+	// the body keeps every token, the values of .byte and .word included, so parameters can be found anywhere
+	Lexer6502::tokenizeLine(line, tokens, true);
+
+	if(tokens[0].type==TOK_DIRECTIVE)
+	{
+		string keyword(line.substr(tokens[0].start, tokens[0].length));
+		std::transform(keyword.begin(), keyword.end(), keyword.begin(), ::tolower);
+		if((keyword=="macro") || (keyword=="rept"))
+			recordingDepth++;
+		else if((keyword=="endm") || (keyword=="endr"))
+		{
+			if(recordingDepth==0)
+				return finishRecording(keyword);
+			recordingDepth--;
+		}
+	}
+
+	Macro *body = recording;
+	for(size_t i=0; i<tokens.size(); i++)
+	{
+		int param = -1;
+		if(((tokens[i].type==TOK_LABEL) || (tokens[i].type==TOK_LABELDEF)) && !recordingParams.empty())
+		{
+			string name = upperCase(line.substr(tokens[i].start, tokens[i].length));
+			for(size_t p=0; (p<recordingParams.size()) && (param<0); p++)
+				if(name==recordingParams[p])
+					param = (int)p;
+		}
+		body->param.push_back((signed char)param);
+	}
+	body->tokens.insert(body->tokens.end(), tokens.begin(), tokens.end());
+	body->lineTokens.push_back((unsigned int)body->tokens.size());
+	body->text.append(line);
+	body->lineStart.push_back((unsigned int)body->text.size());
+	return 0;
+}
+
+/*
+ * finishRecording()
+ *
+ * Closes the block being read: a macro is stored under its name, a .rept
+ * block is expanded right away and dropped.
+ */
+int BASSembler6502::finishRecording(const string &keyword)
+{
+	Macro *body = recording;
+	recording = NULL;
+
+	bool isMacro = !recordingName.empty();
+	if(keyword!=(isMacro ? "endm" : "endr"))
+	{
+		delete body;
+		asmError.errorString = "Syntax error";
+		asmError.errorStringVerbose = isMacro ? "A .macro block must be closed with .endm." : "A .rept block must be closed with .endr.";
+		return -1;
+	}
+
+	if(isMacro)
+	{
+		macroNames[recordingName] = (unsigned int)macros.size();
+		macros.push_back(body);
+		return 0;
+	}
+
+	// errors in the repeated lines are reported for the .rept line
+	int result = expandBody(*body, recordingCount, recordingLine);
+	delete body;
+	return result;
+}
+
+/*
+ * expandMacro()
+ *
+ * Expands a macro invoked by the mnemonic token 't': name[ arg[, arg...]].
+ * An argument is whatever stands between the commas (commas within
+ * parentheses don't count), it is used in place of the parameter as it is.
+ * Returns 1 if there is no macro by that name.
+ */
+int BASSembler6502::expandMacro(string_view line, int t, unsigned int lineNumber)
+{
+	map<string, unsigned int>::const_iterator found = macroNames.find(upperCase(line.substr(tokens[t].start, tokens[t].length)));
+	if(found==macroNames.end())
+		return 1;
+	const Macro &macro = *macros[found->second];
+	if(expansionNesting==MACRO_MAX_NESTING)
+		return expandBody(macro, 1, lineNumber); // only reports the error
+
+	// the arguments are copied, the expansion reuses 'tokens' and may overwrite the line itself
+	Expansion &expansion = expansions[expansionNesting];
+	string &args = expansion.args;
+	vector<Token> &argTokens = expansion.argTokens;
+	vector<unsigned int> &argStart = expansion.argStart;
+	args.assign(line.substr(0, tokens.back().start));
+	argTokens.clear();
+	argStart.assign(1, 0);
+	int depth = 0;
+	for(size_t i=t+1; tokens[i].type!=TOK_END; i++)
+	{
+		if(isOperator(tokens[i], '('))
+			depth++;
+		else if(isOperator(tokens[i], ')'))
+			depth--;
+		else if(isOperator(tokens[i], ',') && (depth==0))
+		{
+			argStart.push_back((unsigned int)argTokens.size());
+			continue;
+		}
+		argTokens.push_back(tokens[i]);
+	}
+	argStart.push_back((unsigned int)argTokens.size());
+	if(tokens[t+1].type==TOK_END) // no arguments at all, rather than a single empty one
+		argStart.pop_back();
+
+	if(argStart.size()-1!=macro.paramCount)
+	{
+		stringstream ss;
+		ss << "Wrong number of macro arguments: " << (argStart.size()-1) << " instead of " << macro.paramCount;
+		asmError.errorString = ss.str();
+		return -1;
+	}
+
+	return expandBody(macro, 1, lineNumber);
+}
+
+/*
+ * expandBody()
+ *
+ * Assembles the lines of a macro or .rept body 'count' times. For every line
+ * the body's tokens are copied into 'tokens', with the tokens of an argument
+ * (from the Expansion of the current nesting level) in place of a parameter.
+ * The text of the line is put together alongside, the offsets of the tokens
+ * are moved to match it, but it is not lexed again. All lines are reported
+ * under 'lineNumber', with their expanded text.
+ */
+int BASSembler6502::expandBody(const Macro &body, int count, unsigned int lineNumber)
+{
+	if(expansionNesting==MACRO_MAX_NESTING)
+	{
+		asmError.errorString = "Macros nested too deep";
+		asmError.errorStringVerbose = "Does a macro invoke itself?";
+		return -1;
+	}
+	Expansion &expansion = expansions[expansionNesting++];
+	string_view args(expansion.args);
+	const vector<Token> &argTokens = expansion.argTokens;
+	const vector<unsigned int> &argStart = expansion.argStart;
+	string &expanded = expansion.line;
+	int result = 0;
+	unsigned int lineCount = (unsigned int)body.lineStart.size() - 1;
+	for(int n=0; (n<count) && (result==0); n++)
+	{
+		for(unsigned int l=0; (l<lineCount) && (result==0); l++)
+		{
+			string_view text = string_view(body.text).substr(body.lineStart[l], body.lineStart[l+1] - body.lineStart[l]);
+			expanded.clear();
+			tokens.clear();
+
+			int pos = 0; // the text up to here has been copied to 'expanded'
+			for(unsigned int i=body.lineTokens[l]; i<body.lineTokens[l+1]; i++)
+			{
+				Token token = body.tokens[i];
+				int param = body.param[i];
+				if(param<0)
+				{
+					token.start += (int)expanded.size() - pos; // where it will be once the text up to it is copied
+					tokens.push_back(token);
+					continue;
+				}
+
+				expanded.append(text.substr(pos, token.start - pos));
+				pos = token.start + token.length;
+
+				unsigned int first = argStart[param], last = argStart[param+1];
+				if(first==last) // an empty argument
+					continue;
+				int argBegin = tokenBegin(argTokens[first]);
+				int shift = (int)expanded.size() - argBegin;
+				for(unsigned int a=first; a<last; a++)
+				{
+					Token argToken = argTokens[a];
+					argToken.start += shift;
+					if((token.type==TOK_LABELDEF) && (argToken.type==TOK_LABEL)) // a label name given to the macro
+						argToken.type = TOK_LABELDEF;
+					tokens.push_back(argToken);
+				}
+				expanded.append(args.substr(argBegin, tokenEnd(argTokens[last-1]) - argBegin));
+			}
+			expanded.append(text.substr(pos));
+
+			string_view line(expanded);
+			result = assembleStatement(line, lineNumber);
+		}
+	}
+
+	if((result==0) && (recording!=NULL) && (recordingNesting==expansionNesting)) // a block must end in the body it started in
+	{
+		asmError.errorString = recordingName.empty() ? "Missing .endr" : "Missing .endm";
+		asmError.errorStringVerbose = "The block is still open at the end of the macro or .rept body.";
+		setErrorLine(actUnit, lineNumber, sourceLine(actUnit, lineNumber));
+		delete recording;
+		recording = NULL;
+		result = -1;
+	}
+
+	expansionNesting--;
+	return result;
+}
+
+// ----------------------------------------------------------------------------
+// drops every macro and a block left open by a failed assembly
+void BASSembler6502::clearMacros()
+{
+	for(size_t i=0; i<macros.size(); i++)
+		delete macros[i];
+	macros.clear();
+	macroNames.clear();
+	delete recording;
+	recording = NULL;
+	expansionNesting = 0;
+}
+
+// ----------------------------------------------------------------------------
+int BASSembler6502::assembleLine(string_view line, unsigned int lineNumber) // 7815772, 821250366 <- kathrin's numbers
 {
-    remove_comments->GlobalReplace("", &line);
-    
-    if(isEmptyLine->FullMatch(line))  // without any processing
+    STATS_TIME(lineTime);
+
+    if(tokens[0].type==TOK_END)  // without any processing
         return 0;
     
-    // convert whole line into upper case
-    std::transform(line.begin(), line.end(), line.begin(), ::toupper);
+    // skip label definition, it's been handled by detectLabelDefinition()
+    int t = (tokens[0].type==TOK_LABELDEF) ? 1 : 0;
+
+    // not an instruction, but maybe a macro
+    if((tokens[t].type==TOK_MNEMONIC) && !macros.empty() && (findOpcode(line.data() + tokens[t].start, tokens[t].length).name[0]==0))
+    {
+        int result = expandMacro(line, t, lineNumber);
+        if(result!=1)
+            return result;
+    }
 
-    removeLabelDefinition->GlobalReplace("\\1", &line);
-        
     // now we can process the instruction
-    string opcodeStr, operandStr;
-    if(!getInstructionElements->FullMatch(line, &opcodeStr, &operandStr))
+    if((tokens[t].type!=TOK_MNEMONIC) || (tokens[t].length<3))
         return 1;
 
+    word start = actAddress;
+    int result = assembleInstruction(line, t, lineNumber);
+    if((result==0) && optimize)
+        result = optimizeInstruction(start, &tokens[t+1], lineNumber);
+    return result;
+}
+
+// ----------------------------------------------------------------------------
+// encodes the instruction at token 't'
+int BASSembler6502::assembleInstruction(string_view line, int t, unsigned int lineNumber)
+{
+    const Token *op = &tokens[t+1]; // the operand is everything between the mnemonic and the comment
+
     if(actChunk==NULL)
     {
         asmError.errorString = "Instruction reached without address specification";
@@ -453,16 +1656,22 @@ int BASSembler6502::assembleLine(string line, unsigned int lineNumber) // 781577
         return -1;
     }
     
-    Opcode opcode = opcodeMap[opcodeStr];
-    if(opcode.name == "")
+    const Opcode &opcode = findOpcode(line.data() + tokens[t].start, tokens[t].length);
+    if(opcode.name[0] == 0)
     {
-        asmError.errorString = "Unknown instruction " + opcodeStr;
+        asmError.errorString = "Unknown instruction " + upperCase(line.substr(tokens[t].start, tokens[t].length));
         return -1;
     }
+
+    if(instructionLog!=NULL)
+    {
+        InstructionRecord record = { actAddress, actUnit, lineNumber };
+        instructionLog->push_back(record);
+    }
     
-    if(singleByteInstructions.find(opcodeStr)!=string::npos) // if we have a one byte instruction
+    if(opcode.flags & OPCODE_IMPLIED_ONLY) // if we have a one byte instruction
     {
-        if(operandStr!="")
+        if(op->type!=TOK_END)
         {
             asmError.errorString = "Unknown instruction";
             asmError.errorStringVerbose = "This instruction is not supposed to have an operand.";
@@ -470,145 +1679,90 @@ int BASSembler6502::assembleLine(string line, unsigned int lineNumber) // 781577
         }
         actChunk->addByte(opcode.codes[9]); // then we're done: add it's ML code from the 'implicit' column
         actAddress++;
+        STATS_COUNT(modes[ADDR_IMPLIED], 1);
         return 0;
     }
     else // we need to decode the addressing mode
-    {   // first look for a label in the operand
-        int imm = 0, indx = 0, indy = 0, indi = 0;		
-		 
-        string rawLabel;
-        
-        // handle label references
-		 if((imm=checkSimpleLabelReference->FullMatch(operandStr, &rawLabel)) || (indx=checkXIndexedLabelReference->FullMatch(operandStr, &rawLabel)) || (indy=checkYIndexedLabelReference->FullMatch(operandStr, &rawLabel)) || (indi=checkIndirectLabelReference->FullMatch(operandStr, &rawLabel)))
-        {
-            if(labels[operandStr] == 0) // if label is unknown yet, then...
-            {
-                UnresolvedAddress unresolvedAddress;
-                unresolvedAddress.address = actAddress + 1;
-                unresolvedAddress.memChunk = actChunk;
+    {
+        Operand operand;
+        if(parseOperand(line, op, operand)==-1)
+            return -1;
+        STATS_COUNT(modes[operand.mode], 1);
 
-                bool low, high;
-                if((low=(operandStr.find("#<")!=string::npos)) || (high=(operandStr.find("#>")!=string::npos)))
-                {
-                    unresolvedAddress.isOneByteAddr = true;
-                    rawLabel = operandStr.substr(2);
-                }
-                else
-                    unresolvedAddress.isOneByteAddr = false;
-                
-                if(low)
-                {
-                    unresolvedAddress.isLowPart = true;
-                }
-                if(high)
-                {
-                    unresolvedAddress.isLowPart = false;
-                }
-                
-                if((opcodeStr=="BCC")||(opcodeStr=="BCS")||(opcodeStr=="BEQ")||(opcodeStr=="BMI")||(opcodeStr=="BNE")||(opcodeStr=="BPL")||(opcodeStr=="BVC")||(opcodeStr=="BVS"))
-                    unresolvedAddress.isBranch = true;
-                else
-                    unresolvedAddress.isBranch = false;
+        // handle forward references: the expression is evaluated once all labels are known
+        if(operand.terms)
+        {
+            Fixup fixup;
+            fixup.chunk = (unsigned int)chunks.size()-1; // actChunk is the last chunk
+            fixup.address = actAddress + 1;
+            fixup.expr = operand.expr;
+            fixup.terms = operand.terms;
+            fixup.unit = actUnit;
+            fixup.line = lineNumber;
 
-                unresolvedLabels[rawLabel].addresses.push_back(unresolvedAddress);
-                unresolvedLabels[rawLabel].line = lineNumber;
-                stringstream ss; // ...and create a fake temporary address to be able to compile this line
-                if(imm)
+            operand.value = actAddress; // use a fake temporary address to be able to compile this line
+            if(opcode.flags & OPCODE_BRANCH)
+                fixup.kind = FIXUP_BRANCH;
+            else if(operand.part=='<')
+                fixup.kind = FIXUP_LOW;
+            else if(operand.part=='>')
+                fixup.kind = FIXUP_HIGH;
+            else
+            {
+                // zero page or absolute? if the instruction has both forms, it's a relaxation site
+                bool zeroPage = (operand.mode==ADDR_IMMEDIATE) || (operand.mode==ADDR_INDEXED_INDIRECT) || (operand.mode==ADDR_INDIRECT_INDEXED);
+                int column = (operand.mode==ADDR_DIRECT) ? 1 : ((operand.mode==ADDR_INDEXED_X) ? 2 : ((operand.mode==ADDR_INDEXED_Y) ? 3 : 0));
+                if(column && opcode.codes[column] && opcode.codes[column+3])
                 {
-                    if(unresolvedAddress.isOneByteAddr == true)
+                    if(finalPass)
+                        zeroPage = sites[siteCount].zeroPage;
+                    else
                     {
-                        if(unresolvedAddress.isLowPart == true)
-                            ss << "#<$" << hex << actAddress;
-                        else
-                            ss << "#>$" << hex << actAddress;                            
+                        RelaxSite site;
+                        site.expr = (unsigned int)siteTerms.size();
+                        site.zeroPage = false; // this pass assumes absolute
+                        site.pinned = false;
+
+                        const Token *start = operand.start;
+                        string error;
+                        Expression::parse(line, start, symbols, actAddress, siteTerms, error, true); // parsed once already, can't fail
+                        site.terms = (unsigned int)siteTerms.size() - site.expr;
+                        sites.push_back(site);
                     }
-                    else
-                        ss << "$" << hex << actAddress;
+                    siteCount++;
                 }
-                if(indx)
-                    ss << "$" << hex << actAddress << ",X";
-                if(indy)
-                    ss << "$" << hex << actAddress << ",Y";
-                if(indi)
-                    ss << "($" << hex << actAddress << ")";
-                operandStr = ss.str();
-            }
-            else // label is known
-            {
-                stringstream ss; // convert address to hex string and assign it to operandStr
-                ss << "$" << hex << labels[operandStr];
-                operandStr = ss.str();
-            }
-            std::transform(operandStr.begin(), operandStr.end(), operandStr.begin(), ::toupper);
-        }
+                else if(column && opcode.codes[column]) // zero page only, like stx ZP,y
+                    zeroPage = true;
 
-        if(operandStr == "*")
-        {
-            stringstream ss;
-            ss << "$" << hex << actAddress;
-            operandStr = ss.str();
-            std::transform(operandStr.begin(), operandStr.end(), operandStr.begin(), ::toupper);
-        }
-        
-        // check for '*' in operand
-        string operatorStr; string valueStr; int value;
-        if(detectAsteriskExpression->FullMatch(operandStr, &operatorStr, &valueStr))
-        {
-            value = convertIntoDecimal(valueStr);
-            if(value > 127)
-            {
-                asmError.errorString = "Branch out of range";
-                asmError.errorStringVerbose = "You can only jump +/-127 bytes with a branch instruction.";
-                return -1;
-            }
-            word tmpAddress;
-            
-            if(operatorStr=="+")
-            {
-                tmpAddress = actAddress + (word)value;
-            }
-            else
-            {
-                if(operatorStr=="-")
+                if(zeroPage)
                 {
-                    tmpAddress = actAddress - (word)value;
+                    fixup.kind = FIXUP_BYTE;
+                    operand.value = 0;
                 }
                 else
                 {
-                    asmError.errorString = "Invalid operator";
-                    return  -1;
+                    fixup.kind = FIXUP_WORD;
+                    operand.value = 0xffff; // anything that doesn't fit into zero page
                 }
             }
-            
-            stringstream ss;
-            ss << "$" << hex << tmpAddress;
-            operandStr = ss.str();
-            std::transform(operandStr.begin(), operandStr.end(), operandStr.begin(), ::toupper);
-            
-//            cout << opcodeStr << " " << operandStr << endl;
-        }
 
-        string operandValue;
+            fixups.push_back(fixup);
+        }
 
-        // check immediate: LDA #0, LDA #$12, LDA #%10010011, LDA #<$3322
-        if(checkImmediateAddr->FullMatch(operandStr, &operandValue))
+        // immediate: LDA #0, LDA #$12, LDA #%10010011, LDA #<$3322
+        if(operand.mode==ADDR_IMMEDIATE)
         {
-            int value = convertIntoDecimal(operandValue);
-            if(value==-1)
-            {
-                asmError.errorString = "Invalid number type: " + operandStr;
-                return -1;
-            }
+            int value = operand.value;
             
-            if(operandStr.find("#<")!=string::npos)
+            if(operand.part=='<')
                 value = value & 0xff;
-            if(operandStr.find("#>")!=string::npos)
+            if(operand.part=='>')
                 value = (value & 0xff00)>>8;
             
             if((value<0) || (value>255))
             {
                 stringstream ss;
-                ss << "Value out of range (" << value << "/$" << hex << value << "): " << operandStr;
+                ss << "Value out of range (" << value << "/$" << hex << value << "): " << operandString(line, op);
                 asmError.errorString = ss.str();
                 asmError.errorStringVerbose = "Value value must fall between 0 and 255/$ff.";
                 return -1;
@@ -623,18 +1777,13 @@ int BASSembler6502::assembleLine(string line, unsigned int lineNumber) // 781577
             }
         }
         
-        if(checkZPorAbsolute->FullMatch(operandStr))
+        if(operand.mode==ADDR_DIRECT)
         {
-            int address = convertIntoDecimal(operandStr);
-            if(address==-1)
-            {
-                asmError.errorString = "Invalid number type: " + operandStr;
-                return -1;
-            }
+            int address = operand.value;
             if((address<0) || (address>0xffff))
             {
                 stringstream ss;
-                ss << "Value out of range (" << address << "/$" << hex << address << "): " << operandStr;
+                ss << "Value out of range (" << address << "/$" << hex << address << "): " << operandString(line, op);
                 asmError.errorString = ss.str();
                 asmError.errorStringVerbose = "Address value must fall between 0 and 65535/$ffff.";
                 return -1;
@@ -656,36 +1805,29 @@ int BASSembler6502::assembleLine(string line, unsigned int lineNumber) // 781577
                 return 0;
             }
 
-            if(address<0x100) // ZeroPage: lda $10
+            if((address<0x100) && opcode.codes[1]) // ZeroPage: lda $10
             {
-                // TODO: make exception for JSR $10, JMP $10 etc
-                if(opcode.codes[1])
-                {
-                    actChunk->addByte(opcode.codes[1]);
-                    actChunk->addByte((byte)address);
-                    actAddress += 2;
-                    return 0;
-                }
+                actChunk->addByte(opcode.codes[1]);
+                actChunk->addByte((byte)address);
+                actAddress += 2;
+                return 0;
             }
-            else // Absolute: lda $1001
+            if(opcode.codes[4]) // Absolute: lda $1001, and jsr $10, jmp $10 which have no zero page form
             {
-                if(opcode.codes[4])
-                {
-                    actChunk->addByte(opcode.codes[4]);
-                    actChunk->addWord((word)address);
-                    actAddress += 3;
-                    return 0;
-                }
+                actChunk->addByte(opcode.codes[4]);
+                actChunk->addWord((word)address);
+                actAddress += 3;
+                return 0;
             }
         }
         
-        if(checkZPXorAbsoluteX->FullMatch(operandStr, &operandValue))
+        if(operand.mode==ADDR_INDEXED_X)
         {
-            int address = convertIntoDecimal(operandValue);
+            int address = operand.value;
             //cout << "ABS,X: " << operandStr << ", address = " << hex << address << endl;
-            if((address<0) || (address>0xffff)) // TODO: more precise error messages! (like before) handle the case of -1
+            if((address<0) || (address>0xffff)) // TODO: more precise error messages! (like before)
             {
-                asmError.errorString = "Address out of range or invalid syntax" + operandStr;
+                asmError.errorString = "Address out of range or invalid syntax" + operandString(line, op);
                 return -1;
             }
             
@@ -696,7 +1838,7 @@ int BASSembler6502::assembleLine(string line, unsigned int lineNumber) // 781577
                 return -1;
             }
             
-            if(address<0x100) // ZeroPage: lda $10,X
+            if(((address<0x100) && opcode.codes[2]) || (opcode.codes[5]==0)) // ZeroPage: lda $10,X
             {
                 actChunk->addByte(opcode.codes[2]);
                 actChunk->addByte((byte)address);
@@ -711,13 +1853,13 @@ int BASSembler6502::assembleLine(string line, unsigned int lineNumber) // 781577
             return 0;
         }
 
-        if(checkZPYorAbsoluteY->FullMatch(operandStr, &operandValue))
+        if(operand.mode==ADDR_INDEXED_Y)
         {
-            int address = convertIntoDecimal(operandValue);
+            int address = operand.value;
 //            cout << "opcode = " << hex << opcode << endl;
             if((address<0) || (address>0xffff)) // TODO: more precise error messages! (like before)
             {
-                asmError.errorString = "Address out of range or invalid syntax" + operandStr;
+                asmError.errorString = "Address out of range or invalid syntax" + operandString(line, op);
                 return -1;
             }
             
@@ -727,7 +1869,7 @@ int BASSembler6502::assembleLine(string line, unsigned int lineNumber) // 781577
                 return -1;
             }
             
-            if(address<0x100) // ZeroPage: ldx $10,Y
+            if(((address<0x100) && opcode.codes[3]) || (opcode.codes[6]==0)) // ZeroPage: ldx $10,Y
             {
                 actChunk->addByte(opcode.codes[3]);
                 actChunk->addByte((byte)address);
@@ -742,12 +1884,12 @@ int BASSembler6502::assembleLine(string line, unsigned int lineNumber) // 781577
             return 0;
         }
         
-        if(checkIndirect->FullMatch(operandStr, &operandValue))
+        if(operand.mode==ADDR_INDIRECT)
         {
-            int address = convertIntoDecimal(operandValue);
+            int address = operand.value;
             if((address<0) || (address>0xffff)) // TODO: more precise error messages! (like before)
             {
-                asmError.errorString = "Address out of range or invalid syntax" + operandStr;
+                asmError.errorString = "Address out of range or invalid syntax" + operandString(line, op);
                 return -1;
             }
             actChunk->addByte(0x6c);
@@ -756,13 +1898,13 @@ int BASSembler6502::assembleLine(string line, unsigned int lineNumber) // 781577
             return 0;
         }
         
-        if(checkIndexedIndirect->FullMatch(operandStr, &operandValue))
+        if(operand.mode==ADDR_INDEXED_INDIRECT)
         {
-            int address = convertIntoDecimal(operandValue);
+            int address = operand.value;
             
             if((address<0) || (address > 0xff)) // TODO: more precise error messages! (like before)
             {
-                asmError.errorString = "Address out of range or invalid syntax" + operandStr;
+                asmError.errorString = "Address out of range or invalid syntax" + operandString(line, op);
                 asmError.errorStringVerbose = "Address must fall between $0 and $FF.";
                 return -1;
             }
@@ -773,13 +1915,13 @@ int BASSembler6502::assembleLine(string line, unsigned int lineNumber) // 781577
             return 0;
         }
 
-        if(checkIndirectIndexed->FullMatch(operandStr, &operandValue))
+        if(operand.mode==ADDR_INDIRECT_INDEXED)
         {
-            int address = convertIntoDecimal(operandValue);
+            int address = operand.value;
             
             if((address<0) || (address > 0xff)) // TODO: more precise error messages! (like before)
             {
-                asmError.errorString = "Address out of range or invalid syntax" + operandStr;
+                asmError.errorString = "Address out of range or invalid syntax" + operandString(line, op);
                 asmError.errorStringVerbose = "Address must fall between $0 and $FF.";
                 return -1;
             }
@@ -791,7 +1933,7 @@ int BASSembler6502::assembleLine(string line, unsigned int lineNumber) // 781577
         }
         
         // here we check for implied addr. mode for ror, rol, asl, lsr
-        if((singleByteInstructionsSpecial.find(opcodeStr)!=string::npos) && (operandStr==""))
+        if((opcode.flags & OPCODE_ACCUMULATOR) && (operand.mode==ADDR_IMPLIED))
         {
             actChunk->addByte(opcode.codes[9]);
             actAddress++;
@@ -804,211 +1946,533 @@ int BASSembler6502::assembleLine(string line, unsigned int lineNumber) // 781577
 	return -1;
 }
 
-// ----------------------------------------------------------------------------
 /*
- * convertIntoDecimal
+ * The peephole optimizer
+ *
+ * Sees every instruction right after it was emitted (see setOptimize()).
+ * What it knows about the registers comes from straight-line code: it is
+ * forgotten at every label and other jump target, and after anything that
+ * leaves the block (JMP, JSR, RTS, RTI, BRK). A rewrite removes the bytes
+ * at the end of the chunk before the next line is assembled, so the labels
+ * that follow are simply defined at the lower addresses, in every pass.
  *
- * Helper function to convert a number in string format into an integer.
- * Input: a string containing the numerical value
- *        -if the string contains a leading $, it will be treated as a hexa number
- *        -if the string contains a leading %, it will be treates as a bin number
- *        -if the string begins with a numberical character, it will be treates as a decimal number
+ * Only operands of plain numbers count as known values: a label or '*' in
+ * an immediate operand could have another value in the final pass (see
+ * relaxLayout()), which would give that pass another layout. Code that
+ * patches its own immediate operands must not be optimized.
  */
+
+// what an operand refers to
+enum OperandKind
+{
+    OPERAND_NUMBERS,    // nothing but numbers
+    OPERAND_LABEL,      // a single label
+    OPERAND_RELATIVE,   // uses '*'
+    OPERAND_OTHER       // labels in an expression
+};
+
+static int operandKind(const Token *op)
+{
+    if((op[0].type==TOK_LABEL) && (op[1].type==TOK_END))
+        return OPERAND_LABEL;
+
+    int kind = OPERAND_NUMBERS;
+    for(; op->type!=TOK_END; op++)
+    {
+        if((op->type==TOK_OPERATOR) && (op->op=='*'))
+            return OPERAND_RELATIVE;
+        if(op->type==TOK_LABEL)
+            kind = OPERAND_OTHER;
+    }
+    return kind;
+}
+
+// N and Z would be the same as after loading 'value'
+static bool sameFlags(int flags, int value)
+{
+    return (flags>=0) && ((flags==0)==(value==0)) && ((flags & 0x80)==(value & 0x80));
+}
+
+static void forget(Peephole &peephole)
+{
+    peephole.a = peephole.x = peephole.y = peephole.flags = peephole.carry = -1;
+}
+
 // ----------------------------------------------------------------------------
-int BASSembler6502::convertIntoDecimal(string valueStr)
+void BASSembler6502::addRewrite(unsigned int unit, unsigned int line, const char *rule, unsigned int bytes, unsigned int cycles)
 {
-    string table = "0123456789ABCDEF";
-    string tmpStr;
-    int i, result = 0;
-    char actChar;
-    int length;
-    int baseValue;
-    
-    if(checkIfBin->FullMatch(valueStr, &tmpStr))
+    PeepholeRewrite rewrite = { unit, line, rule, bytes, cycles };
+    rewrites.push_back(rewrite);
+    peephole.rewritten = actAddress;
+}
+
+/*
+ * retract()
+ *
+ * Takes back the code from 'start' to the end of the current chunk, with
+ * its fixups and its entry in the instruction log.
+ */
+void BASSembler6502::retract(word start)
+{
+    unsigned int chunk = (unsigned int)chunks.size()-1;
+    while(!fixups.empty() && (fixups.back().chunk==chunk) && (fixups.back().address>start))
     {
-        length = (int)tmpStr.length();
-        baseValue = 1;
-        for(i=length-1; i>=0; i--)
-        {
-            actChar = tmpStr[i];
-            if(actChar=='1')
-                result += baseValue;
-            baseValue *= 2;
-        }
-        
-        return result;
+        exprTerms.resize(fixups.back().expr);
+        fixups.pop_back();
     }
-    
-    if(checkIfHex->FullMatch(valueStr, &tmpStr))
+    if((instructionLog!=NULL) && !instructionLog->empty() && (instructionLog->back().address==start))
+        instructionLog->pop_back();
+
+    actChunk->length -= actAddress - start;
+    actAddress = start;
+}
+
+/*
+ * dropJumpTo()
+ *
+ * Called before 'label' is defined: a JMP to it right before it is
+ * removed, so the label is defined where the JMP was.
+ */
+void BASSembler6502::dropJumpTo(SymbolId label)
+{
+    const Peephole &p = peephole;
+    if((actChunk==NULL) || (p.chunk!=chunks.size()-1) || (p.end!=actAddress) || (p.code!=0x4c) || p.blind || !p.targets.empty() ||
+       fixups.empty())
+        return;
+
+    const Fixup &fixup = fixups.back();
+    if((fixup.chunk!=p.chunk) || (fixup.address!=p.address+1) || (fixup.terms!=1) ||
+       (exprTerms[fixup.expr].op!=EXPR_SYMBOL) || (exprTerms[fixup.expr].value!=(int)label))
+        return;
+
+    retract(p.address);
+    addRewrite(p.unit, p.line, "JMP to the next instruction removed", 3, 3);
+}
+
+/*
+ * optimizeInstruction()
+ *
+ * Looks at the instruction just emitted at 'start' ('op' are its operand
+ * tokens): removes it if it is redundant, and updates what is known after it.
+ * Returns -1 if a branch relative to '*' would cross code that was removed,
+ * 0 otherwise.
+ */
+int BASSembler6502::optimizeInstruction(word start, const Token *op, unsigned int lineNumber)
+{
+    Peephole &p = peephole;
+    unsigned int chunk = (unsigned int)chunks.size()-1;
+    const byte *code = actChunk->data + (start - actChunk->startAddress);
+    const InstructionInfo &info = instructionTable.codes[code[0]];
+    word key = info.key;
+    bool fixed = fixups.empty() || (fixups.back().chunk!=chunk) || (fixups.back().address!=start+1); // the operand is in the code
+    int operand = (info.length==3) ? (code[1] | (code[2] << 8)) : ((info.length==2) ? code[1] : 0);
+    int kind = operandKind(op);
+
+    if(p.chunk!=chunk)
+    {
+        p.blind = false;
+        p.targets.clear();
+        p.rewritten = -1;
+    }
+
+    // the forward targets reached
+    bool target = false;
+    size_t ahead = 0;
+    for(size_t i=0; i<p.targets.size(); i++)
+    {
+        if(p.targets[i]>start)
+            p.targets[ahead++] = p.targets[i];
+        else if(p.targets[i]==start)
+            target = true;
+    }
+    p.targets.resize(ahead);
+
+    bool adjacent = (p.chunk==chunk) && (p.end==start) && (p.labels==labelCount) && !target && !p.blind;
+    if(!adjacent)
+        forget(p);
+    bool movable = !p.blind && p.targets.empty(); // code may be removed here
+
+    int *reg = (key==mnemonicKey("LDA")) ? &p.a : ((key==mnemonicKey("LDX")) ? &p.x : ((key==mnemonicKey("LDY")) ? &p.y : NULL));
+    bool constant = (info.column==COLUMN_IMMEDIATE) && fixed && (kind==OPERAND_NUMBERS);
+    if(movable && adjacent && (reg!=NULL) && constant && (*reg==operand) && sameFlags(p.flags, operand))
+    {
+        retract(start);
+        addRewrite(actUnit, lineNumber, (reg==&p.a) ? "LDA removed, A already holds the value" :
+                   ((reg==&p.x) ? "LDX removed, X already holds the value" : "LDY removed, Y already holds the value"), 2, 2);
+        return 0;
+    }
+    if(movable && adjacent && (((key==mnemonicKey("CLC")) && (p.carry==0)) || ((key==mnemonicKey("SEC")) && (p.carry==1))))
+    {
+        retract(start);
+        addRewrite(actUnit, lineNumber, (p.carry==0) ? "CLC removed, the carry is already clear" : "SEC removed, the carry is already set", 1, 2);
+        return 0;
+    }
+    if(movable && adjacent && (key==mnemonicKey("RTS")) && (p.code==0x20)) // JSR abs: a tail call
+    {
+        actChunk->data[p.address - actChunk->startAddress] = 0x4c;
+        retract(start);
+        addRewrite(actUnit, lineNumber, "JSR and RTS replaced by JMP", 1, 9);
+        p.code = 0x4c;
+        forget(p);
+        return 0;
+    }
+    if(movable && (key==mnemonicKey("JMP")) && (info.column==COLUMN_ABSOLUTE) && fixed && (operand==start+3) &&
+       (kind==OPERAND_RELATIVE) && (op[1].type==TOK_OPERATOR) && (op[1].op=='+') && (op[2].type==TOK_NUMBER) && (op[3].type==TOK_END)) // JMP *+3
+    {
+        retract(start);
+        addRewrite(actUnit, lineNumber, "JMP to the next instruction removed", 3, 3);
+        return 0;
+    }
+
+    // where it jumps to
+    bool jump = (info.flags & INSTRUCTION_BRANCH) || (((key==mnemonicKey("JMP")) || (key==mnemonicKey("JSR"))) && (info.column==COLUMN_ABSOLUTE));
+    if(jump && !fixed)
     {
-        length = (int)tmpStr.length();
-        baseValue = 1;
-        for(i=length-1; i>=0; i--)
+        const Fixup &fixup = fixups.back();
+        if((fixup.terms!=1) || (exprTerms[fixup.expr].op!=EXPR_SYMBOL)) // 'label+2' or the like: anywhere in the chunk
+            p.blind = true;
+    }
+    else if(jump && (kind!=OPERAND_LABEL) && ((kind!=OPERAND_NUMBERS) || (info.flags & INSTRUCTION_BRANCH))) // 'jsr $ffd2' is not code of this chunk
+    {
+        word address = (info.flags & INSTRUCTION_BRANCH) ? (word)(start + 2 + (signed char)operand) : (word)operand;
+        if(address>start)
+            p.targets.push_back(address);
+        else if((address>=actChunk->startAddress) && (p.rewritten>=0) && (address<=p.rewritten))
         {
-            actChar = tmpStr[i];
-            result += findChar(table, actChar) * baseValue;
-            baseValue *= 16;
+            asmError.errorString = "Branch across code removed by the optimizer";
+            asmError.errorStringVerbose = "Code was removed between this instruction and its target. Use a label as the target, or assemble without -O.";
+            return -1;
         }
-        
-        return result;
     }
-    
-    if(checkIfDec->FullMatch(valueStr, &tmpStr))
+
+    // what is known after it
+    switch(key)
+    {
+        case mnemonicKey("LDA"): case mnemonicKey("LDX"): case mnemonicKey("LDY"):
+            *reg = p.flags = constant ? operand : -1;
+            break;
+        case mnemonicKey("TAX"): p.x = p.flags = p.a; break;
+        case mnemonicKey("TAY"): p.y = p.flags = p.a; break;
+        case mnemonicKey("TXA"): p.a = p.flags = p.x; break;
+        case mnemonicKey("TYA"): p.a = p.flags = p.y; break;
+        case mnemonicKey("INX"): p.x = p.flags = (p.x<0) ? -1 : ((p.x+1) & 0xff); break;
+        case mnemonicKey("DEX"): p.x = p.flags = (p.x<0) ? -1 : ((p.x-1) & 0xff); break;
+        case mnemonicKey("INY"): p.y = p.flags = (p.y<0) ? -1 : ((p.y+1) & 0xff); break;
+        case mnemonicKey("DEY"): p.y = p.flags = (p.y<0) ? -1 : ((p.y-1) & 0xff); break;
+        case mnemonicKey("TSX"): p.x = p.flags = -1; break;
+        case mnemonicKey("PLA"): case mnemonicKey("AND"): case mnemonicKey("ORA"): case mnemonicKey("EOR"):
+            p.a = p.flags = -1;
+            break;
+        case mnemonicKey("ADC"): case mnemonicKey("SBC"):
+            p.a = p.flags = p.carry = -1;
+            break;
+        case mnemonicKey("ASL"): case mnemonicKey("LSR"): case mnemonicKey("ROL"): case mnemonicKey("ROR"):
+            if(info.column==COLUMN_IMPLIED) // the accumulator
+                p.a = -1;
+            p.flags = p.carry = -1;
+            break;
+        case mnemonicKey("CMP"): case mnemonicKey("CPX"): case mnemonicKey("CPY"): case mnemonicKey("PLP"):
+            p.flags = p.carry = -1;
+            break;
+        case mnemonicKey("INC"): case mnemonicKey("DEC"): case mnemonicKey("BIT"):
+            p.flags = -1;
+            break;
+        case mnemonicKey("CLC"): p.carry = 0; break;
+        case mnemonicKey("SEC"): p.carry = 1; break;
+        case mnemonicKey("BCC"): p.carry = 1; break; // not taken
+        case mnemonicKey("BCS"): p.carry = 0; break;
+        case mnemonicKey("STA"): case mnemonicKey("STX"): case mnemonicKey("STY"): case mnemonicKey("TXS"):
+        case mnemonicKey("PHA"): case mnemonicKey("PHP"): case mnemonicKey("NOP"):
+        case mnemonicKey("CLD"): case mnemonicKey("SED"): case mnemonicKey("CLI"): case mnemonicKey("SEI"): case mnemonicKey("CLV"):
+        case mnemonicKey("BNE"): case mnemonicKey("BEQ"): case mnemonicKey("BPL"): case mnemonicKey("BMI"):
+        case mnemonicKey("BVC"): case mnemonicKey("BVS"):
+            break;
+        default: // JMP, JSR, RTS, RTI: the block ends
+            forget(p);
+            break;
+    }
+
+    p.chunk = chunk;
+    p.address = start;
+    p.end = actAddress;
+    p.code = code[0];
+    p.labels = labelCount;
+    p.unit = actUnit;
+    p.line = lineNumber;
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+/*
+ * parseOperand
+ *
+ * Decodes the operand tokens into an addressing mode and a value. The value
+ * is an expression (see Expression.h): if all of its labels are known it is
+ * folded right away, otherwise its terms are kept for a fixup, see Operand.
+ * Operands that don't fit any addressing mode get ADDR_INVALID.
+ * Returns -1 on error, 0 otherwise.
+ */
+// ----------------------------------------------------------------------------
+int BASSembler6502::parseOperand(string_view line, const Token *op, Operand &operand)
+{
+    operand.mode = ADDR_INVALID;
+    operand.value = 0;
+    operand.part = 0;
+    operand.expr = 0;
+    operand.terms = 0;
+    operand.start = op;
+
+    if(op[0].type==TOK_END)
+    {
+        operand.mode = ADDR_IMPLIED;
+        return 0;
+    }
+
+    const Token *token = op;
+
+    // immediate: LDA #0, LDA #$12, LDA #%10010011, LDA #<$3322, LDA #>TABLE+$100
+    if(isOperator(*token, '#'))
     {
-        length = (int)tmpStr.length();
-        baseValue = 1;
-        for(i=length-1; i>=0; i--)
+        token++;
+        char part = (isOperator(*token, '<') || isOperator(*token, '>')) ? token->op : 0; // applies to the whole expression
+        if(part) token++;
+        bool bareLabel = !part && (token[0].type==TOK_LABEL) && (token[1].type==TOK_END);
+
+        if(parseExpression(line, op, token, operand)==-1)
+            return -1;
+        if(token->type!=TOK_END)
         {
-            actChar = tmpStr[i];
-            result += findChar(table, actChar) * baseValue;
-            baseValue *= 10;
+            asmError.errorString = "Invalid number type: " + operandString(line, op);
+            return -1;
         }
-        
-        return result;
+
+        if(bareLabel) // note: '#LABEL' has always been assembled as 'LABEL'
+            operand.mode = ADDR_DIRECT;
+        else
+        {
+            operand.mode = ADDR_IMMEDIATE;
+            operand.part = part;
+        }
+        return 0;
     }
-    
-    return -1; // invalid number format
+
+    // indirect: JMP ($1000), LDA ($10,X), LDA ($10),Y
+    if(isOperator(*token, '('))
+    {
+        token++;
+        if(parseExpression(line, op, token, operand)==-1)
+            return -1;
+
+        if(isOperator(token[0], ',') && isRegister(line, token[1], 'X') && isOperator(token[2], ')') && (token[3].type==TOK_END))
+            operand.mode = ADDR_INDEXED_INDIRECT;
+        else if(isOperator(token[0], ')') && (token[1].type==TOK_END))
+            operand.mode = ADDR_INDIRECT;
+        else if(isOperator(token[0], ')') && isOperator(token[1], ',') && isRegister(line, token[2], 'Y') && (token[3].type==TOK_END))
+            operand.mode = ADDR_INDIRECT_INDEXED;
+
+        if(operand.mode!=ADDR_INVALID)
+            return 0;
+
+        // the parentheses only group a part of the expression, like (BASE+1)*2: start over
+        if(operand.terms)
+            exprTerms.resize(operand.expr);
+        operand.terms = 0;
+        token = op;
+    }
+
+    // direct: LDA $1000, LDA TABLE+3,X, LDX ZP,Y
+    if(parseExpression(line, op, token, operand)==-1)
+        return -1;
+
+    if(token[0].type==TOK_END)
+        operand.mode = ADDR_DIRECT;
+    else if(isOperator(token[0], ',') && isRegister(line, token[1], 'X') && (token[2].type==TOK_END))
+        operand.mode = ADDR_INDEXED_X;
+    else if(isOperator(token[0], ',') && isRegister(line, token[1], 'Y') && (token[2].type==TOK_END))
+        operand.mode = ADDR_INDEXED_Y;
+
+    return 0;
 }
 
 // ----------------------------------------------------------------------------
-int BASSembler6502::countChars(string text, char c)
+/*
+ * parseExpression
+ *
+ * Parses the expression at 'token' into 'operand': a constant becomes its
+ * value, anything else stays in 'exprTerms'. 'op' is the start of the whole
+ * operand, for error messages.
+ */
+int BASSembler6502::parseExpression(string_view line, const Token *op, const Token *&token, Operand &operand)
 {
-	int count_ = 0;
-	int size = (int)text.size();
-	
-	for(int i=0; i<size; i++)
-		if(text[i]==c)
-			count_++;
+    unsigned int first = (unsigned int)exprTerms.size();
+    operand.start = token;
+    string error;
+    if(Expression::parse(line, token, symbols, actAddress, exprTerms, error)==-1)
+    {
+        asmError.errorString = error + ": " + operandString(line, op);
+        return -1;
+    }
+
+    if((exprTerms.size()==first+1) && (exprTerms.back().op==EXPR_NUMBER)) // folded into a constant
+    {
+        operand.value = exprTerms.back().value;
+        exprTerms.pop_back();
+        operand.terms = 0;
+    }
+    else
+    {
+        operand.expr = first;
+        operand.terms = (unsigned int)exprTerms.size() - first;
+    }
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// returns the text of the operand (in upper case) for messages and label lookups
+string BASSembler6502::operandString(string_view line, const Token *op)
+{
+    if(op->type==TOK_END)
+        return "";
 
-	return count_;
+    string_view operandStr = line.substr(op->start, tokens.back().start - op->start);
+    trimLine(operandStr);
+    return upperCase(operandStr);
 }
+
 // ----------------------------------------------------------------------------
-int BASSembler6502::findChar(string text, char c)
+bool BASSembler6502::isOperator(const Token &token, char op)
 {
-	int size = (int)text.size();
-	
-	for(int i=0; i<size; i++)
-		if(text[i]==c)
-			return i;
-	
-	return 0;
+    return (token.type==TOK_OPERATOR) && (token.op==op);
 }
+
 // ----------------------------------------------------------------------------
-void BASSembler6502::initOpcodeTable()
+// checks if a token is the name of the given index register (X or Y)
+bool BASSembler6502::isRegister(string_view text, const Token &token, char reg)
 {
-    singleByteInstructions = "CLC SEC CLI SEI CLV CLD SED TAX TXA DEX INX TAY TYA DEY INY RTI RTS TXS TSX PHA PLA PHP PLP NOP";
-    singleByteInstructionsSpecial = "ROL ROR ASL LSR";
-    
-//                     Imm,  ZP,   ZPX,  ZPY,  ABS,  ABSX, ABSY, INDX, INDY, IMPL, BRA
-    Opcode _ADC("ADC", 0x69, 0x65, 0x75, 0x00, 0x6d, 0x7d, 0x79, 0x61, 0x71, 0x00, 0x00);
-    Opcode _AND("AND", 0x29, 0x25, 0x35, 0x00, 0x2d, 0x3d, 0x39, 0x21, 0x31, 0x00, 0x00);
-    Opcode _ASL("ASL", 0x00, 0x06, 0x16, 0x00, 0x0e, 0x1e, 0x00, 0x00, 0x00, 0x0a, 0x00);
-    Opcode _BIT("BIT", 0x00, 0x24, 0x00, 0x00, 0x2c, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00);
-    Opcode _BPL("BPL", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10);
-    Opcode _BMI("BMI", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x30);
-    Opcode _BVC("BVC", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x50);
-    Opcode _BVS("BVS", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x70);
-    Opcode _BCC("BCC", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x90);
-    Opcode _BCS("BCS", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xb0);
-    Opcode _BNE("BNE", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xd0);
-    Opcode _BEQ("BEQ", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xf0);
-    Opcode _CMP("CMP", 0xc9, 0xc5, 0xd5, 0x00, 0xcd, 0xdd, 0xd9, 0xc1, 0xd1, 0x00, 0x00);
-    Opcode _CPX("CPX", 0xe0, 0xe4, 0x00, 0x00, 0xec, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00);
-    Opcode _CPY("CPY", 0xc0, 0xc4, 0x00, 0x00, 0xcc, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00);
-    Opcode _DEC("DEC", 0x00, 0xc6, 0xd6, 0x00, 0xce, 0xde, 0x00, 0x00, 0x00, 0x00, 0x00);
-    Opcode _EOR("EOR", 0x49, 0x45, 0x55, 0x00, 0x4d, 0x5d, 0x59, 0x41, 0x51, 0x00, 0x00);
-    Opcode _CLC("CLC", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x18, 0x00); //
-    Opcode _SEC("SEC", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x38, 0x00); //
-    Opcode _CLI("CLI", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x58, 0x00); // 
-    Opcode _SEI("SEI", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x78, 0x00); //
-    Opcode _CLV("CLV", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xb8, 0x00); //
-    Opcode _CLD("CLD", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xd8, 0x00); //
-    Opcode _SED("SED", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xf8, 0x00); //
-    Opcode _INC("INC", 0x00, 0xe6, 0xf6, 0x00, 0xee, 0xfe, 0x00, 0x00, 0x00, 0x00, 0x00);
-    Opcode _JMP("JMP", 0x00, 0x00, 0x00, 0x00, 0x4c, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00);
-    Opcode _JSR("JSR", 0x00, 0x00, 0x00, 0x00, 0x20, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00);
-    Opcode _LDA("LDA", 0xa9, 0xa5, 0xb5, 0x00, 0xad, 0xbd, 0xb9, 0xa1, 0xb1, 0x00, 0x00);
-    Opcode _LDX("LDX", 0xa2, 0xa6, 0x00, 0xb6, 0xae, 0x00, 0xbe, 0x00, 0x00, 0x00, 0x00);
-    Opcode _LDY("LDY", 0xa0, 0xa4, 0xb4, 0x00, 0xac, 0xbc, 0x00, 0x00, 0x00, 0x00, 0x00);
-    Opcode _LSR("LSR", 0x00, 0x46, 0x56, 0x00, 0x4e, 0x5e, 0x00, 0x00, 0x00, 0x4a, 0x00);
-    Opcode _NOP("NOP", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xea, 0x00); //
-    Opcode _ORA("ORA", 0x09, 0x05, 0x15, 0x00, 0x0d, 0x1d, 0x19, 0x01, 0x11, 0x00, 0x00);
-    Opcode _TAX("TAX", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xaa, 0x00); //
-    Opcode _TXA("TXA", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x8a, 0x00); //
-    Opcode _DEX("DEX", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xca, 0x00); //
-    Opcode _INX("INX", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xe8, 0x00); //
-    Opcode _TAY("TAY", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xa8, 0x00); //
-    Opcode _TYA("TYA", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x98, 0x00); //
-    Opcode _DEY("DEY", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x88, 0x00); //
-    Opcode _INY("INY", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xc8, 0x00); //
-    Opcode _ROR("ROR", 0x00, 0x66, 0x76, 0x00, 0x6e, 0x7e, 0x00, 0x00, 0x00, 0x6a, 0x00);
-    Opcode _ROL("ROL", 0x00, 0x26, 0x36, 0x00, 0x2e, 0x3e, 0x00, 0x00, 0x00, 0x2a, 0x00); //<- temporarily corrupted at xxx,y
-    Opcode _RTI("RTI", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x40, 0x00); //
-    Opcode _RTS("RTS", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x60, 0x00); //
-    Opcode _SBC("SBC", 0xe9, 0xe5, 0xf5, 0x00, 0xed, 0xfd, 0xf9, 0xe1, 0xf1, 0x00, 0x00);
-    Opcode _STA("STA", 0x00, 0x85, 0x95, 0x00, 0x8d, 0x9d, 0x99, 0x81, 0x91, 0x00, 0x00);
-    Opcode _TXS("TXS", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x9a, 0x00); //
-    Opcode _TSX("TSX", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xba, 0x00); //
-    Opcode _PHA("PHA", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x48, 0x00); //
-    Opcode _PLA("PLA", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x68, 0x00); //
-    Opcode _PHP("PHP", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x08, 0x00); //
-    Opcode _PLP("PLP", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x28, 0x00); //
-    Opcode _STX("STX", 0x00, 0x86, 0x00, 0x96, 0x8e, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00);
-    Opcode _STY("STY", 0x00, 0x84, 0x94, 0x00, 0x8c, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00);
-    
-    opcodeMap["ADC"] = _ADC;
-    opcodeMap["AND"] = _AND;
-    opcodeMap["ASL"] = _ASL;
-    opcodeMap["BIT"] = _BIT;
-    opcodeMap["BPL"] = _BPL;
-    opcodeMap["BMI"] = _BMI;
-    opcodeMap["BVC"] = _BVC;
-    opcodeMap["BVS"] = _BVS;
-    opcodeMap["BCC"] = _BCC;
-    opcodeMap["BCS"] = _BCS;
-    opcodeMap["BNE"] = _BNE;
-    opcodeMap["BEQ"] = _BEQ;
-    opcodeMap["CMP"] = _CMP;
-    opcodeMap["CPX"] = _CPX;
-    opcodeMap["CPY"] = _CPY;
-    opcodeMap["DEC"] = _DEC;
-    opcodeMap["EOR"] = _EOR;
-    opcodeMap["CLC"] = _CLC;
-    opcodeMap["SEC"] = _SEC;
-    opcodeMap["CLI"] = _CLI;
-    opcodeMap["SEI"] = _SEI;
-    opcodeMap["CLV"] = _CLV;
-    opcodeMap["CLD"] = _CLD;
-    opcodeMap["SED"] = _SED;
-    opcodeMap["INC"] = _INC;
-    opcodeMap["JMP"] = _JMP;
-    opcodeMap["JSR"] = _JSR;
-    opcodeMap["LDA"] = _LDA;
-    opcodeMap["LDX"] = _LDX;
-    opcodeMap["LDY"] = _LDY;
-    opcodeMap["LSR"] = _LSR;
-    opcodeMap["NOP"] = _NOP;
-    opcodeMap["ORA"] = _ORA;
-    opcodeMap["TAX"] = _TAX;
-    opcodeMap["TXA"] = _TXA;
-    opcodeMap["DEX"] = _DEX;
-    opcodeMap["INX"] = _INX;
-    opcodeMap["TAY"] = _TAY;
-    opcodeMap["TYA"] = _TYA;
-    opcodeMap["DEY"] = _DEY;
-    opcodeMap["INY"] = _INY;
-    opcodeMap["ROR"] = _ROR;
-    opcodeMap["ROL"] = _ROL;
-    opcodeMap["RTI"] = _RTI;
-    opcodeMap["RTS"] = _RTS;
-    opcodeMap["SBC"] = _SBC;
-    opcodeMap["STA"] = _STA;
-    opcodeMap["TXS"] = _TXS;
-    opcodeMap["TSX"] = _TSX;
-    opcodeMap["PHA"] = _PHA;
-    opcodeMap["PLA"] = _PLA;
-    opcodeMap["PHP"] = _PHP;
-    opcodeMap["PLP"] = _PLP;
-    opcodeMap["STX"] = _STX;
-    opcodeMap["STY"] = _STY;
+    return (token.type==TOK_LABEL) && (token.length==1) && (toupper(text[token.start])==reg);
+}
+
+// ----------------------------------------------------------------------------
+string BASSembler6502::upperCase(string_view text)
+{
+    string upper(text);
+    std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+    return upper;
+}
+
+// ----------------------------------------------------------------------------
+// removes leading and trailing white space
+void BASSembler6502::trimLine(string_view &line)
+{
+    size_t first = line.find_first_not_of(" \t\r\n\v\f");
+    if(first==string_view::npos)
+    {
+        line = string_view();
+        return;
+    }
+    size_t last = line.find_last_not_of(" \t\r\n\v\f");
+    line = line.substr(first, last-first+1);
+}
+
+// ----------------------------------------------------------------------------
+// returns the (trimmed) text of a source line, only used for error messages
+string_view BASSembler6502::sourceLine(unsigned int unit, unsigned int lineNumber)
+{
+    if(units[unit]->tokenized)
+        return ((lineNumber>0) && (lineNumber<=units[unit]->lines.size())) ? units[unit]->lines[lineNumber-1] : string_view();
+
+    string_view source = units[unit]->text;
+    size_t pos = 0;
+    for(unsigned int i=1; i<lineNumber; i++)
+    {
+        pos = source.find('\n', pos);
+        if(pos==string_view::npos)
+            return string_view();
+        pos++;
+    }
+
+    size_t end = source.find('\n', pos);
+    if(end==string_view::npos)
+        end = source.size();
+
+    string_view line = source.substr(pos, end-pos);
+    trimLine(line);
+    return line;
+}
+
+// ----------------------------------------------------------------------------
+void BASSembler6502::setErrorLine(unsigned int unit, unsigned int lineNumber, string_view line)
+{
+    asmError.errorLineNumber = lineNumber;
+    asmError.lineContent = string(line);
+    asmError.fileName = units[unit]->name;
+}
+// ----------------------------------------------------------------------------
+
+// ----------------------------------------------------------------------------
+// the hash index of the opcode table (see OpcodeTable.h)
+#define OPCODE_HASH_MULTIPLIER 842 // smallest multiplier for which the hash below has no collisions on the table
+
+// maps the 15 bit packed mnemonic into 8 bits
+static constexpr int opcodeHash(word key)
+{
+    return ((key * OPCODE_HASH_MULTIPLIER) & 0xffff) >> 8;
+}
+
+// hash slot -> index into opcodeTable plus one (0 = empty slot)
+struct OpcodeIndex
+{
+    byte slots[256];
+};
+
+static constexpr OpcodeIndex buildOpcodeIndex()
+{
+    OpcodeIndex index = {};
+    for(int i=0; i<OPCODE_COUNT; i++)
+        index.slots[opcodeHash(opcodeTable[i].key)] = (byte)(i+1);
+    return index;
+}
+
+static constexpr OpcodeIndex opcodeIndex = buildOpcodeIndex();
+
+static constexpr bool opcodeHashIsPerfect()
+{
+    int used = 0;
+    for(int i=0; i<256; i++)
+        if(opcodeIndex.slots[i])
+            used++;
+    return used==OPCODE_COUNT;
+}
+
+static_assert(opcodeHashIsPerfect(), "opcode hash has collisions, OPCODE_HASH_MULTIPLIER must be changed");
+
+static constexpr Opcode invalidOpcode; // returned for unknown instructions, its name is empty
+
+// ----------------------------------------------------------------------------
+/*
+ * findOpcode
+ *
+ * Looks up an instruction by its (case insensitive) three letter mnemonic.
+ * Returns a reference into the opcode table, or to an opcode with an empty
+ * name if the mnemonic is unknown.
+ */
+// ----------------------------------------------------------------------------
+const Opcode &BASSembler6502::findOpcode(const char *mnemonic, int length)
+{
+    if(length!=3)
+        return invalidOpcode;
+
+    for(int i=0; i<3; i++) // only letters may be packed, anything else could alias one
+    {
+        char c = mnemonic[i] | 0x20; // lower case
+        if((c<'a') || (c>'z'))
+            return invalidOpcode;
+    }
+
+    word key = Opcode::packMnemonic(mnemonic[0], mnemonic[1], mnemonic[2]);
+    int slot = opcodeIndex.slots[opcodeHash(key)];
+    if((slot==0) || (opcodeTable[slot-1].key!=key))
+        return invalidOpcode;
+
+    return opcodeTable[slot-1];
 }
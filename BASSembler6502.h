@@ -7,54 +7,79 @@
  *
  */
 
+#ifndef BASSEMBLER6502_H
+#define BASSEMBLER6502_H
+
 #include <iostream>
+#include <string>
+#include <string_view>
 #include <vector>
 #include <map>
+#include <string.h> // memcpy()
+#include <stdint.h>
 #include "types.h"
-#include <pcrecpp.h>
+#include "Lexer6502.h"
+#include "SymbolTable.h"
+#include "Expression.h"
+#include "SourceFile.h"
+#include "Charset.h"
+
+// not 'using namespace std', since std::byte (C++17) would clash with our own 'byte'
+using std::string;
+using std::string_view;
+using std::vector;
+using std::map;
+using std::cout;
+using std::endl;
 
-using namespace std; // mainly for 'string'
+#define BASSEMBLER_VERSION "v0.17beta (12.06.2012)"
 
-#define PETSCII     0
-#define ASCII       1
-#define SCREENSCII  2
+#define MEMORY_SIZE  0x10000   // the 6502 address space
+#define MEMORY_SLACK 16        // room for the last instruction of a line that runs past $FFFF, see assemble()
 
 class MemChunk; // fw. dec.
+class IncrementalAssembler;
+class SegmentAssembler;
+class ObjectFile;
 
 /*
  * Opcode class
  *
  * Container for a single opcode.
  * Contains the name and the instruction code for each addressing mode.
- * The 'opcodeMap' (map<string, Opcode>) member variable will hold a map
- * of these opcodes.
+ * The opcode table (see BASSembler6502.cpp) is a constexpr array of these,
+ * looked up through a perfect hash by BASSembler6502::findOpcode().
+ * The flags are derived from the codes when the table is compiled.
  */
+#define OPCODE_IMPLIED_ONLY 1 // CLC, INX, RTS, ...: only the implied column is used
+#define OPCODE_BRANCH       2 // BNE, BCC, ...: relative branches
+#define OPCODE_ACCUMULATOR  4 // ASL, LSR, ROL, ROR: implied (accumulator) form besides the others
+
 class Opcode
 {
 public:
-    string name;
+    char name[4];
+    word key; // the three letters packed into 15 bits, see packMnemonic()
     byte codes[11];
+    byte flags;
 
-    // OK, this might look ridiculous, but if you take a look at BASSembler6502::initOpcodeTable(),
+    // OK, this might look ridiculous, but if you take a look at the opcode table in BASSembler6502.cpp,
     // it will immediately make sense why it is implemented this way.
-    Opcode(string n, byte a, byte b, byte c, byte d, byte e, byte f, byte g, byte h, byte i, byte j, byte k)
+    constexpr Opcode(const char *n, byte a, byte b, byte c, byte d, byte e, byte f, byte g, byte h, byte i, byte j, byte k)
+        : name{n[0], n[1], n[2], 0}, key(packMnemonic(n[0], n[1], n[2])), codes{a, b, c, d, e, f, g, h, i, j, k},
+          flags((k ? OPCODE_BRANCH : 0) |
+                ((j && !(a|b|c|d|e|f|g|h|i|k)) ? OPCODE_IMPLIED_ONLY : 0) |
+                ((j && (a|b|c|d|e|f|g|h|i)) ? OPCODE_ACCUMULATOR : 0))
     {
-        name = n;
-        codes[0] = a;
-        codes[1] = b;
-        codes[2] = c;
-        codes[3] = d;
-        codes[4] = e;
-        codes[5] = f;
-        codes[6] = g;
-        codes[7] = h;
-        codes[8] = i;
-        codes[9] = j;
-        codes[10] = k;
     }
 
-    Opcode(){};
-    ~Opcode(){};
+    constexpr Opcode() : name{0, 0, 0, 0}, key(0), codes{0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, flags(0) {}
+
+    // letters are packed case insensitively: 'A' and 'a' both become 1
+    static constexpr word packMnemonic(char a, char b, char c)
+    {
+        return (word)(((a & 0x1f) << 10) | ((b & 0x1f) << 5) | (c & 0x1f));
+    }
 };
 
 /*
@@ -66,25 +91,236 @@ struct AssemblyError
 	string lineContent;
 	string errorString;
 	string errorStringVerbose;
+	string fileName; // file of the erroneous line (empty if the main source has no name)
 	unsigned int errorLineNumber;
 };
 
-struct UnresolvedAddress
+/*
+ * Operand
+ *
+ * The decoded operand of an instruction: its addressing mode and value.
+ * If the operand's expression refers to labels that are not defined yet,
+ * its terms are kept in BASSembler6502::exprTerms for a fixup and 'value'
+ * is only a placeholder.
+ */
+enum AddressingMode
+{
+    ADDR_INVALID,
+    ADDR_IMPLIED,           // asl
+    ADDR_IMMEDIATE,         // lda #$10
+    ADDR_DIRECT,            // lda $10, lda $1000 (zero page or absolute, decided by the value)
+    ADDR_INDEXED_X,         // lda $10,x  lda $1000,x
+    ADDR_INDEXED_Y,         // ldx $10,y  lda $1000,y
+    ADDR_INDIRECT,          // jmp ($1000)
+    ADDR_INDEXED_INDIRECT,  // lda ($10,x)
+    ADDR_INDIRECT_INDEXED   // lda ($10),y
+};
+
+struct Operand
+{
+    AddressingMode mode;
+    int value;
+    char part;          // '<' or '>' if only the low or high byte is used (#<expr, #>expr), 0 otherwise
+    unsigned int expr;  // first term of the unresolved expression in exprTerms
+    unsigned int terms; // number of its terms, 0 if 'value' is final
+    const Token *start; // first token of the expression
+};
+
+/*
+ * Fixup
+ *
+ * An operand that refers to labels that were not defined yet when the
+ * instruction was assembled. All fixups are collected in one flat array
+ * and patched in a single pass after the last line has been assembled,
+ * by evaluating their expressions (see Expression.h).
+ */
+enum FixupKind
+{
+    FIXUP_WORD,     // jmp LABEL: 16 bit address
+    FIXUP_LOW,      // lda #<LABEL: low byte
+    FIXUP_HIGH,     // lda #>LABEL: high byte
+    FIXUP_BYTE,     // lda #LABEL-BASE, lda (LABEL),y: 8 bit value
+    FIXUP_BRANCH    // bne LABEL: 8 bit relative offset
+};
+
+struct Fixup
+{
+    unsigned int chunk;     // index of the chunk in BASSembler6502::chunks
+    word address;           // address of the byte(s) to patch
+    byte kind;              // see FixupKind
+    unsigned int expr;      // the expression, see Operand
+    unsigned int terms;
+    unsigned int unit;      // source file and line of the reference, for error reporting
+    unsigned int line;
+
+    bool operator<(const Fixup &other) const
+    {
+        return (chunk<other.chunk) || ((chunk==other.chunk) && (address<other.address));
+    }
+};
+
+/*
+ * RelaxSite
+ *
+ * An instruction that has both a zero page and an absolute form, and whose
+ * operand refers to labels that are defined later. The first pass assembles
+ * it as absolute. relaxLayout() then works out which of them fit into zero
+ * page, and the final pass assembles them that way. The site's expression
+ * keeps all of its labels, not just the undefined ones, since any of them
+ * may move when an instruction before them shrinks.
+ */
+struct RelaxSite
+{
+    unsigned int expr;      // first term in BASSembler6502::siteTerms
+    unsigned int terms;
+    bool zeroPage;          // assembled as zero page in the final pass
+    bool pinned;            // had to go back to absolute, it stays so
+};
+
+/*
+ * AssemblyStats
+ *
+ * Where the time of an assemble() went, and what it came across. Filled in
+ * only if the assembler was built with BASSEMBLER_STATS defined, otherwise
+ * none of it is compiled in. Times are in nanoseconds, and a step's time
+ * doesn't include the steps it called: the lines of an .include or a macro
+ * count as lines of their own.
+ */
+#define ADDR_MODE_COUNT (ADDR_INDIRECT_INDEXED+1)
+
+struct AssemblyStats
+{
+    uint64_t directiveTime;     // checkDirectives()
+    uint64_t labelTime;         // detectLabelDefinition()
+    uint64_t lineTime;          // assembleLine(): instructions
+    uint64_t fixupTime;         // resolveFixups()
+    uint64_t splitTime;         // cutting the sources into lines and lexing them
+    uint64_t otherTime;         // passes, everything else
+    unsigned int passes;
+    unsigned int lines;         // lines assembled, counting every pass
+    unsigned int tokens;        // tokens of those lines
+    unsigned int directives;
+    unsigned int labels;        // label definitions, counting every pass
+    unsigned int modes[ADDR_MODE_COUNT]; // instructions by addressing mode
+    unsigned int fixups;        // forward references
+    unsigned int relaxSites;    // forward references that might go to zero page
+    unsigned int chunks;
+    unsigned int bytes;         // emitted
+
+    // the step being timed, while assembling
+    uint64_t *timing;
+    uint64_t timingSince;
+};
+
+/*
+ * InstructionRecord
+ *
+ * Where an instruction was emitted, so the code can be told from the data
+ * after the assembly (see TimingReport). Only filled in if somebody asked,
+ * see BASSembler6502::recordInstructions().
+ */
+struct InstructionRecord
 {
     word address;
-    MemChunk *memChunk;
-    bool isBranch;
-    bool isOneByteAddr;
-    bool isLowPart;
+    unsigned int unit;      // source file and line of the instruction
+    unsigned int line;
 };
 
-struct UnresolvedLabel
+/*
+ * PeepholeRewrite
+ *
+ * A rewrite the optimizer applied (see BASSembler6502::setOptimize()), with
+ * the line of the instruction it removed or changed and what that saved.
+ */
+struct PeepholeRewrite
 {
-    vector<UnresolvedAddress> addresses;
-    word realAddress;
+    unsigned int unit;      // source file and line
     unsigned int line;
+    const char *rule;
+    unsigned int bytes;     // saved
+    unsigned int cycles;
+};
+
+/*
+ * Peephole
+ *
+ * What the optimizer knows at the end of the last instruction it saw: the
+ * instruction itself, and the register values that the straight-line code
+ * since the last jump target has left behind (-1: unknown). A label is a
+ * jump target, and so is the address a branch like 'bne *+5' goes to.
+ */
+struct Peephole
+{
+    unsigned int chunk = ~0u;   // the last instruction: its chunk, address and code
+    word address = 0;
+    word end = 0;               // the address after it
+    byte code = 0;
+    unsigned int labels = 0;    // 'labelCount' after it: a label defined since then starts a new block
+    unsigned int unit = 0, line = 0;
+    int a = -1, x = -1, y = -1;
+    int flags = -1;             // the value N and Z reflect
+    int carry = -1;
+    bool blind = false;         // code jumps somewhere that is not a label, nothing is rewritten until the next chunk
+    vector<word> targets;       // forward targets like 'bne *+5' that are still ahead: nothing may move before them
+    int rewritten = -1;         // the last address of the chunk where code was removed
 };
 
+/*
+ * SourceUnit
+ *
+ * A file taking part in the assembly: the main source, or a file pulled in
+ * by .include or .incbin. Files are loaded once per run and cached by name.
+ * Included sources are also split into lines and tokenized only once,
+ * however many times they are included.
+ */
+struct SourceUnit
+{
+    string name;                        // for error messages and resolving relative includes
+    string_view text;
+    SourceFile *file;                   // NULL for the main source, which belongs to the caller
+    bool tokenized;                     // 'lines' and 'tokens' are filled in
+    bool active;                        // being assembled right now (catches recursive includes)
+    vector<string_view> lines;          // trimmed lines
+    vector<Token> tokens;               // tokens of all lines, back to back
+    vector<unsigned int> lineTokens;    // index of the first token of each line, plus the end
+};
+
+/*
+ * Macro
+ *
+ * The body of a .macro or a .rept block. The lines are copied and tokenized
+ * once, when the block is read, and the tokens that stand for a parameter
+ * are marked right away. An expansion copies the tokens and puts the tokens
+ * of the arguments in place of the parameters, nothing is lexed again.
+ */
+struct Macro
+{
+    unsigned int paramCount;
+    string text;                        // the lines back to back
+    vector<unsigned int> lineStart;     // offset of each line in 'text', plus the end
+    vector<Token> tokens;               // tokens of all lines, back to back (offsets are relative to their line)
+    vector<signed char> param;          // for each token: the parameter it stands for, -1 if none
+    vector<unsigned int> lineTokens;    // index of the first token of each line, plus the end
+};
+
+/*
+ * Expansion
+ *
+ * Buffers of a macro or .rept expansion in progress. There is one for each
+ * level of nesting, so they keep their capacity from one expansion to the next.
+ */
+struct Expansion
+{
+    string args;                    // the text of the invoking line
+    vector<Token> argTokens;        // tokens of the arguments, back to back (without the commas)
+    vector<unsigned int> argStart;  // index of the first token of each argument, plus the end
+    string line;                    // the line being expanded
+};
+
+#define MACRO_MAX_PARAMS 32
+#define MACRO_MAX_NESTING 64    // macros expanded within each other, catches a macro calling itself
+#define REPT_MAX_COUNT 65536
+
 /*
  * BASSembler6502
  *
@@ -93,116 +329,180 @@ struct UnresolvedLabel
  */
 class BASSembler6502
 {
-	vector<string> lines;
+	vector<SourceUnit *> units; // [0] is the main source, the rest are included files
+	map<string, unsigned int> unitCache; // canonical file name -> index in 'units'
+	unsigned int actUnit; // the unit being assembled
 	word actAddress;
+	byte *memory; // the 64K image all chunks are assembled into, allocated on first use
 	vector<MemChunk> chunks; // see MemChunk for info
-	MemChunk *actChunk; // current chunk we assemble into. must be added to the 'chunks' vector and reset when we change the .pc
-	int charset;
-	string petsciiChars;
-	string screenChars;
-    map<string, word> labels;
-    map<string, Opcode> opcodeMap;
-    string singleByteInstructions;
-    string singleByteInstructionsSpecial; // some instructions have a one byte version as well, they are listed here
-    map<string, UnresolvedLabel> unresolvedLabels;
+	MemChunk *actChunk; // current chunk we assemble into, always the last element of 'chunks'
+	const Charset *charset; // .text is converted with this (.ascii, .petscii, .screen, .charset)
+	Charset userCharset; // loaded by .charset
+    SymbolTable symbols; // labels
+    vector<Fixup> fixups; // forward references, patched at the end of assemble()
+    vector<ExprTerm> exprTerms; // expressions of the fixups, back to back
+    bool externalLabels; // labels that are not defined are left to the linker, see allowExternals()
+    vector<Fixup> externals; // the fixups that refer to them, kept by resolveFixups()
+
+    // zero page relaxation, see relaxLayout()
+    vector<RelaxSite> sites; // recorded by the first pass, in source order
+    vector<ExprTerm> siteTerms; // expressions of the sites, back to back
+    unsigned int siteCount; // sites passed in the current pass
+    unsigned int chunkFirstSite; // 'siteCount' when the current chunk was started
+    vector<unsigned int> labelFirstSite, labelSite; // the same two for each label, when it was defined
+    bool finalPass; // sizes are taken from 'sites', nothing is recorded
+
+    // macros, see Macro
+    vector<Macro *> macros;
+    map<string, unsigned int> macroNames; // upper case name -> index in 'macros'
+    Macro *recording; // the .macro or .rept block whose lines are being read, NULL if none
+    string recordingName; // the macro's name, empty for .rept
+    vector<string> recordingParams;
+    int recordingCount; // .rept count
+    int recordingDepth; // .macro and .rept blocks opened inside the one being read
+    unsigned int recordingUnit, recordingLine; // where the block started
+    int recordingNesting; // 'expansionNesting' when the block started
+    int expansionNesting;
+    Expansion expansions[MACRO_MAX_NESTING];
+
+    AssemblyStats *stats; // NULL if nobody asked, see AssemblyStats
+    IncrementalAssembler *tracker; // told about every line of the main source, NULL if nobody asked
+    vector<InstructionRecord> *instructionLog; // every instruction of the last pass, NULL if nobody asked
+    int threads; // for the .pc segments of the main source, see SegmentAssembler
+    unsigned int labelCount; // labels defined in the current pass
+    bool optimize; // see setOptimize()
+    Peephole peephole;
+    vector<PeepholeRewrite> rewrites; // applied in the last pass
+	
+    vector<Token> tokens; // tokens of the line being assembled
 	
-	int assembleLine(string line, unsigned int lineNumber);
-	int checkDirectives(string &line);
-    int detectLabelDefinition(string line);
+	int assembleSource();
+	int assemblePass();
+	void startPass();
+	bool relaxLayout();
+	int assembleUnit(unsigned int unit);
+	int assembleStatement(string_view &line, unsigned int lineNumber);
+	int assembleLine(string_view line, unsigned int lineNumber);
+	int assembleInstruction(string_view line, int t, unsigned int lineNumber);
+    int optimizeInstruction(word start, const Token *op, unsigned int lineNumber);
+    void dropJumpTo(SymbolId label);
+    void retract(word start);
+    void addRewrite(unsigned int unit, unsigned int line, const char *rule, unsigned int bytes, unsigned int cycles);
+    int resolveFixups();
+    bool refersToUndefined(const Fixup &fixup) const;
+    int closeChunk();
+    int checkRoom(unsigned int bytes);
+    int loadUnit(string_view fileName, unsigned int &unit);
+    void tokenizeUnit(SourceUnit *unit);
+	int checkDirectives(string_view &line, unsigned int lineNumber);
+	int assembleData(string_view data, int size);
+    int detectLabelDefinition(string_view line);
+    int startRecording(string_view line, unsigned int lineNumber, const string &keyword);
+    int recordLine(string_view line);
+    int finishRecording(const string &keyword);
+    int expandMacro(string_view line, int t, unsigned int lineNumber);
+    int expandBody(const Macro &body, int count, unsigned int lineNumber);
+    void clearMacros();
 	
     // utility functions
-    int countChars(string text, char c);
-	int findChar(string text, char c);
-    int convertIntoDecimal(string valueStr);
-    
-    void initOpcodeTable(void);
+    int parseOperand(string_view line, const Token *op, Operand &operand);
+    int parseExpression(string_view line, const Token *op, const Token *&token, Operand &operand);
+    string operandString(string_view line, const Token *op);
+    static bool isOperator(const Token &token, char op);
+    static bool isRegister(string_view text, const Token &token, char reg);
+    static string upperCase(string_view text);
+    static void trimLine(string_view &line);
+    string_view sourceLine(unsigned int unit, unsigned int lineNumber);
+    void setErrorLine(unsigned int unit, unsigned int lineNumber, string_view line);
     
-    // declarations of regular expressions used across the assembler
-	pcrecpp::RE *remove_comments; //("\\s*;.*");
-	pcrecpp::RE *remove_leading_space; //("^\\s+(.+)");
-	pcrecpp::RE *remove_trailing_space; //("\\s+$");
-    pcrecpp::RE *searchDirective; //("\\s*\\..*"); // create regex "\s*\..*": looks for '.' in line, leading white space is allowed
-	pcrecpp::RE *extractKeyword; //("\\s*\\.(\\w+).*"); // extract keyword
-    pcrecpp::RE *extractMemoryAddress; //("\\s*.pc\\s*=\\s*\\$([a-f0-9]+)"); // extract memory address (without '$' character)
-    pcrecpp::RE *getDataElements; //("\\s*\\.\\w+\\s+(.*)\\s*"); // get whole line after directive excluding optional white space
-    pcrecpp::RE *getSingleElement; //("\\s*((%[0|1]+)|(\\$[0-9a-f]+)|([0-9]+))\\s*,\\s*");
-    pcrecpp::RE *getLastElement; //("\\s*((%[0|1]+)|(\\$[0-9a-f]+)|([0-9]+))\\s*"); // notice the absence of ','
-    pcrecpp::RE *getDataElements2; //("\\s*\\.\\w+\\s+\"(.*)\"$");
-    pcrecpp::RE *isEmptyLine; //("^\\s*$"); // if line is empty, return
-    pcrecpp::RE *detectLabelDef; //("^(\\S*):\\s*(.*)\\s*$"); // basically looks for some text followed by a colon (:)
-    pcrecpp::RE *detectLabelDefCorrectness; //("^([A-Z]+[A-Z0-9_!]*):.*");  // check if there is a legal label definition
-    pcrecpp::RE *removeLabelDefinition; //("^[A-Z]+[A-Z0-9_!]*:\\s*(.*)\\s*");
-    pcrecpp::RE *getInstructionElements; //("\\s*([a-zA-Z]{3})\\s*(.*)"); // $1 = opcode, $2 = operand
-    pcrecpp::RE *checkImmediateAddr; //("^#(.*)");
-    pcrecpp::RE *checkZPorAbsolute; //("^\\$[0-9A-F]+");
-    pcrecpp::RE *checkZPXorAbsoluteX; //("(\\$[0-9A-F]+)\\s*,\\s*X");
-    pcrecpp::RE *checkZPYorAbsoluteY; //("(\\$[0-9A-F]+)\\s*,\\s*Y");
-    pcrecpp::RE *checkIndirect; //("\\((\\$[0-9A-F]+)\\)");
-    pcrecpp::RE *checkIndexedIndirect; //("\\(\\s*(\\$[0-9A-F]+)\\s*,\\s*X\\s*\\)");
-    pcrecpp::RE *checkIndirectIndexed; //("\\(\\s*(\\$[0-9A-F]+)\\s*\\)\\s*,\\s*Y");
-    pcrecpp::RE *checkIfBin; //("^%([0-1]{8})");
-    pcrecpp::RE *checkIfHex; //("^\\$([0-9A-Z]+)");
-    pcrecpp::RE *checkIfDec; //("^([0-9]+)");
-    pcrecpp::RE *checkSimpleLabelReference;
-    pcrecpp::RE *checkXIndexedLabelReference;
-    pcrecpp::RE *checkYIndexedLabelReference;
-    pcrecpp::RE *checkIndirectLabelReference;
-	pcrecpp::RE *detectAsteriskExpression;
+    static const Opcode &findOpcode(const char *mnemonic, int length);
+
+    friend class IncrementalAssembler;
+    friend class SegmentAssembler;
+    friend class ObjectFile;
 
 public:
 	AssemblyError asmError; // the caller can fetch the error message here in case assemble() returns with an error
 
 	BASSembler6502()
     {
-        remove_comments = new pcrecpp::RE("\\s*;.*");
-        remove_leading_space = new pcrecpp::RE("^\\s+(.+)");
-        remove_trailing_space = new pcrecpp::RE("\\s+$");
-        searchDirective = new pcrecpp::RE("\\s*\\..*");
-        extractKeyword = new pcrecpp::RE("\\s*\\.(\\w+).*");
-        extractMemoryAddress = new pcrecpp::RE("\\s*.pc\\s*=\\s*\\$([a-f0-9]+)");
-        getDataElements = new pcrecpp::RE("\\s*\\.\\w+\\s+(.*)\\s*");
-        getSingleElement = new pcrecpp::RE("\\s*((%[0|1]+)|(\\$[0-9a-f]+)|([0-9]+))\\s*,\\s*");
-        getLastElement = new pcrecpp::RE("\\s*((%[0|1]+)|(\\$[0-9a-f]+)|([0-9]+))\\s*");
-        getDataElements2 = new pcrecpp::RE("\\s*\\.\\w+\\s+\"(.*)\"$");
-        isEmptyLine = new pcrecpp::RE("^\\s*$");
-        detectLabelDef = new pcrecpp::RE("^(\\S*):\\s*(.*)\\s*");
-        detectLabelDefCorrectness = new pcrecpp::RE("^([A-Z]+[A-Z0-9_!]*):.*");
-        removeLabelDefinition = new pcrecpp::RE("^[A-Z]+[A-Z0-9_!]*:\\s*(.*)\\s*");
-        getInstructionElements = new pcrecpp::RE("\\s*([a-zA-Z]{3})\\s*(.*)");
-        checkImmediateAddr = new pcrecpp::RE("^#[<>]?(.*)");
-        checkZPorAbsolute = new pcrecpp::RE("^\\$?[0-9A-F]+");
-        checkZPXorAbsoluteX = new pcrecpp::RE("(\\$[0-9A-F]+)\\s*,\\s*X");
-        checkZPYorAbsoluteY = new pcrecpp::RE("(\\$[0-9A-F]+)\\s*,\\s*Y");
-        checkIndirect = new pcrecpp::RE("\\((\\$[0-9A-F]+)\\)");
-        checkIndexedIndirect = new pcrecpp::RE("\\(\\s*(\\$[0-9A-F]+)\\s*,\\s*X\\s*\\)");
-        checkIndirectIndexed = new pcrecpp::RE("\\(\\s*(\\$[0-9A-F]+)\\s*\\)\\s*,\\s*Y");
-        checkIfBin = new pcrecpp::RE("^%([0-1]+)");
-        checkIfHex = new pcrecpp::RE("^\\$([0-9A-Z]+)");
-        checkIfDec = new pcrecpp::RE("^([0-9]+)");
-        checkSimpleLabelReference = new pcrecpp::RE("#?([<>]?[A-Z]+[A-Z0-9_!]*)");
-        checkXIndexedLabelReference = new pcrecpp::RE("([A-Z]+[A-Z0-9_!]*)\\s*,\\s*X");
-        checkYIndexedLabelReference = new pcrecpp::RE("([A-Z]+[A-Z0-9_!]*)\\s*,\\s*Y");
-        checkIndirectLabelReference = new pcrecpp::RE("\\(\\s*([A-Z]+[A-Z0-9_!]*)\\s*\\)");
-        detectAsteriskExpression = new pcrecpp::RE("\\*\\s*([\\-|\\+])\\s*([0-9]+)");
+		memory = NULL;
+		actUnit = 0;
 		actChunk = NULL;
 		actAddress = 0;
-		charset = ASCII;
-		
-		petsciiChars = "                                 !\"#$%&'()*+,-./0123456789:;<=>?@abcdefghijklmno"
-					   "pqrstuvwxyz[\\]^_`ABCDEFGHIJKLMNOPQRSTUVWXYZ   ~                                 "
-					   "                          ✓     `ABCDEFGHIJKLMNOPQRSTUVWXYZ   ~                "
-					   "               ";
-		screenChars =  "@abcdefghijklmnopqrstuvwxyz[\\]^_ !\"#$%&'()*+,-./0123456789:;<=>?@abcdefghijklmno"
-					   "pqrstuvwxyz[\\]^_`ABCDEFGHIJKLMNOPQRSTUVWXYZ{\\}~ "
-					   "                                                                                "
-					   "                                                ";
-
-        initOpcodeTable();
+		charset = &asciiCharset;
+		siteCount = 0;
+		chunkFirstSite = 0;
+		finalPass = false;
+		recording = NULL;
+		recordingCount = recordingDepth = recordingNesting = expansionNesting = 0;
+		recordingUnit = recordingLine = 0;
+		stats = NULL;
+		tracker = NULL;
+		instructionLog = NULL;
+		threads = 1;
+		externalLabels = false;
+		labelCount = 0;
+		optimize = false;
 	};
 	
-	~BASSembler6502(){};
+	~BASSembler6502()
+	{
+		delete [] memory;
+		clearMacros();
+		for(int i=0; i<(int)units.size(); i++)
+		{
+			delete units[i]->file;
+			delete units[i];
+		}
+	};
 	
 	int assemble(char *source, vector<MemChunk> *&chunks);
+	int assemble(string_view source, vector<MemChunk> *&chunks, const string &fileName = "", AssemblyStats *stats = NULL);
+	void reset();
+
+	// threads to assemble the .pc segments of a source on (0: one per hardware thread).
+	// The result is the same as with a single thread, which is the default.
+	void setThreads(int threads) { this->threads = threads; }
+
+	// assembles a module for the linker: a label that is not defined anywhere
+	// is not an error, the references to it go into the object file (see ObjectFile).
+	// Such references are always absolute, never zero page.
+	void allowExternals(bool allow) { externalLabels = allow; }
+
+	// writes the value of a reference into a chunk, see resolveFixups()
+	static int applyFixup(MemChunk &chunk, byte kind, word address, int value, AssemblyError &error);
+
+	// every instruction the next assemble() emits is recorded in 'log' (NULL: none are).
+	// The log belongs to the caller, it is cleared at the start of each pass.
+	void recordInstructions(vector<InstructionRecord> *log) { instructionLog = log; }
+
+	// Rewrites the code as it is emitted to save bytes and cycles: loads of
+	// a value the register already holds, CLC/SEC when the carry is already
+	// so, JSR followed by RTS, and JMP to the next instruction. Labels get
+	// the addresses of the rewritten code. Assembles serially. Not for code
+	// that patches its own immediate operands.
+	void setOptimize(bool optimize) { this->optimize = optimize; }
+
+	// the rewrites of the last assemble(), see setOptimize()
+	const vector<PeepholeRewrite> &optimizations() const { return rewrites; }
+
+	// the name of a source unit, as in InstructionRecord and AssemblyError
+	const string &unitName(unsigned int unit) const { return units[unit]->name; }
+
+	// the labels of the last assemble()
+	const SymbolTable &labels() const { return symbols; }
+
+	// the files the last assemble() read besides the main source (.include, .incbin, .charset),
+	// with the contents it read
+	void sourceFiles(vector<string> &fileNames, vector<string_view> &texts) const
+	{
+		for(int i=1; i<(int)units.size(); i++)
+		{
+			fileNames.push_back(units[i]->name);
+			texts.push_back(units[i]->text);
+		}
+	}
 };
 
 /*
@@ -211,54 +511,53 @@ public:
  * Assembling works in a way that several independent memory chunks
  * might be produced along the way. One such "chunk" is defined with
  * this class. One byte is given to the chunk a time, just like a stack.
- * The size of the data buffer is dynamically expanded when needed.
+ *
+ * A chunk doesn't own its data: it is a view into the assembler's 64K
+ * memory image, starting at the chunk's start address, so emitting a byte
+ * is a single store with no growing or copying. The assembler makes sure
+ * that no chunk runs past $FFFF and that chunks don't overlap.
  *
  * The invoker of the assembler class must handle the produced collection
  * of chunks since these are the ultimate results of the assembly.
+ * The data stays valid as long as the assembler object exists.
  */
 class MemChunk
 {
-	word bufferSize;
 public:
 	word startAddress;
-	word length;
+	unsigned int length; // a full 64K chunk doesn't fit in a word
 	byte *data;
 	
 	MemChunk()
 	{
-		length = bufferSize = 0;
+		startAddress = 0;
+		length = 0;
 		data = NULL;
 	}
 
-	~MemChunk()
+	MemChunk(byte *image, word address)
 	{
+		startAddress = address;
+		length = 0;
+		data = image + address;
 	}
 	
 	void addByte(byte newByte)
 	{
-		if(data==NULL) // if this is called for the first time
-		{
-			data = new byte[256]; // then create initial data buffer
-			bufferSize = 256; // and set the length
-		}
-		
-		if(length==bufferSize) // if our buffer is full
-		{
-			if((bufferSize*2) > 65536) // cannot have a chunk larger than 64K
-			{
-				cout << "Internal error (2)" << endl;
-				exit(-1);
-			}
-			// 256, 512, 1024, 2048, 4086, 8192, 16384, 32768, 65536
-			byte *tmpBuffer = new byte[bufferSize*2]; // then create new, twice as ama.. big buffer
-			memcpy(tmpBuffer, data, bufferSize); // copy the content of the old one to the new one
-			delete [] data; // free up the old one
-			data = tmpBuffer; // redirect the pointer to the new buffer
-			// ps.: i know that there's such a thing called realloc(), but anyway. :)
-		}
-		
 		data[length++] = newByte;
-		//printf("addByte: [%.2d] new byte added %.2X\n", length, newByte);
+	}
+	
+	void addBytes(const byte *bytes, unsigned int count)
+	{
+		memcpy(data + length, bytes, count);
+		length += count;
+	}
+	
+	byte *reserve(unsigned int count) // for filling in several bytes at once
+	{
+		byte *space = data + length;
+		length += count;
+		return space;
 	}
 	
 	void addWord(word newWord)
@@ -267,15 +566,9 @@ public:
 		addByte((newWord & 0xff00)>>8);
 	}
 	
-	void finalize()
+	unsigned int endAddress() const // first address after the chunk, may be $10000
 	{
-		if(length==bufferSize)	// if the buffer happens to be exactly full
-			return;				// then we don't need to do anything
-		
-		byte *tmpBuffer = new byte[length]; // otherwise we tailor the buffer size exactly
-		memcpy(tmpBuffer, data, length);	// to the amount of data we're storing
-		delete [] data;
-		data = tmpBuffer;
+		return startAddress + length;
 	}
 
     void rewriteByteAtAddress(byte newData, word destAddress)
@@ -291,3 +584,5 @@ public:
         data[offset+1] = (byte)((newData & 0xff00) >> 8);
     }
 };
+
+#endif // BASSEMBLER6502_H
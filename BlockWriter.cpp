@@ -0,0 +1,96 @@
+/*
+ *  BlockWriter.cpp
+ *  6502assembler
+ *
+ *  Output of the assembled blocks: .prg files and hex dumps.
+ *
+ */
+
+#include "BlockWriter.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+using std::string;
+
+// the two digits of every byte, built when compiling
+struct HexTable
+{
+    char digits[256][2];
+
+    constexpr HexTable() : digits()
+    {
+        const char *hex = "0123456789ABCDEF";
+        for(int i=0; i<256; i++)
+        {
+            digits[i][0] = hex[i >> 4];
+            digits[i][1] = hex[i & 15];
+        }
+    }
+};
+
+static constexpr HexTable hexTable;
+
+// ----------------------------------------------------------------------------
+void BlockWriter::hexDump(string &out, const byte *data, unsigned int length)
+{
+    size_t start = out.size();
+    out.resize(start + length*3 + length/16);
+    char *p = &out[start];
+    for(unsigned int i=0; i<length; i++)
+    {
+        p[0] = hexTable.digits[data[i]][0];
+        p[1] = hexTable.digits[data[i]][1];
+        p[2] = ' ';
+        p += 3;
+        if((i & 15)==15)
+            *p++ = '\n';
+    }
+}
+
+// ----------------------------------------------------------------------------
+int BlockWriter::writePrg(const string &fileName, const MemChunk &chunk)
+{
+    int file = open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(file==-1)
+        return -1;
+
+    byte header[2] = { (byte)(chunk.startAddress & 0xff), (byte)(chunk.startAddress >> 8) };
+    struct iovec parts[2];
+    parts[0].iov_base = header;
+    parts[0].iov_len = 2;
+    parts[1].iov_base = chunk.data;
+    parts[1].iov_len = chunk.length;
+
+    struct iovec *part = parts;
+    int count = 2;
+    while(count>0)
+    {
+        ssize_t written = writev(file, part, count);
+        if(written<0)
+        {
+            if(errno==EINTR)
+                continue;
+            int error = errno;
+            close(file);
+            errno = error;
+            return -1;
+        }
+
+        // a short write: skip what went out, carry on with the rest
+        while((count>0) && ((size_t)written>=part->iov_len))
+        {
+            written -= part->iov_len;
+            part++;
+            count--;
+        }
+        if(count>0)
+        {
+            part->iov_base = (char *)part->iov_base + written;
+            part->iov_len -= written;
+        }
+    }
+
+    return close(file);
+}
@@ -0,0 +1,34 @@
+/*
+ *  BlockWriter.h
+ *  6502assembler
+ *
+ *  Output of the assembled blocks: .prg files and hex dumps.
+ *
+ */
+
+#ifndef BLOCKWRITER_H
+#define BLOCKWRITER_H
+
+#include <string>
+#include "BASSembler6502.h"
+
+/*
+ * BlockWriter
+ *
+ * Both outputs avoid copying the block: the hex dump is formatted straight
+ * into the caller's buffer, so a whole report goes out in one write, and a
+ * .prg file is written from the block's own bytes, with the load address
+ * in front of them in a separate buffer.
+ */
+class BlockWriter
+{
+public:
+    // Appends "A9 01 8D ..." to 'out', 16 bytes a line.
+    static void hexDump(std::string &out, const byte *data, unsigned int length);
+
+    // Writes the load address of the block (little endian) and its bytes.
+    // Returns 0, or -1 on error (errno is set).
+    static int writePrg(const std::string &fileName, const MemChunk &chunk);
+};
+
+#endif // BLOCKWRITER_H
@@ -0,0 +1,149 @@
+/*
+ *  Charset.cpp
+ *  6502assembler
+ *
+ *  Character set translation tables for .text
+ *
+ */
+
+#include "Charset.h"
+#include "Lexer6502.h"
+#include <vector>
+#include <sstream>
+
+using std::string;
+using std::string_view;
+using std::vector;
+
+// ----------------------------------------------------------------------------
+/*
+ * makeCharset
+ *
+ * Builds a translation table at compile time from a layout string: the
+ * character at position i gets code i. Spaces in the layout are only padding,
+ * the space character itself always gets code $20. If a character occurs
+ * more than once, its first position counts.
+ */
+static constexpr Charset makeCharset(const char *layout, const char *name)
+{
+    Charset charset = {};
+    charset.name = name;
+
+    for(int c=0; c<256; c++)
+        charset.unmappable[c] = 1;
+
+    for(int i=0; layout[i]; i++)
+    {
+        byte c = (byte)layout[i];
+        if((c!=' ') && charset.unmappable[c])
+        {
+            charset.codes[c] = (byte)i;
+            charset.unmappable[c] = 0;
+        }
+    }
+
+    charset.codes[(byte)' '] = 0x20;
+    charset.unmappable[(byte)' '] = 0;
+    return charset;
+}
+
+static constexpr Charset makeIdentityCharset(const char *name)
+{
+    Charset charset = {};
+    charset.name = name;
+
+    for(int c=0; c<256; c++)
+        charset.codes[c] = (byte)c;
+    return charset;
+}
+
+constexpr Charset asciiCharset = makeIdentityCharset("ASCII");
+
+constexpr Charset petsciiCharset = makeCharset(
+    "                                 !\"#$%&'()*+,-./0123456789:;<=>?@abcdefghijklmno"
+    "pqrstuvwxyz[\\]^_`ABCDEFGHIJKLMNOPQRSTUVWXYZ   ~", "PETSCII");
+
+constexpr Charset screenCharset = makeCharset(
+    "@abcdefghijklmnopqrstuvwxyz[\\]^_ !\"#$%&'()*+,-./0123456789:;<=>?@abcdefghijklmno"
+    "pqrstuvwxyz[\\]^_`ABCDEFGHIJKLMNOPQRSTUVWXYZ{\\}~", "screen code");
+
+static_assert(petsciiCharset.codes[(byte)'A']==0x61 && screenCharset.codes[(byte)'a']==0x01, "charset layout is broken");
+
+// ----------------------------------------------------------------------------
+/*
+ * load()
+ *
+ * Reads a user defined character set. Every line maps characters to codes:
+ *
+ *     "abcdefghijklmnopqrstuvwxyz" = $41  ; consecutive codes from $41 on
+ *     "\"" = $22                          ; \" and \\ as in .text
+ *     $5c = $1c                           ; a character given by its value
+ *
+ * Characters that are not mentioned are unmappable. Empty lines and ';'
+ * comments are skipped.
+ */
+int Charset::load(string_view text, string &error)
+{
+    for(int c=0; c<256; c++)
+    {
+        codes[c] = 0;
+        unmappable[c] = 1;
+    }
+    name = "user defined";
+
+    vector<Token> tokens;
+    size_t pos = 0;
+    unsigned int lineNumber = 0;
+    while(pos<text.size())
+    {
+        size_t end = text.find('\n', pos);
+        if(end==string_view::npos)
+            end = text.size();
+        string_view line = text.substr(pos, end-pos);
+        pos = end+1;
+        lineNumber++;
+
+        Lexer6502::tokenizeOperand(line, tokens);
+        if(tokens[0].type==TOK_END)
+            continue;
+
+        bool valid = ((tokens[0].type==TOK_STRING) || (tokens[0].type==TOK_NUMBER)) &&
+                     (tokens[1].type==TOK_OPERATOR) && (tokens[1].op=='=') &&
+                     (tokens[2].type==TOK_NUMBER) && (tokens[3].type==TOK_END);
+
+        // the characters on the left side
+        string characters;
+        if(valid && (tokens[0].type==TOK_NUMBER))
+        {
+            valid = (tokens[0].value<256);
+            characters += (char)tokens[0].value;
+        }
+        else if(valid)
+        {
+            string_view quoted = line.substr(tokens[0].start, tokens[0].length);
+            for(size_t i=0; i<quoted.size(); i++)
+            {
+                if((quoted[i]=='\\') && (i+1<quoted.size())) // escaped character
+                    i++;
+                characters += quoted[i];
+            }
+        }
+
+        int code = valid ? tokens[2].value : 0;
+        if(!valid || characters.empty() || (code + (int)characters.size() > 256))
+        {
+            std::stringstream ss;
+            ss << "Invalid character set definition in line " << lineNumber << ": " << line;
+            error = ss.str();
+            return -1;
+        }
+
+        for(size_t i=0; i<characters.size(); i++)
+        {
+            codes[(byte)characters[i]] = (byte)(code + i);
+            unmappable[(byte)characters[i]] = 0;
+        }
+    }
+
+    return 0;
+}
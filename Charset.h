@@ -0,0 +1,51 @@
+/*
+ *  Charset.h
+ *  6502assembler
+ *
+ *  Character set translation tables for .text
+ *
+ */
+
+#ifndef CHARSET_H
+#define CHARSET_H
+
+#include <string>
+#include <string_view>
+#include "types.h"
+
+/*
+ * Charset
+ *
+ * Maps every source byte straight to its target code. 'unmappable' is
+ * nonzero for bytes that have no code in the character set. Translating a
+ * string is one table lookup per character without branches (see translate()),
+ * the errors are collected in a single flag and only looked at afterwards.
+ */
+struct Charset
+{
+    byte codes[256];
+    byte unmappable[256];
+    const char *name;
+
+    // translates 'count' bytes from 'source' to 'dest', returns nonzero if any of them was unmappable
+    byte translate(const byte *source, byte *dest, unsigned int count) const
+    {
+        byte invalid = 0;
+        for(unsigned int i=0; i<count; i++)
+        {
+            dest[i] = codes[source[i]];
+            invalid |= unmappable[source[i]];
+        }
+        return invalid;
+    }
+
+    // loads a user defined character set, see Charset.cpp for the format.
+    // returns 0 on success, -1 on error (with the reason in 'error')
+    int load(std::string_view text, std::string &error);
+};
+
+extern const Charset asciiCharset;      // the bytes are copied unchanged
+extern const Charset petsciiCharset;    // Commodore PETSCII
+extern const Charset screenCharset;     // Commodore screen codes
+
+#endif // CHARSET_H
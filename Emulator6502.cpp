@@ -0,0 +1,438 @@
+/*
+ *  Emulator6502.cpp
+ *  6502assembler
+ *
+ *  Runs assembled code in-process, for testing routines.
+ *
+ */
+
+#include "Emulator6502.h"
+#include "OpcodeTable.h"
+#include <string.h> // memset(), memcmp()
+
+#define FLAG_C 0x01
+#define FLAG_Z 0x02
+#define FLAG_I 0x04
+#define FLAG_D 0x08
+#define FLAG_B 0x10
+#define FLAG_U 0x20 // always set
+#define FLAG_V 0x40
+#define FLAG_N 0x80
+
+// the N and Z flags of every value
+struct NZTable
+{
+    byte flags[256];
+
+    constexpr NZTable() : flags()
+    {
+        for(int i=0; i<256; i++)
+            flags[i] = (byte)((i & FLAG_N) | (i==0 ? FLAG_Z : 0));
+    }
+};
+
+static constexpr NZTable nzTable;
+
+static inline void setNZ(byte &p, byte value)
+{
+    p = (byte)((p & ~(FLAG_N | FLAG_Z)) | nzTable.flags[value]);
+}
+
+static inline word readWord(const byte *memory, word address)
+{
+    return (word)(memory[address] | (memory[(word)(address+1)] << 8));
+}
+
+// the pointer of an indirect mode: both bytes are in the zero page
+static inline word readZeroPageWord(const byte *memory, byte address)
+{
+    return (word)(memory[address] | (memory[(byte)(address+1)] << 8));
+}
+
+// ----------------------------------------------------------------------------
+// ADC and SBC, decimal mode as the NMOS 6502 does it: Z comes from the binary sum, N and V from
+// the sum after the low digit was adjusted; SBC takes all of them from the binary difference
+static inline void addWithCarry(Emulator6502 &cpu, byte value)
+{
+    int carry = cpu.p & FLAG_C;
+    int sum = cpu.a + value + carry;
+    byte p = (byte)(cpu.p & ~(FLAG_C | FLAG_V));
+
+    if(cpu.p & FLAG_D)
+    {
+        int low = (cpu.a & 0x0f) + (value & 0x0f) + carry;
+        if(low>=0x0a)
+            low = ((low + 0x06) & 0x0f) + 0x10;
+        int decimal = (cpu.a & 0xf0) + (value & 0xf0) + low;
+        setNZ(p, (byte)sum);
+        p = (byte)((p & ~FLAG_N) | (decimal & FLAG_N));
+        if(~(cpu.a ^ value) & (cpu.a ^ decimal) & 0x80)
+            p |= FLAG_V;
+        if(decimal>=0xa0)
+            decimal += 0x60;
+        if(decimal>=0x100)
+            p |= FLAG_C;
+        cpu.p = p;
+        cpu.a = (byte)decimal;
+        return;
+    }
+
+    if(~(cpu.a ^ value) & (cpu.a ^ sum) & 0x80)
+        p |= FLAG_V;
+    if(sum>0xff)
+        p |= FLAG_C;
+    setNZ(p, (byte)sum);
+    cpu.p = p;
+    cpu.a = (byte)sum;
+}
+
+static inline void subtractWithBorrow(Emulator6502 &cpu, byte value)
+{
+    if(!(cpu.p & FLAG_D))
+    {
+        addWithCarry(cpu, (byte)~value);
+        return;
+    }
+
+    int borrow = (cpu.p & FLAG_C) ? 0 : 1;
+    int difference = cpu.a - value - borrow;
+    byte p = (byte)(cpu.p & ~(FLAG_C | FLAG_V));
+    if((cpu.a ^ value) & (cpu.a ^ difference) & 0x80)
+        p |= FLAG_V;
+    if(difference>=0)
+        p |= FLAG_C;
+    setNZ(p, (byte)difference);
+
+    int low = (cpu.a & 0x0f) - (value & 0x0f) - borrow;
+    if(low<0)
+        low = ((low - 0x06) & 0x0f) - 0x10;
+    int decimal = (cpu.a & 0xf0) - (value & 0xf0) + low;
+    if(decimal<0)
+        decimal -= 0x60;
+    cpu.p = p;
+    cpu.a = (byte)decimal;
+}
+
+static inline void compare(byte &p, byte reg, byte value)
+{
+    p = (byte)((p & ~FLAG_C) | (reg>=value ? FLAG_C : 0));
+    setNZ(p, (byte)(reg - value));
+}
+
+/*
+ * execute()
+ *
+ * The handler of the instruction code CODE. Its addressing mode and its
+ * operation are looked up in the instruction table at compile time, so only
+ * the lines that apply to this one code are compiled into it.
+ */
+template<int CODE>
+void Emulator6502::execute(Emulator6502 &cpu)
+{
+    constexpr InstructionInfo info = instructionTable.codes[CODE];
+    if constexpr(info.key==0)
+    {
+        cpu.stopReason = EMULATOR_ILLEGAL;
+        cpu.limit = 0;
+        cpu.instructions--; // it didn't run
+        return;
+    }
+    else
+    {
+        constexpr word key = info.key;
+        constexpr int column = info.column;
+        byte *memory = cpu.memory;
+        word pc = cpu.pc;
+
+        // the effective address
+        word address = 0;
+        word base = 0; // of an indexed mode, to see if the index crosses a page
+        if constexpr(column==COLUMN_IMMEDIATE)
+            address = (word)(pc+1);
+        else if constexpr(column==COLUMN_ZERO_PAGE)
+            address = memory[(word)(pc+1)];
+        else if constexpr(column==COLUMN_ZERO_PAGE_X)
+            address = (byte)(memory[(word)(pc+1)] + cpu.x);
+        else if constexpr(column==COLUMN_ZERO_PAGE_Y)
+            address = (byte)(memory[(word)(pc+1)] + cpu.y);
+        else if constexpr(column==COLUMN_ABSOLUTE)
+            address = readWord(memory, (word)(pc+1));
+        else if constexpr(column==COLUMN_ABSOLUTE_X)
+            address = (word)((base = readWord(memory, (word)(pc+1))) + cpu.x);
+        else if constexpr(column==COLUMN_ABSOLUTE_Y)
+            address = (word)((base = readWord(memory, (word)(pc+1))) + cpu.y);
+        else if constexpr(column==COLUMN_INDEXED_INDIRECT)
+            address = readZeroPageWord(memory, (byte)(memory[(word)(pc+1)] + cpu.x));
+        else if constexpr(column==COLUMN_INDIRECT_INDEXED)
+            address = (word)((base = readZeroPageWord(memory, memory[(word)(pc+1)])) + cpu.y);
+        else if constexpr(column==COLUMN_INDIRECT) // the pointer doesn't cross a page: jmp ($10ff) reads $10ff and $1000
+        {
+            word pointer = readWord(memory, (word)(pc+1));
+            address = (word)(memory[pointer] | (memory[(pointer & 0xff00) | ((pointer+1) & 0xff)] << 8));
+        }
+        else if constexpr(column==COLUMN_RELATIVE)
+            address = (word)(pc + 2 + (signed char)memory[(word)(pc+1)]);
+
+        cpu.pc = (word)(pc + info.length);
+        cpu.cycles += info.cycles;
+        if constexpr(info.flags & INSTRUCTION_PAGE_PENALTY)
+            cpu.cycles += ((base ^ address) & 0xff00) ? 1 : 0;
+
+        // the operation
+        if constexpr(key==mnemonicKey("LDA"))
+            setNZ(cpu.p, cpu.a = memory[address]);
+        else if constexpr(key==mnemonicKey("LDX"))
+            setNZ(cpu.p, cpu.x = memory[address]);
+        else if constexpr(key==mnemonicKey("LDY"))
+            setNZ(cpu.p, cpu.y = memory[address]);
+        else if constexpr(key==mnemonicKey("STA"))
+            memory[address] = cpu.a;
+        else if constexpr(key==mnemonicKey("STX"))
+            memory[address] = cpu.x;
+        else if constexpr(key==mnemonicKey("STY"))
+            memory[address] = cpu.y;
+        else if constexpr(key==mnemonicKey("ADC"))
+            addWithCarry(cpu, memory[address]);
+        else if constexpr(key==mnemonicKey("SBC"))
+            subtractWithBorrow(cpu, memory[address]);
+        else if constexpr(key==mnemonicKey("AND"))
+            setNZ(cpu.p, cpu.a &= memory[address]);
+        else if constexpr(key==mnemonicKey("ORA"))
+            setNZ(cpu.p, cpu.a |= memory[address]);
+        else if constexpr(key==mnemonicKey("EOR"))
+            setNZ(cpu.p, cpu.a ^= memory[address]);
+        else if constexpr(key==mnemonicKey("CMP"))
+            compare(cpu.p, cpu.a, memory[address]);
+        else if constexpr(key==mnemonicKey("CPX"))
+            compare(cpu.p, cpu.x, memory[address]);
+        else if constexpr(key==mnemonicKey("CPY"))
+            compare(cpu.p, cpu.y, memory[address]);
+        else if constexpr(key==mnemonicKey("BIT"))
+        {
+            byte value = memory[address];
+            cpu.p = (byte)((cpu.p & ~(FLAG_N | FLAG_V | FLAG_Z)) | (value & (FLAG_N | FLAG_V)) | ((cpu.a & value) ? 0 : FLAG_Z));
+        }
+        else if constexpr((key==mnemonicKey("ASL")) || (key==mnemonicKey("LSR")) || (key==mnemonicKey("ROL")) || (key==mnemonicKey("ROR")))
+        {
+            byte &target = (column==COLUMN_IMPLIED) ? cpu.a : memory[address];
+            byte value = target;
+            byte carry;
+            if constexpr(key==mnemonicKey("ASL"))
+            {
+                carry = value >> 7;
+                value = (byte)(value << 1);
+            }
+            else if constexpr(key==mnemonicKey("LSR"))
+            {
+                carry = value & 1;
+                value = (byte)(value >> 1);
+            }
+            else if constexpr(key==mnemonicKey("ROL"))
+            {
+                carry = value >> 7;
+                value = (byte)((value << 1) | (cpu.p & FLAG_C));
+            }
+            else
+            {
+                carry = value & 1;
+                value = (byte)((value >> 1) | ((cpu.p & FLAG_C) << 7));
+            }
+            target = value;
+            cpu.p = (byte)((cpu.p & ~FLAG_C) | carry);
+            setNZ(cpu.p, value);
+        }
+        else if constexpr(key==mnemonicKey("INC"))
+            setNZ(cpu.p, ++memory[address]);
+        else if constexpr(key==mnemonicKey("DEC"))
+            setNZ(cpu.p, --memory[address]);
+        else if constexpr(key==mnemonicKey("INX"))
+            setNZ(cpu.p, ++cpu.x);
+        else if constexpr(key==mnemonicKey("INY"))
+            setNZ(cpu.p, ++cpu.y);
+        else if constexpr(key==mnemonicKey("DEX"))
+            setNZ(cpu.p, --cpu.x);
+        else if constexpr(key==mnemonicKey("DEY"))
+            setNZ(cpu.p, --cpu.y);
+        else if constexpr(key==mnemonicKey("TAX"))
+            setNZ(cpu.p, cpu.x = cpu.a);
+        else if constexpr(key==mnemonicKey("TXA"))
+            setNZ(cpu.p, cpu.a = cpu.x);
+        else if constexpr(key==mnemonicKey("TAY"))
+            setNZ(cpu.p, cpu.y = cpu.a);
+        else if constexpr(key==mnemonicKey("TYA"))
+            setNZ(cpu.p, cpu.a = cpu.y);
+        else if constexpr(key==mnemonicKey("TSX"))
+            setNZ(cpu.p, cpu.x = cpu.s);
+        else if constexpr(key==mnemonicKey("TXS"))
+            cpu.s = cpu.x;
+        else if constexpr(key==mnemonicKey("CLC"))
+            cpu.p &= (byte)~FLAG_C;
+        else if constexpr(key==mnemonicKey("SEC"))
+            cpu.p |= FLAG_C;
+        else if constexpr(key==mnemonicKey("CLI"))
+            cpu.p &= (byte)~FLAG_I;
+        else if constexpr(key==mnemonicKey("SEI"))
+            cpu.p |= FLAG_I;
+        else if constexpr(key==mnemonicKey("CLV"))
+            cpu.p &= (byte)~FLAG_V;
+        else if constexpr(key==mnemonicKey("CLD"))
+            cpu.p &= (byte)~FLAG_D;
+        else if constexpr(key==mnemonicKey("SED"))
+            cpu.p |= FLAG_D;
+        else if constexpr(column==COLUMN_RELATIVE)
+        {
+            bool taken;
+            if constexpr(key==mnemonicKey("BPL"))
+                taken = !(cpu.p & FLAG_N);
+            else if constexpr(key==mnemonicKey("BMI"))
+                taken = (cpu.p & FLAG_N);
+            else if constexpr(key==mnemonicKey("BVC"))
+                taken = !(cpu.p & FLAG_V);
+            else if constexpr(key==mnemonicKey("BVS"))
+                taken = (cpu.p & FLAG_V);
+            else if constexpr(key==mnemonicKey("BCC"))
+                taken = !(cpu.p & FLAG_C);
+            else if constexpr(key==mnemonicKey("BCS"))
+                taken = (cpu.p & FLAG_C);
+            else if constexpr(key==mnemonicKey("BNE"))
+                taken = !(cpu.p & FLAG_Z);
+            else
+                taken = (cpu.p & FLAG_Z);
+
+            if(taken)
+            {
+                cpu.cycles += ((cpu.pc ^ address) & 0xff00) ? 2 : 1;
+                cpu.pc = address;
+            }
+        }
+        else if constexpr(key==mnemonicKey("JMP"))
+            cpu.pc = address;
+        else if constexpr(key==mnemonicKey("JSR"))
+        {
+            word back = (word)(cpu.pc - 1);
+            memory[0x100 | cpu.s--] = (byte)(back >> 8);
+            memory[0x100 | cpu.s--] = (byte)back;
+            cpu.pc = address;
+        }
+        else if constexpr(key==mnemonicKey("RTS"))
+        {
+            if(cpu.s==cpu.returnStack) // the routine that run() called returns
+            {
+                cpu.stopReason = EMULATOR_RETURNED;
+                cpu.limit = 0;
+            }
+            byte low = memory[0x100 | ++cpu.s];
+            byte high = memory[0x100 | ++cpu.s];
+            cpu.pc = (word)(((high << 8) | low) + 1);
+        }
+        else if constexpr(key==mnemonicKey("RTI"))
+        {
+            cpu.p = (byte)((memory[0x100 | ++cpu.s] & ~FLAG_B) | FLAG_U);
+            byte low = memory[0x100 | ++cpu.s];
+            byte high = memory[0x100 | ++cpu.s];
+            cpu.pc = (word)((high << 8) | low);
+        }
+        else if constexpr(key==mnemonicKey("PHA"))
+            memory[0x100 | cpu.s--] = cpu.a;
+        else if constexpr(key==mnemonicKey("PHP"))
+            memory[0x100 | cpu.s--] = (byte)(cpu.p | FLAG_B | FLAG_U);
+        else if constexpr(key==mnemonicKey("PLA"))
+            setNZ(cpu.p, cpu.a = memory[0x100 | ++cpu.s]);
+        else if constexpr(key==mnemonicKey("PLP"))
+            cpu.p = (byte)((memory[0x100 | ++cpu.s] & ~FLAG_B) | FLAG_U);
+        else if constexpr(key==mnemonicKey("BRK")) // there is no interrupt handler, the run ends
+        {
+            cpu.pc = pc;
+            cpu.stopReason = EMULATOR_BRK;
+            cpu.limit = 0;
+        }
+        else
+            static_assert(key==mnemonicKey("NOP"), "an instruction of the opcode table is not emulated");
+    }
+}
+
+// ----------------------------------------------------------------------------
+template<size_t... CODES>
+constexpr Emulator6502::Handlers Emulator6502::makeHandlers(std::index_sequence<CODES...>)
+{
+    return Handlers{ { &execute<(int)CODES>... } };
+}
+
+const Emulator6502::Handlers Emulator6502::handlers = makeHandlers(std::make_index_sequence<256>());
+
+// ----------------------------------------------------------------------------
+Emulator6502::Emulator6502()
+{
+    reset();
+}
+
+void Emulator6502::reset()
+{
+    memset(memory, 0, sizeof(memory));
+    a = x = y = 0;
+    s = 0xff;
+    p = FLAG_U | FLAG_I;
+    pc = 0;
+    cycles = instructions = 0;
+    limit = 0;
+    returnStack = 0;
+    stopReason = EMULATOR_BUDGET;
+}
+
+void Emulator6502::load(const vector<MemChunk> &chunks)
+{
+    for(size_t i=0; i<chunks.size(); i++)
+        memcpy(memory + chunks[i].startAddress, chunks[i].data, chunks[i].length);
+}
+
+/*
+ * run()
+ *
+ * The loop only compares the cycles with the limit: an instruction that
+ * ends the run sets the limit to 0.
+ */
+int Emulator6502::run(word address, uint64_t cycleBudget)
+{
+    // a JSR from the current pc, the RTS that pulls this return address ends the run
+    word back = (word)(pc - 1);
+    memory[0x100 | s--] = (byte)(back >> 8);
+    memory[0x100 | s--] = (byte)back;
+    returnStack = s;
+    pc = address;
+
+    stopReason = EMULATOR_BUDGET;
+    limit = cycles + cycleBudget;
+    while(cycles<limit)
+    {
+        handlers.code[memory[pc]](*this);
+        instructions++;
+    }
+    return stopReason;
+}
+
+// ----------------------------------------------------------------------------
+void Emulator6502::changes(const byte *before, vector<MemoryChange> &changed) const
+{
+    unsigned int address = 0;
+    while(address<MEMORY_SIZE)
+    {
+        // skip the equal parts a block at a time
+        if((address%64==0) && (memcmp(memory + address, before + address, 64)==0))
+        {
+            address += 64;
+            continue;
+        }
+        if(memory[address]==before[address])
+        {
+            address++;
+            continue;
+        }
+
+        MemoryChange change;
+        change.address = (word)address;
+        while((address<MEMORY_SIZE) && (memory[address]!=before[address]))
+            address++;
+        change.length = address - change.address;
+        changed.push_back(change);
+    }
+}
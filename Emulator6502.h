@@ -0,0 +1,86 @@
+/*
+ *  Emulator6502.h
+ *  6502assembler
+ *
+ *  Runs assembled code in-process, for testing routines.
+ *
+ */
+
+#ifndef EMULATOR6502_H
+#define EMULATOR6502_H
+
+#include <vector>
+#include <utility> // index_sequence
+#include <stdint.h>
+#include "BASSembler6502.h"
+
+/*
+ * Why a run stopped, see Emulator6502::run()
+ */
+enum EmulatorStop
+{
+    EMULATOR_RETURNED,  // the RTS of the routine that was called
+    EMULATOR_BRK,       // a BRK, 'pc' is its address
+    EMULATOR_BUDGET,    // the cycle budget ran out
+    EMULATOR_ILLEGAL    // an illegal opcode, 'pc' is its address
+};
+
+// a run of bytes that changed, see Emulator6502::changes()
+struct MemoryChange
+{
+    word address;
+    unsigned int length;
+};
+
+/*
+ * Emulator6502
+ *
+ * An NMOS 6502 with the whole 64K as RAM, no I/O. Every instruction code
+ * has a handler of its own, compiled from its row of the opcode table (see
+ * instructionTable in OpcodeTable.h), so running an instruction is a single
+ * indirect call that knows its addressing mode and its operation at compile
+ * time. Cycles are counted per instruction, with the page crossing and
+ * taken branch penalties. Illegal opcodes stop the run.
+ */
+class Emulator6502
+{
+    uint64_t limit;         // the run ends when 'cycles' reaches it, see run()
+    byte returnStack;       // 's' at the call of the routine, its RTS ends the run
+    int stopReason;
+
+    typedef void (*Handler)(Emulator6502 &cpu);
+    struct Handlers
+    {
+        Handler code[256];
+    };
+    static const Handlers handlers; // by instruction code
+
+    template<int CODE> static void execute(Emulator6502 &cpu);
+    template<size_t... CODES> static constexpr Handlers makeHandlers(std::index_sequence<CODES...>);
+
+public:
+    byte memory[MEMORY_SIZE];
+    byte a, x, y, s, p;     // p: NV-BDIZC
+    word pc;
+    uint64_t cycles;        // since reset()
+    uint64_t instructions;
+
+    Emulator6502();
+
+    // clears the memory and the registers (s = $ff, p = $24)
+    void reset();
+
+    // copies the blocks of an assembly into the memory
+    void load(const vector<MemChunk> &chunks);
+
+    // Calls the routine at 'address' as if by a JSR, and runs it until it
+    // returns, a BRK or an illegal opcode, or until 'cycleBudget' more cycles
+    // have been spent. The registers and the memory are left as they are.
+    // Returns the reason, see EmulatorStop.
+    int run(word address, uint64_t cycleBudget);
+
+    // the bytes that differ from 'before' (a 64K image), in runs
+    void changes(const byte *before, vector<MemoryChange> &changed) const;
+};
+
+#endif // EMULATOR6502_H
@@ -0,0 +1,306 @@
+/*
+ *  Expression.cpp
+ *  6502assembler
+ *
+ *  Operand expressions: parsing with constant folding, deferred evaluation.
+ *
+ */
+
+#include "Expression.h"
+
+using std::string;
+using std::string_view;
+using std::vector;
+
+#define EXPR_MAX_NESTING 64 // parentheses and unary operators, keeps the recursion bounded
+
+// ----------------------------------------------------------------------------
+// precedence of a binary operator token, 0 if the token is not one
+static int precedence(const Token &token, byte &op)
+{
+    op = 0;
+    if(token.type!=TOK_OPERATOR)
+        return 0;
+
+    switch(token.op)
+    {
+        case '|':            op = EXPR_OR;  return 1;
+        case '^':            op = EXPR_XOR; return 2;
+        case '&':            op = EXPR_AND; return 3;
+        case OP_SHIFT_LEFT:  op = EXPR_SHL; return 4;
+        case OP_SHIFT_RIGHT: op = EXPR_SHR; return 4;
+        case '+':            op = EXPR_ADD; return 5;
+        case '-':            op = EXPR_SUB; return 5;
+        case '*':            op = EXPR_MUL; return 6;
+        case '/':            op = EXPR_DIV; return 6;
+        default:             return 0;
+    }
+}
+
+// ----------------------------------------------------------------------------
+/*
+ * apply
+ *
+ * Executes a single operator. The arithmetic wraps around like unsigned
+ * 32 bit math instead of overflowing, shifts by 32 or more give 0 (or -1
+ * for a negative value shifted right). Returns false on division by zero.
+ */
+static bool apply(byte op, int a, int b, int &result)
+{
+    unsigned int ua = (unsigned int)a, ub = (unsigned int)b;
+    switch(op)
+    {
+        case EXPR_NEGATE: result = (int)(0u - ua); break;
+        case EXPR_LOW:    result = a & 0xff; break;
+        case EXPR_HIGH:   result = (a >> 8) & 0xff; break;
+        case EXPR_ADD:    result = (int)(ua + ub); break;
+        case EXPR_SUB:    result = (int)(ua - ub); break;
+        case EXPR_MUL:    result = (int)(ua * ub); break;
+        case EXPR_AND:    result = a & b; break;
+        case EXPR_OR:     result = a | b; break;
+        case EXPR_XOR:    result = a ^ b; break;
+        case EXPR_SHL:    result = ((b<0) || (b>31)) ? 0 : (int)(ua << b); break;
+        case EXPR_SHR:    result = ((b<0) || (b>31)) ? ((a<0) ? -1 : 0) : (a >> b); break;
+        case EXPR_DIV:
+            if(b==0)
+                return false;
+            result = (b==-1) ? (int)(0u - ua) : (a / b); // INT_MIN/-1 would trap
+            break;
+    }
+    return true;
+}
+
+/*
+ * ExpressionParser
+ *
+ * Precedence climbing over the token stream. Terms are emitted in postfix
+ * order, and an operator whose operands are all numbers is evaluated on the
+ * spot instead of being emitted: in postfix form those operands are simply
+ * the last terms.
+ */
+class ExpressionParser
+{
+    string_view line;
+    const Token *&token;
+    SymbolTable &symbols;
+    int pc;
+    vector<ExprTerm> &terms;
+    size_t first; // the expression's first term, anything before belongs to someone else
+    int nesting;
+    bool keepLabels;
+    string &error;
+
+    bool isNumber(size_t fromEnd) const
+    {
+        return (terms.size() - first > fromEnd) && (terms[terms.size()-1-fromEnd].op==EXPR_NUMBER);
+    }
+
+    void push(byte op, int value)
+    {
+        ExprTerm term;
+        term.op = op;
+        term.value = value;
+        terms.push_back(term);
+    }
+
+    int emitUnary(byte op);
+    int emitBinary(byte op);
+    int parseUnary();
+    int parseBinary(int minPrecedence);
+
+public:
+    ExpressionParser(string_view line, const Token *&token, SymbolTable &symbols, int pc, vector<ExprTerm> &terms,
+                     bool keepLabels, string &error)
+        : line(line), token(token), symbols(symbols), pc(pc), terms(terms), first(terms.size()), nesting(0),
+          keepLabels(keepLabels), error(error)
+    {
+    }
+
+    int parse() { return parseBinary(1); }
+};
+
+// ----------------------------------------------------------------------------
+int ExpressionParser::emitUnary(byte op)
+{
+    if(isNumber(0))
+    {
+        apply(op, terms.back().value, 0, terms.back().value);
+        return 0;
+    }
+    push(op, 0);
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+int ExpressionParser::emitBinary(byte op)
+{
+    if(isNumber(0) && isNumber(1))
+    {
+        int b = terms.back().value;
+        terms.pop_back();
+        if(!apply(op, terms.back().value, b, terms.back().value))
+        {
+            error = "Division by zero";
+            return -1;
+        }
+        return 0;
+    }
+    push(op, 0);
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// a value, optionally preceded by unary operators
+int ExpressionParser::parseUnary()
+{
+    if(++nesting > EXPR_MAX_NESTING)
+    {
+        error = "Expression too complex";
+        return -1;
+    }
+
+    const Token &t = *token;
+    int result = 0;
+
+    if(t.type==TOK_NUMBER)
+    {
+        push(EXPR_NUMBER, t.value);
+        token++;
+    }
+    else if(t.type==TOK_LABEL)
+    {
+        SymbolId symbol = symbols.intern(line.data() + t.start, t.length);
+        if(symbols.isDefined(symbol) && !keepLabels)
+            push(EXPR_NUMBER, symbols.address(symbol));
+        else
+            push(EXPR_SYMBOL, (int)symbol);
+        token++;
+    }
+    else if((t.type==TOK_OPERATOR) && (t.op=='*')) // the current address
+    {
+        push(EXPR_NUMBER, pc);
+        token++;
+    }
+    else if((t.type==TOK_OPERATOR) && (t.op=='('))
+    {
+        token++;
+        result = parseBinary(1);
+        if((result==0) && !((token->type==TOK_OPERATOR) && (token->op==')')))
+        {
+            error = "Missing ')'";
+            result = -1;
+        }
+        if(result==0)
+            token++;
+    }
+    else if((t.type==TOK_OPERATOR) && ((t.op=='-') || (t.op=='<') || (t.op=='>')))
+    {
+        token++;
+        result = parseUnary();
+        if(result==0)
+            result = emitUnary((t.op=='-') ? EXPR_NEGATE : ((t.op=='<') ? EXPR_LOW : EXPR_HIGH));
+    }
+    else
+    {
+        error = (t.type==TOK_END) ? "Value expected" : "Unexpected '" + string(line.substr(t.start, t.length)) + "'";
+        result = -1;
+    }
+
+    nesting--;
+    return result;
+}
+
+// ----------------------------------------------------------------------------
+// operands joined by binary operators of at least 'minPrecedence'
+int ExpressionParser::parseBinary(int minPrecedence)
+{
+    if(parseUnary()==-1)
+        return -1;
+
+    byte op;
+    int actPrecedence;
+    while((actPrecedence = precedence(*token, op)) >= minPrecedence)
+    {
+        token++;
+        if(parseBinary(actPrecedence+1)==-1) // every operator is left associative
+            return -1;
+        if(emitBinary(op)==-1)
+            return -1;
+    }
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+int Expression::parse(string_view line, const Token *&token, SymbolTable &symbols, int pc,
+                      vector<ExprTerm> &terms, string &error, bool keepLabels)
+{
+    size_t first = terms.size();
+    ExpressionParser parser(line, token, symbols, pc, terms, keepLabels, error);
+    if(parser.parse()==-1)
+    {
+        terms.resize(first);
+        return -1;
+    }
+
+    // make sure the evaluation stack will do
+    int depth = 0;
+    for(size_t i=first; i<terms.size(); i++)
+    {
+        if((terms[i].op==EXPR_NUMBER) || (terms[i].op==EXPR_SYMBOL))
+            depth++;
+        else if(terms[i].op>=EXPR_ADD)
+            depth--;
+
+        if(depth>EXPR_MAX_DEPTH)
+        {
+            error = "Expression too complex";
+            terms.resize(first);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+int Expression::evaluate(const ExprTerm *terms, unsigned int count, const SymbolTable &symbols,
+                         int &value, string &error)
+{
+    int stack[EXPR_MAX_DEPTH];
+    int top = 0;
+
+    for(unsigned int i=0; i<count; i++)
+    {
+        const ExprTerm &term = terms[i];
+        switch(term.op)
+        {
+            case EXPR_NUMBER:
+                stack[top++] = term.value;
+                break;
+
+            case EXPR_SYMBOL:
+                if(!symbols.isDefined((SymbolId)term.value))
+                {
+                    error = "Unresolved label definition '" + symbols.name((SymbolId)term.value) + "'";
+                    return -1;
+                }
+                stack[top++] = symbols.address((SymbolId)term.value);
+                break;
+
+            case EXPR_NEGATE: case EXPR_LOW: case EXPR_HIGH:
+                apply(term.op, stack[top-1], 0, stack[top-1]);
+                break;
+
+            default: // binary operators
+                top--;
+                if(!apply(term.op, stack[top-1], stack[top], stack[top-1]))
+                {
+                    error = "Division by zero";
+                    return -1;
+                }
+                break;
+        }
+    }
+
+    value = stack[0];
+    return 0;
+}
@@ -0,0 +1,79 @@
+/*
+ *  Expression.h
+ *  6502assembler
+ *
+ *  Operand expressions: parsing with constant folding, deferred evaluation.
+ *
+ */
+
+#ifndef EXPRESSION_H
+#define EXPRESSION_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include "types.h"
+#include "Lexer6502.h"
+#include "SymbolTable.h"
+
+#define EXPR_MAX_DEPTH 32 // size of the evaluation stack, the parser rejects anything deeper
+
+/*
+ * ExprTerm
+ *
+ * One term of an expression in postfix form. Numbers and symbols push a
+ * value, operators pop their operands and push the result, so a whole
+ * expression is a flat run of terms that is evaluated with a small fixed
+ * stack and no allocation.
+ */
+enum ExprOp
+{
+    EXPR_NUMBER,    // 'value' is the number
+    EXPR_SYMBOL,    // 'value' is the id of a label (one that was not defined yet, see parse())
+    EXPR_NEGATE,    // -a
+    EXPR_LOW,       // <a
+    EXPR_HIGH,      // >a
+    EXPR_ADD,       // a+b
+    EXPR_SUB,       // a-b
+    EXPR_MUL,       // a*b
+    EXPR_DIV,       // a/b
+    EXPR_AND,       // a&b
+    EXPR_OR,        // a|b
+    EXPR_XOR,       // a^b
+    EXPR_SHL,       // a<<b
+    EXPR_SHR        // a>>b
+};
+
+struct ExprTerm
+{
+    byte op;        // see ExprOp
+    int value;
+};
+
+/*
+ * Expression
+ *
+ * Operators, from the lowest precedence to the highest:
+ *     |    ^    &    << >>    + -    * /    unary - < >
+ * Parentheses group, '*' in place of a value is the current address.
+ * Unary < and > take the low and high byte of the value right after them.
+ */
+class Expression
+{
+public:
+    // Parses the expression starting at 'token' and appends it to 'terms' in
+    // postfix form, leaving 'token' on the first token after it. Labels that are
+    // already defined are replaced by their address (unless 'keepLabels' is set)
+    // and every operation on known values is folded right away, so a constant
+    // expression ends up as a single EXPR_NUMBER term.
+    // Returns 0, or -1 with the reason in 'error'.
+    static int parse(std::string_view line, const Token *&token, SymbolTable &symbols, int pc,
+                     std::vector<ExprTerm> &terms, std::string &error, bool keepLabels = false);
+
+    // Evaluates 'count' terms once all their labels are defined.
+    // Returns 0, or -1 with the reason in 'error'.
+    static int evaluate(const ExprTerm *terms, unsigned int count, const SymbolTable &symbols,
+                        int &value, std::string &error);
+};
+
+#endif // EXPRESSION_H
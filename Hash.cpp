@@ -0,0 +1,109 @@
+/*
+ *  Hash.cpp
+ *  6502assembler
+ *
+ *  Fast 64-bit content hash.
+ *
+ */
+
+#include "Hash.h"
+#include <string.h>
+
+#define PRIME1 11400714785074694791ULL
+#define PRIME2 14029467366897019727ULL
+#define PRIME3 1609587929392839161ULL
+#define PRIME4 9650029242287828579ULL
+#define PRIME5 2870177450012600261ULL
+
+static inline uint64_t rotate(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// unaligned little endian reads
+static inline uint64_t read64(const unsigned char *p)
+{
+    uint64_t value = 0;
+    for(int i=7; i>=0; i--)
+        value = (value << 8) | p[i];
+    return value;
+}
+
+static inline uint64_t read32(const unsigned char *p)
+{
+    return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24);
+}
+
+static inline uint64_t mixLane(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME2;
+    acc = rotate(acc, 31);
+    return acc * PRIME1;
+}
+
+static inline uint64_t mergeRound(uint64_t acc, uint64_t value)
+{
+    acc ^= mixLane(0, value);
+    return acc * PRIME1 + PRIME4;
+}
+
+// ----------------------------------------------------------------------------
+uint64_t contentHash(const void *data, size_t length, uint64_t seed)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    const unsigned char *end = p + length;
+    uint64_t h;
+
+    if(length>=32) // four lanes of 8 bytes
+    {
+        uint64_t v1 = seed + PRIME1 + PRIME2;
+        uint64_t v2 = seed + PRIME2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME1;
+        const unsigned char *limit = end - 32;
+        do
+        {
+            v1 = mixLane(v1, read64(p));
+            v2 = mixLane(v2, read64(p+8));
+            v3 = mixLane(v3, read64(p+16));
+            v4 = mixLane(v4, read64(p+24));
+            p += 32;
+        } while(p<=limit);
+
+        h = rotate(v1, 1) + rotate(v2, 7) + rotate(v3, 12) + rotate(v4, 18);
+        h = mergeRound(h, v1);
+        h = mergeRound(h, v2);
+        h = mergeRound(h, v3);
+        h = mergeRound(h, v4);
+    }
+    else
+        h = seed + PRIME5;
+
+    h += (uint64_t)length;
+
+    // the tail
+    for(; p+8<=end; p+=8)
+    {
+        h ^= mixLane(0, read64(p));
+        h = rotate(h, 27) * PRIME1 + PRIME4;
+    }
+    if(p+4<=end)
+    {
+        h ^= read32(p) * PRIME1;
+        h = rotate(h, 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    for(; p<end; p++)
+    {
+        h ^= (*p) * PRIME5;
+        h = rotate(h, 11) * PRIME1;
+    }
+
+    // avalanche
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
@@ -0,0 +1,19 @@
+/*
+ *  Hash.h
+ *  6502assembler
+ *
+ *  Fast 64-bit content hash.
+ *
+ */
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// xxHash64 of 'length' bytes. Chaining the result into the seed of the
+// next call hashes several pieces as one key.
+uint64_t contentHash(const void *data, size_t length, uint64_t seed = 0);
+
+#endif // HASH_H
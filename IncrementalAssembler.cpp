@@ -0,0 +1,590 @@
+/*
+ *  IncrementalAssembler.cpp
+ *  6502assembler
+ *
+ *  Keeps a source assembled between edits, reassembles only what an edit touches.
+ *
+ */
+
+#include "IncrementalAssembler.h"
+#include <sstream>
+#include <algorithm>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+using std::stringstream;
+
+/*
+ * Hunk
+ *
+ * One change of a diff: the lines [first, last) of the old source are
+ * replaced by 'newLines'. An insertion has first==last.
+ */
+struct Hunk
+{
+    unsigned int first, last;
+    vector<string> oldLines, newLines;
+};
+
+// ----------------------------------------------------------------------------
+// splits a text into lines the same way BASSembler6502::assembleUnit() does
+static void splitLines(string_view text, vector<string> &lines)
+{
+    size_t pos = 0;
+    while(pos<text.size())
+    {
+        size_t end = text.find('\n', pos);
+        if(end==string_view::npos)
+            end = text.size();
+        lines.push_back(string(text.substr(pos, end-pos)));
+        pos = end+1;
+    }
+}
+
+// ----------------------------------------------------------------------------
+static LineInfo emptyLineInfo()
+{
+    LineInfo line;
+    line.chunk = line.chunkEnd = -1;
+    line.address = 0;
+    line.length = 0;
+    line.label = NO_SYMBOL;
+    line.site = line.siteEnd = 0;
+    line.charset = &asciiCharset;
+    line.simple = line.positional = line.opaque = line.inBlock = false;
+    line.alive = true;
+    return line;
+}
+
+// ----------------------------------------------------------------------------
+IncrementalAssembler::IncrementalAssembler()
+{
+    stamp = 0;
+    opaqueCount = 0;
+    endChunk = -1;
+    endAddress = 0;
+    endCharset = &asciiCharset;
+    scratch = new byte[MEMORY_SIZE + MEMORY_SLACK];
+    valid = false;
+    trackedLength = trackedLabels = 0;
+}
+
+IncrementalAssembler::~IncrementalAssembler()
+{
+    delete [] scratch;
+}
+
+// ----------------------------------------------------------------------------
+int IncrementalAssembler::load(string_view text, const string &fileName)
+{
+    name = fileName;
+    lines.clear();
+    splitLines(text, lines);
+    order.clear();
+    return reassemble();
+}
+
+/*
+ * reassemble()
+ *
+ * Assembles the whole source, and records every line of it on the way
+ * (see lineStarted() and lineDone()). Afterwards the line ids are the line
+ * numbers minus one again.
+ */
+int IncrementalAssembler::reassemble()
+{
+    if(!order.empty()) // put the lines back in source order, the deleted ones are dropped
+    {
+        vector<string> current;
+        current.reserve(order.size());
+        for(size_t i=0; i<order.size(); i++)
+            current.push_back(std::move(lines[order[i]]));
+        lines.swap(current);
+    }
+    order.resize(lines.size());
+    for(size_t i=0; i<order.size(); i++)
+        order[i] = (unsigned int)i;
+
+    source.clear();
+    for(size_t i=0; i<lines.size(); i++)
+    {
+        source += lines[i];
+        source += '\n';
+    }
+
+    info.assign(lines.size(), emptyLineInfo());
+    stamps.assign(lines.size(), 0);
+    users.clear();
+    opaqueCount = 0;
+
+    vector<MemChunk> *result;
+    assembler.tracker = this;
+    valid = (assembler.assemble(source, result, name)==0);
+    assembler.tracker = NULL;
+    if(!valid)
+        return -1;
+    delete result; // we work on the assembler's own chunks
+
+    endChunk = assembler.actChunk ? (int)assembler.chunks.size()-1 : -1;
+    endAddress = assembler.actAddress;
+    endCharset = assembler.charset;
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// a line of the main source is about to be assembled, its tokens are in assembler.tokens
+void IncrementalAssembler::lineStarted(string_view text, unsigned int lineNumber)
+{
+    BASSembler6502 &as = assembler;
+    if(lineNumber==1) // a new pass
+    {
+        users.clear();
+        opaqueCount = 0;
+    }
+
+    unsigned int id = lineNumber-1;
+    LineInfo &line = info[id];
+    line = emptyLineInfo();
+    line.chunk = as.actChunk ? (int)as.chunks.size()-1 : -1;
+    line.address = as.actAddress;
+    line.charset = as.charset;
+    line.site = as.siteCount;
+    line.inBlock = (as.recording!=NULL);
+    classify(id, text, line, !line.inBlock);
+    if(line.inBlock)
+        line.simple = false;
+
+    trackedLength = as.actChunk ? as.actChunk->length : 0; // the length of the chunk, to tell what the line added
+    trackedLabels = as.labelCount;
+}
+
+// ----------------------------------------------------------------------------
+void IncrementalAssembler::lineDone(unsigned int lineNumber)
+{
+    BASSembler6502 &as = assembler;
+    LineInfo &line = info[lineNumber-1];
+    line.chunkEnd = as.actChunk ? (int)as.chunks.size()-1 : -1;
+    line.length = ((line.chunk>=0) && (line.chunkEnd==line.chunk)) ? as.actChunk->length - trackedLength : 0;
+    line.siteEnd = as.siteCount;
+    if(as.recording!=NULL) // opened a block
+        line.simple = false;
+
+    bool hiddenLabels = (as.labelCount - trackedLabels) > ((line.label!=NO_SYMBOL) ? 1u : 0u);
+    line.opaque = !line.simple && ((line.length>0) || hiddenLabels);
+    if(line.opaque)
+        opaqueCount++;
+}
+
+/*
+ * classify()
+ *
+ * Decides from the tokens of a line whether it can be assembled on its own,
+ * and whether its bytes depend on its own address. If 'collect' is set, the
+ * line is added to the users of the labels it refers to.
+ */
+void IncrementalAssembler::classify(unsigned int id, string_view text, LineInfo &line, bool collect)
+{
+    BASSembler6502 &as = assembler;
+    const vector<Token> &tokens = as.tokens;
+
+    int t = (tokens[0].type==TOK_LABELDEF) ? 1 : 0;
+    line.label = t ? as.symbols.intern(text.data() + tokens[0].start, tokens[0].length) : NO_SYMBOL;
+    line.simple = false;
+    line.positional = false;
+
+    const Token &first = tokens[t];
+    if(first.type==TOK_END)
+        line.simple = true;
+    else if(first.type==TOK_DIRECTIVE)
+    {
+        // data only: the rest change the state of the assembler or pull in other files
+        string keyword(text.substr(first.start, first.length));
+        std::transform(keyword.begin(), keyword.end(), keyword.begin(), ::tolower);
+        line.simple = (keyword=="byte") || (keyword=="word") || (keyword=="fill") || (keyword=="res") ||
+                      ((keyword=="text") && (line.charset!=&as.userCharset)); // .charset may load another one later
+    }
+    else if(first.type==TOK_MNEMONIC)
+    {
+        const Opcode &opcode = BASSembler6502::findOpcode(text.data() + first.start, first.length);
+        line.simple = (opcode.name[0]!=0); // otherwise a macro
+        line.positional = (opcode.flags & OPCODE_BRANCH)!=0;
+    }
+
+    for(size_t i=t+1; i<tokens.size(); i++)
+    {
+        if((tokens[i].type==TOK_OPERATOR) && (tokens[i].op=='*')) // the current address, or a multiplication
+            line.positional = true;
+    }
+
+    if(!collect || !line.simple)
+        return;
+
+    for(size_t i=t+1; i<tokens.size(); i++)
+    {
+        if((tokens[i].type!=TOK_LABEL) || BASSembler6502::isRegister(text, tokens[i], 'X') || BASSembler6502::isRegister(text, tokens[i], 'Y'))
+            continue;
+
+        SymbolId symbol = as.symbols.intern(text.data() + tokens[i].start, tokens[i].length);
+        if(symbol>=users.size())
+            users.resize(as.symbols.size());
+        if(users[symbol].empty() || (users[symbol].back()!=id))
+            users[symbol].push_back(id);
+    }
+}
+
+/*
+ * encodeLine()
+ *
+ * Assembles a single line into the scratch image, at line.address.
+ * Returns 0, 1 if the line can't be assembled on its own (it is not simple,
+ * or refers to a label that is defined nowhere before or after it), or -1
+ * on error.
+ */
+int IncrementalAssembler::encodeLine(unsigned int id, LineInfo &line, bool collect)
+{
+    BASSembler6502 &as = assembler;
+    string_view text = lines[id];
+    BASSembler6502::trimLine(text);
+    Lexer6502::tokenizeLine(text, as.tokens);
+    classify(id, text, line, collect);
+    if(!line.simple)
+        return 1;
+
+    // the line is assembled into a chunk of its own, everything it may add to the assembler's state is undone
+    MemChunk chunk(scratch, line.address);
+    MemChunk *actChunk = as.actChunk;
+    const Charset *charset = as.charset;
+    word actAddress = as.actAddress;
+    bool finalPass = as.finalPass;
+    unsigned int siteCount = as.siteCount;
+    size_t fixupCount = as.fixups.size(), termCount = as.exprTerms.size();
+    size_t siteTotal = as.sites.size(), siteTermCount = as.siteTerms.size();
+
+    as.actChunk = &chunk;
+    as.actAddress = line.address;
+    as.charset = line.charset;
+    as.finalPass = false;
+    int result = as.assembleStatement(text, 0);
+    if((result==0) && (as.fixups.size()!=fixupCount)) // a label that isn't defined
+        result = 1;
+
+    as.actChunk = actChunk;
+    as.actAddress = actAddress;
+    as.charset = charset;
+    as.finalPass = finalPass;
+    as.siteCount = siteCount;
+    as.fixups.resize(fixupCount);
+    as.exprTerms.resize(termCount);
+    as.sites.resize(siteTotal);
+    as.siteTerms.resize(siteTermCount);
+
+    line.length = chunk.length;
+    return result;
+}
+
+// ----------------------------------------------------------------------------
+void IncrementalAssembler::addPatch(vector<Patch> &patches, int chunk, unsigned int address, unsigned int length)
+{
+    Patch patch;
+    patch.chunk = (unsigned int)chunk;
+    patch.offset = address - assembler.chunks[chunk].startAddress;
+    patch.length = length;
+    patches.push_back(patch);
+}
+
+/*
+ * patchHunk()
+ *
+ * Replaces the lines [first, last) by 'newLines'. If 'attempt' is set, the
+ * new lines are assembled and patched into the chunks. Returns 0 if that
+ * worked, 1 if the source needs a full assembly.
+ */
+int IncrementalAssembler::patchHunk(unsigned int first, unsigned int last, const vector<string> &newLines,
+                                    vector<Patch> &patches, bool attempt)
+{
+    BASSembler6502 &as = assembler;
+
+    // where the new lines go
+    int chunk = endChunk;
+    word address = endAddress;
+    const Charset *charset = endCharset;
+    bool inBlock = false;
+    if(first<order.size())
+    {
+        const LineInfo &at = info[order[first]];
+        chunk = at.chunk;
+        address = at.address;
+        charset = at.charset;
+        inBlock = at.inBlock;
+    }
+
+    bool possible = attempt && valid && (chunk>=0) && !inBlock;
+    unsigned int oldLength = 0;
+    vector<SymbolId> oldLabels;
+    vector<word> oldAddresses;
+    for(unsigned int i=first; i<last; i++)
+    {
+        const LineInfo &line = info[order[i]];
+        possible = possible && line.simple;
+        for(unsigned int s=line.site; s<line.siteEnd; s++)
+            possible = possible && !as.sites[s].pinned; // kept absolute by the relaxation, assembling it alone would differ
+        oldLength += line.length;
+        if(line.label!=NO_SYMBOL)
+        {
+            oldLabels.push_back(line.label);
+            oldAddresses.push_back(as.symbols.address(line.label));
+        }
+    }
+
+    // the text is edited in any case
+    vector<unsigned int> newIds;
+    for(size_t i=0; i<newLines.size(); i++)
+    {
+        newIds.push_back((unsigned int)lines.size());
+        lines.push_back(newLines[i]);
+        info.push_back(emptyLineInfo());
+        stamps.push_back(0);
+    }
+    for(unsigned int i=first; i<last; i++)
+        info[order[i]].alive = false;
+    order.erase(order.begin() + first, order.begin() + last);
+    order.insert(order.begin() + first, newIds.begin(), newIds.end());
+
+    if(!possible)
+        return 1;
+
+    // the new lines define the labels of the old ones again
+    for(size_t i=0; i<oldLabels.size(); i++)
+        as.symbols.undefine(oldLabels[i]);
+
+    unsigned int newLength = 0;
+    for(size_t i=0; i<newIds.size(); i++)
+    {
+        LineInfo &line = info[newIds[i]];
+        line.chunk = line.chunkEnd = chunk;
+        line.address = (word)(address + newLength);
+        line.charset = charset;
+        if(encodeLine(newIds[i], line, true)!=0)
+            return 1;
+        newLength += line.length;
+    }
+
+    vector<SymbolId> moved;
+    for(size_t i=0; i<oldLabels.size(); i++)
+    {
+        if(!as.symbols.isDefined(oldLabels[i])) // its users would fail, let the full assembly tell
+            return 1;
+        if(as.symbols.address(oldLabels[i])!=oldAddresses[i])
+            moved.push_back(oldLabels[i]);
+    }
+
+    // the lines behind the hunk in the same chunk move along
+    int delta = (int)newLength - (int)oldLength;
+    unsigned int behind = first + (unsigned int)newIds.size();
+    unsigned int stop = behind;
+    bool labelsBehind = false;
+    while((delta!=0) && (stop<order.size()))
+    {
+        const LineInfo &line = info[order[stop]];
+        if(line.chunk!=chunk)
+            break;
+        if(line.opaque)
+            return 1;
+        labelsBehind = labelsBehind || (line.label!=NO_SYMBOL);
+        stop++;
+        if(line.chunkEnd!=chunk) // .pc: it starts at the end of this chunk, the rest is in another one
+            break;
+    }
+    if((labelsBehind || !moved.empty()) && (opaqueCount>0)) // macros and included files may refer to them
+        return 1;
+
+    MemChunk &actChunk = as.chunks[chunk];
+    unsigned int end = actChunk.endAddress();
+    if(delta>0)
+    {
+        if(end + delta > MEMORY_SIZE)
+            return 1;
+        for(size_t i=0; i<as.chunks.size(); i++)
+        {
+            const MemChunk &other = as.chunks[i];
+            if(((int)i!=chunk) && (other.length>0) && (other.startAddress < end + delta) && (end < other.endAddress()))
+                return 1;
+        }
+    }
+
+    // patch the chunk
+    byte *memory = as.memory;
+    if(delta==0)
+    {
+        unsigned int from = 0, to = newLength;
+        while((from<to) && (memory[address+from]==scratch[address+from]))
+            from++;
+        while((to>from) && (memory[address+to-1]==scratch[address+to-1]))
+            to--;
+        if(from<to)
+        {
+            memcpy(memory + address + from, scratch + address + from, to-from);
+            addPatch(patches, chunk, address + from, to-from);
+        }
+    }
+    else
+    {
+        memmove(memory + address + newLength, memory + address + oldLength, end - (address + oldLength));
+        memcpy(memory + address, scratch + address, newLength);
+        actChunk.length += delta;
+        addPatch(patches, chunk, address, actChunk.endAddress() - address); // everything behind the hunk moved
+    }
+
+    stamp++;
+    vector<unsigned int> dirty;
+    for(unsigned int i=behind; i<stop; i++)
+    {
+        LineInfo &line = info[order[i]];
+        line.address = (word)(line.address + delta);
+        if(line.label!=NO_SYMBOL)
+        {
+            as.symbols.define(line.label, line.address);
+            moved.push_back(line.label);
+        }
+        if(line.positional)
+        {
+            stamps[order[i]] = stamp;
+            dirty.push_back(order[i]);
+        }
+    }
+    if((chunk==endChunk) && (stop==order.size()))
+        endAddress = (word)(endAddress + delta);
+
+    // only the lines that refer to a label that moved are assembled again
+    for(size_t m=0; m<moved.size(); m++)
+    {
+        if(moved[m]>=users.size())
+            continue;
+        const vector<unsigned int> &lineIds = users[moved[m]];
+        for(size_t u=0; u<lineIds.size(); u++)
+        {
+            unsigned int id = lineIds[u];
+            if(info[id].alive && (stamps[id]!=stamp))
+            {
+                stamps[id] = stamp;
+                dirty.push_back(id);
+            }
+        }
+    }
+
+    for(size_t i=0; i<dirty.size(); i++)
+    {
+        LineInfo &line = info[dirty[i]];
+        unsigned int length = line.length;
+        if(line.label!=NO_SYMBOL)
+            as.symbols.undefine(line.label); // defined again, at the same address
+        if((encodeLine(dirty[i], line, false)!=0) || (line.length!=length)) // a size changed: the layout is different
+            return 1;
+
+        if(memcmp(memory + line.address, scratch + line.address, length)!=0)
+        {
+            memcpy(memory + line.address, scratch + line.address, length);
+            addPatch(patches, line.chunk, line.address, length);
+        }
+    }
+
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+void IncrementalAssembler::diffError(const string &message)
+{
+    AssemblyError &error = assembler.asmError;
+    error.errorString = message;
+    error.errorStringVerbose = "Diffs must be in the normal format of diff(1), without context.";
+    error.lineContent = "";
+    error.fileName = name;
+    error.errorLineNumber = 0;
+}
+
+/*
+ * update()
+ *
+ * Parses the diff and checks it against the source before anything is
+ * changed. The hunks are applied from the last one to the first one, so the
+ * line numbers of the diff stay valid.
+ */
+int IncrementalAssembler::update(string_view diff, vector<Patch> &patches)
+{
+    patches.clear();
+
+    vector<Hunk> hunks;
+    size_t pos = 0;
+    while(pos<diff.size())
+    {
+        size_t end = diff.find('\n', pos);
+        if(end==string_view::npos)
+            end = diff.size();
+        string_view line = diff.substr(pos, end-pos);
+        pos = end+1;
+
+        if(line.empty() || (line[0]=='\\')) // "\ No newline at end of file"
+            continue;
+
+        if(((line[0]=='<') || (line[0]=='>')) && !hunks.empty())
+        {
+            string text(line.substr((line.size()>1) ? 2 : 1));
+            (line[0]=='<' ? hunks.back().oldLines : hunks.back().newLines).push_back(text);
+            continue;
+        }
+        if((line.substr(0, 3)=="---") && !hunks.empty())
+            continue;
+
+        // a command: N[,N]aN[,N], N[,N]cN[,N] or N[,N]dN[,N]
+        string command(line);
+        char *rest;
+        long from = strtol(command.c_str(), &rest, 10);
+        long to = (*rest==',') ? strtol(rest+1, &rest, 10) : from;
+        char kind = *rest;
+        if(!isdigit((unsigned char)command[0]) || ((kind!='a') && (kind!='c') && (kind!='d')) || (to<from))
+        {
+            diffError("Invalid diff: " + command);
+            assembler.asmError.errorStringVerbose = "Diffs must be in the normal format of diff(1), without context.";
+            return -1;
+        }
+
+        Hunk hunk;
+        hunk.first = (kind=='a') ? (unsigned int)from : (unsigned int)from-1;
+        hunk.last = (kind=='a') ? (unsigned int)from : (unsigned int)to;
+        hunks.push_back(hunk);
+    }
+
+    // the old lines must be what we have
+    unsigned int previous = 0;
+    for(size_t h=0; h<hunks.size(); h++)
+    {
+        const Hunk &hunk = hunks[h];
+        bool matches = (hunk.first>=previous) && (hunk.last<=order.size()) && (hunk.oldLines.size()==hunk.last-hunk.first);
+        for(unsigned int i=0; matches && (i<hunk.oldLines.size()); i++)
+            matches = (lines[order[hunk.first+i]]==hunk.oldLines[i]);
+        if(!matches)
+        {
+            stringstream ss;
+            ss << "Diff doesn't match the source at line " << hunk.first+1;
+            diffError(ss.str());
+            assembler.asmError.errorStringVerbose = "Send 'reload' to read the file again.";
+            return -1;
+        }
+        previous = hunk.last;
+    }
+
+    bool patching = true;
+    for(size_t h=hunks.size(); h>0; h--)
+    {
+        const Hunk &hunk = hunks[h-1];
+        if(patchHunk(hunk.first, hunk.last, hunk.newLines, patches, patching)!=0)
+            patching = false;
+    }
+
+    if(patching)
+        return 0;
+
+    patches.clear();
+    return (reassemble()==-1) ? -1 : 1;
+}
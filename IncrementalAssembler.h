@@ -0,0 +1,118 @@
+/*
+ *  IncrementalAssembler.h
+ *  6502assembler
+ *
+ *  Keeps a source assembled between edits, reassembles only what an edit touches.
+ *
+ */
+
+#ifndef INCREMENTALASSEMBLER_H
+#define INCREMENTALASSEMBLER_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include "BASSembler6502.h"
+
+/*
+ * LineInfo
+ *
+ * What a line of the main source produced in the last assembly. Lines are
+ * identified by an id that stays the same while other lines are inserted or
+ * deleted around them.
+ */
+struct LineInfo
+{
+    int chunk;                  // index of the chunk it was assembled into, -1 if there was none
+    int chunkEnd;               // the chunk after the line (.pc starts a new one)
+    word address;               // actAddress before the line
+    unsigned int length;        // bytes emitted
+    SymbolId label;             // the label it defines, NO_SYMBOL if none
+    unsigned int site, siteEnd; // relaxation sites it passed, see RelaxSite
+    const Charset *charset;     // the one in effect for .text
+    bool simple;                // an instruction, data, a label or nothing: it can be assembled on its own
+    bool positional;            // its bytes depend on its own address (branches, '*')
+    bool opaque;                // not simple, and emitted bytes or defined labels we can't follow (macros, .include, ...)
+    bool inBlock;               // inside a .macro or .rept block
+    bool alive;                 // not deleted since the last full assembly
+};
+
+/*
+ * Patch
+ *
+ * A range of bytes that changed, relative to the start of its chunk.
+ */
+struct Patch
+{
+    unsigned int chunk;
+    unsigned int offset;
+    unsigned int length;
+};
+
+/*
+ * IncrementalAssembler
+ *
+ * Assembles a source once, then applies edits to it. An edit is assembled
+ * on its own, at the address of the lines it replaces, with every label
+ * already known. If its size differs, the rest of its chunk is moved, the
+ * labels behind it are moved along, and only the lines that refer to a moved
+ * label (or branch from a moved address) are encoded again. The result is a
+ * list of patches to the chunks.
+ *
+ * Anything that doesn't fit this model is assembled again from scratch:
+ * directives that start a chunk or change the state of the assembler, macros
+ * and includes whose labels would move, an instruction whose size changes
+ * because a label moved, or an edit with an error in it (so that the error
+ * is reported just like a normal assembly would).
+ */
+class IncrementalAssembler
+{
+    BASSembler6502 assembler;
+    string name;
+    string source;                      // the text of the last full assembly (the assembler refers to it)
+    vector<string> lines;               // the text of each line, by id
+    vector<unsigned int> order;         // line ids in source order
+    vector<LineInfo> info;              // by line id
+    vector<vector<unsigned int>> users; // by symbol: the simple lines that refer to it (may be stale)
+    vector<unsigned int> stamps;        // by line id, marks the lines already queued in an update
+    unsigned int stamp;
+    unsigned int opaqueCount;           // opaque lines in the source
+    int endChunk;                       // the state after the last line
+    word endAddress;
+    const Charset *endCharset;
+    byte *scratch;                      // lines are encoded here before they are compared and copied
+    bool valid;                         // the last assembly succeeded, its result can be patched
+
+    // the line being tracked during a full assembly
+    unsigned int trackedLength, trackedLabels;
+
+    int reassemble();
+    int patchHunk(unsigned int first, unsigned int last, const vector<string> &newLines, vector<Patch> &patches, bool attempt);
+    int encodeLine(unsigned int id, LineInfo &line, bool collect);
+    void classify(unsigned int id, string_view text, LineInfo &line, bool collect);
+    void diffError(const string &message);
+    void addPatch(vector<Patch> &patches, int chunk, unsigned int address, unsigned int length);
+
+    // called by BASSembler6502::assembleUnit() for each line of the main source
+    void lineStarted(string_view text, unsigned int lineNumber);
+    void lineDone(unsigned int lineNumber);
+    friend class BASSembler6502;
+
+public:
+    IncrementalAssembler();
+    ~IncrementalAssembler();
+
+    // Assembles 'text' from scratch. Returns 0, or -1 on error (see error()).
+    int load(string_view text, const string &fileName);
+
+    // Applies a diff to the source and assembles the result. The diff is in
+    // the normal format of diff(1) ("2c2", "5a6,7", "9,10d8" followed by the
+    // "< old" and "> new" lines). Returns 0 if only the bytes in 'patches'
+    // changed, 1 if the whole source had to be assembled again, -1 on error.
+    int update(string_view diff, vector<Patch> &patches);
+
+    const vector<MemChunk> &chunks() const { return assembler.chunks; }
+    const AssemblyError &error() const { return assembler.asmError; }
+};
+
+#endif // INCREMENTALASSEMBLER_H
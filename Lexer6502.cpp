@@ -0,0 +1,269 @@
+/*
+ *  Lexer6502.cpp
+ *  6502assembler
+ *
+ *  Single-pass line tokenizer for the assembler.
+ *
+ */
+
+#include "Lexer6502.h"
+#include <string.h> // memchr()
+
+using namespace std;
+
+#define NUMBER_OVERFLOW 0x1000000 // large enough to fail every range check, small enough not to overflow an int
+
+// ----------------------------------------------------------------------------
+bool Lexer6502::isIdentifierStart(char c)
+{
+    return ((c>='A') && (c<='Z')) || ((c>='a') && (c<='z'));
+}
+
+// ----------------------------------------------------------------------------
+bool Lexer6502::isIdentifierChar(char c)
+{
+    return isIdentifierStart(c) || ((c>='0') && (c<='9')) || (c=='_') || (c=='!');
+}
+
+// ----------------------------------------------------------------------------
+/*
+ * scanNumber
+ *
+ * Scans a number starting at 'pos'. The format is decided by the first character:
+ * '$' means hexadecimal, '%' means binary, a digit means decimal.
+ * Returns the position after the number. If no digits follow the prefix,
+ * the token is marked as TOK_INVALID.
+ */
+int Lexer6502::scanNumber(const char *text, int length, int pos, Token &token)
+{
+    int base = 10;
+    int i = pos;
+
+    if(text[i]=='$')
+    {
+        base = 16;
+        i++;
+    }
+    else if(text[i]=='%')
+    {
+        base = 2;
+        i++;
+    }
+
+    int value = 0;
+    int digitStart = i;
+    for(; i<length; i++)
+    {
+        char c = text[i];
+        int digit;
+        if((c>='0') && (c<='9'))
+            digit = c - '0';
+        else if((c>='A') && (c<='F'))
+            digit = c - 'A' + 10;
+        else if((c>='a') && (c<='f'))
+            digit = c - 'a' + 10;
+        else
+            break;
+
+        if(digit>=base)
+            break;
+
+        if(value<NUMBER_OVERFLOW) // saturate instead of overflowing
+            value = value*base + digit;
+    }
+
+    if(value>NUMBER_OVERFLOW)
+        value = NUMBER_OVERFLOW;
+
+    token.type = (i==digitStart) ? TOK_INVALID : TOK_NUMBER;
+    token.value = value;
+    token.length = i - pos;
+    return i;
+}
+
+// ----------------------------------------------------------------------------
+// 'byte' or 'word', in any case
+bool Lexer6502::isDataDirective(const char *keyword, int length)
+{
+    if(length!=4)
+        return false;
+
+    char lower[4];
+    for(int i=0; i<4; i++)
+        lower[i] = keyword[i] | 0x20; // letters only, anything else won't match anyway
+    return (memcmp(lower, "byte", 4)==0) || (memcmp(lower, "word", 4)==0);
+}
+
+// ----------------------------------------------------------------------------
+int Lexer6502::tokenizeLine(string_view line, vector<Token> &tokens, bool dataTokens)
+{
+    return tokenize(line, tokens, true, dataTokens);
+}
+
+void Lexer6502::tokenizeOperand(string_view operand, vector<Token> &tokens)
+{
+    tokenize(operand, tokens, false, false);
+}
+
+// ----------------------------------------------------------------------------
+static inline bool isSpace(char c)
+{
+    return (c==' ') || (c=='\t') || (c=='\r') || (c=='\n') || (c=='\v') || (c=='\f');
+}
+
+// ----------------------------------------------------------------------------
+/*
+ * tokenize
+ *
+ * The actual scanner shared by tokenizeLine() and tokenizeOperand().
+ * 'statement' tells whether label definitions and mnemonics are expected.
+ */
+int Lexer6502::tokenize(string_view line, vector<Token> &tokens, bool statement, bool dataTokens)
+{
+    const char *text = line.data();
+    int length = (int)line.length();
+    int commentStart = length;
+    bool expectMnemonic = statement;
+
+    tokens.clear();
+
+    int i = 0;
+    while(i<length)
+    {
+        char c = text[i];
+
+        if(isSpace(c))
+        {
+            i++;
+            continue;
+        }
+
+        if(c==';') // rest of the line is a comment
+        {
+            commentStart = i;
+            break;
+        }
+
+        Token token;
+        token.type = TOK_INVALID;
+        token.op = 0;
+        token.value = 0;
+        token.start = i;
+        token.length = 1;
+
+        if(isIdentifierStart(c))
+        {
+            int j = i+1;
+            while((j<length) && isIdentifierChar(text[j]))
+                j++;
+            token.length = j - i;
+
+            if(statement && tokens.empty() && (j<length) && (text[j]==':')) // label definition
+            {
+                token.type = TOK_LABELDEF;
+                j++; // the colon belongs to the definition
+            }
+            else if(expectMnemonic)
+            {
+                token.type = TOK_MNEMONIC;
+                expectMnemonic = false;
+            }
+            else
+                token.type = TOK_LABEL;
+
+            tokens.push_back(token);
+            i = j;
+            continue;
+        }
+
+        expectMnemonic = false; // anything else at statement position ends the chance for a mnemonic
+
+        if(((c>='0') && (c<='9')) || (c=='$') || (c=='%'))
+        {
+            i = scanNumber(text, length, i, token);
+            tokens.push_back(token);
+            continue;
+        }
+
+        if((c=='.') && (i+1<length) && (isIdentifierChar(text[i+1]) && (text[i+1]!='!')))
+        {
+            int j = i+1;
+            while((j<length) && isIdentifierChar(text[j]) && (text[j]!='!'))
+                j++;
+            token.type = TOK_DIRECTIVE;
+            token.start = i+1;
+            token.length = j - i - 1;
+            tokens.push_back(token);
+            i = j;
+
+            // the values of a .byte or .word statement are scanned by the assembler
+            // straight from the text, only the start of the comment is needed
+            if(statement && !dataTokens && (tokens.size()==1) && isDataDirective(text+token.start, token.length))
+            {
+                const char *comment = (const char *)memchr(text+i, ';', length-i);
+                commentStart = comment ? (int)(comment-text) : length;
+                break;
+            }
+            continue;
+        }
+
+        if(c=='"')
+        {
+            int j = i+1;
+            while((j<length) && (text[j]!='"'))
+            {
+                if((text[j]=='\\') && (j+1<length)) // skip escaped characters
+                    j++;
+                j++;
+            }
+            if(j<length) // closing quotation mark found
+            {
+                token.type = TOK_STRING;
+                token.start = i+1;
+                token.length = j - i - 1;
+                j++;
+            }
+            else
+                token.length = j - i;
+
+            tokens.push_back(token);
+            i = j;
+            continue;
+        }
+
+        if(((c=='<') || (c=='>')) && (i+1<length) && (text[i+1]==c)) // shift
+        {
+            token.type = TOK_OPERATOR;
+            token.op = (c=='<') ? OP_SHIFT_LEFT : OP_SHIFT_RIGHT;
+            token.length = 2;
+            tokens.push_back(token);
+            i += 2;
+            continue;
+        }
+
+        switch(c)
+        {
+            case '#': case '<': case '>': case ',': case '(': case ')':
+            case '*': case '+': case '-': case '=': case ':': case '.':
+            case '/': case '&': case '|': case '^':
+                token.type = TOK_OPERATOR;
+                token.op = c;
+                break;
+            default:
+                break; // stays TOK_INVALID
+        }
+
+        tokens.push_back(token);
+        i++;
+    }
+
+    Token end;
+    end.type = TOK_END;
+    end.op = 0;
+    end.value = 0;
+    end.start = commentStart;
+    end.length = 0;
+    tokens.push_back(end);
+
+    return commentStart;
+}
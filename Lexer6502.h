@@ -0,0 +1,83 @@
+/*
+ *  Lexer6502.h
+ *  6502assembler
+ *
+ *  Single-pass line tokenizer for the assembler.
+ *
+ */
+
+#ifndef LEXER6502_H
+#define LEXER6502_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include "types.h"
+
+/*
+ * TokenType
+ *
+ * Kinds of tokens a source line is sliced into. Operator tokens
+ * (# < > , ( ) * + - = : / & | ^) are all TOK_OPERATOR with the character
+ * stored in Token::op. The two character operators << and >> have codes
+ * of their own.
+ */
+#define OP_SHIFT_LEFT  'L'  // <<
+#define OP_SHIFT_RIGHT 'R'  // >>
+
+enum TokenType
+{
+    TOK_END = 0,    // end of line (or start of a comment)
+    TOK_LABELDEF,   // 'LABEL:' at the beginning of the line
+    TOK_DIRECTIVE,  // '.keyword', the token text excludes the dot
+    TOK_MNEMONIC,   // the first word of a statement
+    TOK_LABEL,      // any other identifier (label reference, X, Y)
+    TOK_NUMBER,     // $hex, %bin or decimal number, value in Token::value
+    TOK_STRING,     // "quoted text", the token text excludes the quotes
+    TOK_OPERATOR,   // single character operator, see Token::op
+    TOK_INVALID     // something the lexer could not make sense of
+};
+
+/*
+ * Token
+ *
+ * A single token. Tokens don't own any text, they only refer to their
+ * position in the tokenized line.
+ */
+struct Token
+{
+    TokenType type;
+    char op;        // operator character for TOK_OPERATOR
+    int value;      // numerical value for TOK_NUMBER
+    int start;      // offset of the token in the line
+    int length;     // length of the token in characters
+};
+
+/*
+ * Lexer6502
+ *
+ * Scans a source line exactly once and produces a compact token stream.
+ * The token vector is always terminated with a TOK_END token, so the
+ * parser can look ahead without bounds checking.
+ */
+class Lexer6502
+{
+    static bool isIdentifierStart(char c);
+    static bool isIdentifierChar(char c);
+    static int scanNumber(const char *text, int length, int pos, Token &token);
+    static bool isDataDirective(const char *keyword, int length);
+    static int tokenize(std::string_view line, std::vector<Token> &tokens, bool statement, bool dataTokens);
+
+public:
+    // Tokenizes a whole source line. A leading identifier followed by a colon is
+    // reported as TOK_LABELDEF, the first word of the statement as TOK_MNEMONIC.
+    // A .byte or .word statement gives only the directive and the end token,
+    // unless 'dataTokens' is set (macro bodies need the values as tokens).
+    // Returns the offset where a ';' comment starts, or the length of the line.
+    static int tokenizeLine(std::string_view line, std::vector<Token> &tokens, bool dataTokens = false);
+
+    // Tokenizes an operand only (no label definitions or mnemonics expected)
+    static void tokenizeOperand(std::string_view operand, std::vector<Token> &tokens);
+};
+
+#endif // LEXER6502_H
@@ -0,0 +1,198 @@
+/*
+ *  Linker.cpp
+ *  6502assembler
+ *
+ *  Links object files into the blocks of a program.
+ *
+ */
+
+#include "Linker.h"
+#include <sstream>
+#include <string.h> // strlen()
+
+using std::string;
+using std::stringstream;
+using std::hex;
+
+// ----------------------------------------------------------------------------
+Linker::Linker()
+{
+    memory = NULL;
+    error.errorLineNumber = 0;
+}
+
+Linker::~Linker()
+{
+    delete [] memory;
+    for(size_t i=0; i<objects.size(); i++)
+        delete objects[i];
+}
+
+// ----------------------------------------------------------------------------
+int Linker::add(const char *fileName)
+{
+    ObjectFile *object = new ObjectFile();
+    if(object->open(fileName, error.errorString)==-1)
+    {
+        delete object;
+        return -1;
+    }
+    objects.push_back(object);
+    names.push_back(fileName);
+    return 0;
+}
+
+/*
+ * placeSections()
+ *
+ * Copies the sections into the image, in the order of the objects.
+ */
+int Linker::placeSections()
+{
+    if(memory==NULL)
+        memory = new byte[MEMORY_SIZE];
+
+    chunks.clear();
+    vector<size_t> owners; // the object of each chunk
+    for(size_t o=0; o<objects.size(); o++)
+    {
+        const ObjectFile &object = *objects[o];
+        for(uint32_t s=0; s<object.info().sections; s++)
+        {
+            const ObjectSection &section = object.sections()[s];
+            MemChunk chunk(memory, section.address);
+            for(size_t i=0; i<chunks.size(); i++)
+            {
+                const MemChunk &other = chunks[i];
+                if((section.length==0) || (other.length==0))
+                    continue;
+
+                if((section.address < other.endAddress()) && (other.startAddress < section.address + section.length))
+                {
+                    stringstream ss;
+                    ss << "Overlapping memory blocks: $" << hex << section.address << "-$" << section.address + section.length - 1
+                       << " in " << names[o] << " and $" << other.startAddress << "-$" << other.endAddress()-1 << " in " << names[owners[i]];
+                    error.errorString = ss.str();
+                    error.errorStringVerbose = "Each .pc block of the linked modules must occupy its own address range.";
+                    return -1;
+                }
+            }
+            chunk.addBytes(object.data() + section.data, section.length);
+            chunks.push_back(chunk);
+            owners.push_back(o);
+        }
+    }
+    return 0;
+}
+
+/*
+ * defineSymbols()
+ *
+ * Interns the symbols of every object into one table, and maps the symbol
+ * indices of each object to the ids there.
+ */
+void Linker::defineSymbols(vector<vector<SymbolId> > &symbolMaps)
+{
+    symbols.clear();
+    owner.clear();
+    duplicate.clear();
+    symbolMaps.resize(objects.size());
+    for(size_t o=0; o<objects.size(); o++)
+    {
+        const ObjectFile &object = *objects[o];
+        vector<SymbolId> &symbolMap = symbolMaps[o];
+        symbolMap.resize(object.info().symbols);
+        for(uint32_t s=0; s<object.info().symbols; s++)
+        {
+            const ObjectSymbol &symbol = object.symbols()[s];
+            const char *name = object.strings() + symbol.name;
+            SymbolId id = symbols.intern(name, (int)strlen(name));
+            symbolMap[s] = id;
+            if(id>=owner.size())
+            {
+                owner.resize(id+1, -1);
+                duplicate.resize(id+1, -1);
+            }
+
+            if(!(symbol.flags & OBJECT_SYMBOL_DEFINED))
+                continue;
+            if(owner[id]==-1)
+            {
+                owner[id] = (int)o;
+                symbols.define(id, symbol.address);
+            }
+            else if(duplicate[id]==-1)
+                duplicate[id] = (int)o;
+        }
+    }
+}
+
+/*
+ * relocate()
+ *
+ * Patches the references of an object. Its terms are translated to the
+ * ids of the linker's symbol table and evaluated like a fixup's.
+ */
+int Linker::relocate(size_t object, const vector<SymbolId> &symbolMap, size_t sectionBase)
+{
+    const ObjectFile &file = *objects[object];
+    vector<ExprTerm> terms;
+    for(uint32_t r=0; r<file.info().relocations; r++)
+    {
+        const ObjectRelocation &relocation = file.relocations()[r];
+        terms.resize(relocation.terms);
+        for(uint32_t t=0; t<relocation.terms; t++)
+        {
+            const ObjectTerm &term = file.terms()[relocation.expr + t];
+            terms[t].op = term.op;
+            terms[t].value = term.value;
+            if(term.op!=EXPR_SYMBOL)
+                continue;
+
+            SymbolId id = symbolMap[term.value];
+            terms[t].value = (int)id;
+            if(duplicate[id]!=-1)
+            {
+                error.errorString = "Label '" + symbols.name(id) + "' is defined in both " + names[owner[id]] + " and " + names[duplicate[id]];
+                error.errorStringVerbose = "A label that other modules refer to must be defined in only one of them.";
+                break;
+            }
+        }
+
+        MemChunk &chunk = chunks[sectionBase + relocation.section];
+        int value;
+        if(!error.errorString.empty() ||
+           (Expression::evaluate(terms.data(), relocation.terms, symbols, value, error.errorString)==-1) || // a label no module defines
+           (BASSembler6502::applyFixup(chunk, relocation.kind, chunk.startAddress + relocation.offset, value, error)==-1))
+        {
+            error.fileName = file.strings() + relocation.file;
+            error.errorLineNumber = relocation.line;
+            error.lineContent = "(in " + names[object] + ")";
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+int Linker::link(vector<MemChunk> *&chunks)
+{
+    error.lineContent = error.errorString = error.errorStringVerbose = error.fileName = "";
+    error.errorLineNumber = 0;
+
+    vector<vector<SymbolId> > symbolMaps;
+    if(placeSections()==-1)
+        return -1;
+    defineSymbols(symbolMaps);
+
+    size_t sectionBase = 0;
+    for(size_t o=0; o<objects.size(); o++)
+    {
+        if(relocate(o, symbolMaps[o], sectionBase)==-1)
+            return -1;
+        sectionBase += objects[o]->info().sections;
+    }
+
+    chunks = new vector<MemChunk>(this->chunks);
+    return 0;
+}
@@ -0,0 +1,56 @@
+/*
+ *  Linker.h
+ *  6502assembler
+ *
+ *  Links object files into the blocks of a program.
+ *
+ */
+
+#ifndef LINKER_H
+#define LINKER_H
+
+#include <string>
+#include <vector>
+#include "BASSembler6502.h"
+#include "ObjectFile.h"
+
+/*
+ * Linker
+ *
+ * The sections of all objects keep the addresses their .pc gave them, they
+ * are copied into one 64K image and must not overlap. A symbol that a
+ * relocation refers to must be defined by exactly one object; symbols that
+ * several objects define are fine as long as nobody refers to them. Then
+ * every relocation is patched like a fixup of the assembler (see
+ * BASSembler6502::applyFixup()), and the blocks are the sections in the
+ * order of the objects.
+ */
+class Linker
+{
+    vector<ObjectFile *> objects;
+    vector<string> names;       // of the object files, for error messages
+    byte *memory;
+    vector<MemChunk> chunks;
+    SymbolTable symbols;        // of all objects
+    vector<int> owner;          // by symbol id: the object that defines it, -1 if none
+    vector<int> duplicate;      // another object that defines it too, -1 if none
+
+    int placeSections();
+    void defineSymbols(vector<vector<SymbolId> > &symbolMaps);
+    int relocate(size_t object, const vector<SymbolId> &symbolMap, size_t sectionBase);
+
+public:
+    AssemblyError error; // the reason if add() or link() fails
+
+    Linker();
+    ~Linker();
+
+    // Opens an object file. Returns 0, or -1 on error.
+    int add(const char *fileName);
+
+    // Links the objects added so far. The blocks stay valid as long as the
+    // linker exists. Returns 0, or -1 on error.
+    int link(vector<MemChunk> *&chunks);
+};
+
+#endif // LINKER_H
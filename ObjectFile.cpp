@@ -0,0 +1,242 @@
+/*
+ *  ObjectFile.cpp
+ *  6502assembler
+ *
+ *  Assembled modules for the linker.
+ *
+ */
+
+#include "ObjectFile.h"
+#include <string.h>
+#include <errno.h>
+
+using std::string;
+
+// ----------------------------------------------------------------------------
+template<typename Record>
+static void append(string &out, const Record &record)
+{
+    out.append((const char *)&record, sizeof(record));
+}
+
+// adds a name to the strings, returns its offset
+static uint32_t addString(string &strings, string_view name)
+{
+    uint32_t offset = (uint32_t)strings.size();
+    strings.append(name.data(), name.size());
+    strings += '\0';
+    return offset;
+}
+
+// ----------------------------------------------------------------------------
+int ObjectFile::write(const string &fileName, const BASSembler6502 &assembler, const vector<MemChunk> &chunks)
+{
+    ObjectHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, OBJECT_MAGIC, 4);
+    header.byteOrder = OBJECT_BYTE_ORDER;
+
+    string sections, symbols, relocations, terms, data;
+    string strings(1, '\0'); // offset 0 is the empty name
+
+    for(size_t i=0; i<chunks.size(); i++)
+    {
+        ObjectSection section;
+        section.data = (uint32_t)data.size();
+        section.length = chunks[i].length;
+        section.address = chunks[i].startAddress;
+        section.reserved = 0;
+        append(sections, section);
+        data.append((const char *)chunks[i].data, chunks[i].length);
+    }
+
+    // every label the module defines, then the ones its relocations refer to
+    const SymbolTable &labels = assembler.symbols;
+    vector<uint32_t> index(labels.size(), 0xffffffff);
+    uint32_t symbolCount = 0;
+    for(SymbolId id=0; id<labels.size(); id++)
+    {
+        if(!labels.isDefined(id))
+            continue;
+        ObjectSymbol symbol;
+        symbol.name = addString(strings, labels.nameView(id));
+        symbol.address = labels.address(id);
+        symbol.flags = OBJECT_SYMBOL_DEFINED;
+        append(symbols, symbol);
+        index[id] = symbolCount++;
+    }
+
+    vector<uint32_t> fileNames(assembler.units.size(), 0);
+    for(size_t i=0; i<assembler.units.size(); i++)
+        fileNames[i] = addString(strings, assembler.units[i]->name);
+
+    uint32_t termCount = 0;
+    for(size_t i=0; i<assembler.externals.size(); i++)
+    {
+        const Fixup &fixup = assembler.externals[i];
+        ObjectRelocation relocation;
+        relocation.expr = termCount;
+        relocation.line = fixup.line;
+        relocation.file = fileNames[fixup.unit];
+        relocation.section = (uint16_t)fixup.chunk;
+        relocation.offset = (uint16_t)(fixup.address - chunks[fixup.chunk].startAddress);
+        relocation.kind = fixup.kind;
+        relocation.reserved = 0;
+        relocation.terms = (uint16_t)fixup.terms;
+        append(relocations, relocation);
+
+        for(unsigned int t=0; t<fixup.terms; t++)
+        {
+            const ExprTerm &term = assembler.exprTerms[fixup.expr + t];
+            ObjectTerm out;
+            memset(&out, 0, sizeof(out));
+            out.op = term.op;
+            out.value = term.value;
+            if(term.op==EXPR_SYMBOL)
+            {
+                SymbolId id = (SymbolId)term.value;
+                if(labels.isDefined(id)) // one of ours, its address is final
+                {
+                    out.op = EXPR_NUMBER;
+                    out.value = labels.address(id);
+                }
+                else
+                {
+                    if(index[id]==0xffffffff)
+                    {
+                        ObjectSymbol symbol;
+                        symbol.name = addString(strings, labels.nameView(id));
+                        symbol.address = 0;
+                        symbol.flags = 0;
+                        append(symbols, symbol);
+                        index[id] = symbolCount++;
+                    }
+                    out.value = (int32_t)index[id];
+                }
+            }
+            append(terms, out);
+            termCount++;
+        }
+    }
+
+    strings.resize((strings.size() + 3) & ~(size_t)3, '\0'); // so the data stays aligned
+
+    header.sections = (uint32_t)chunks.size();
+    header.symbols = symbolCount;
+    header.relocations = (uint32_t)assembler.externals.size();
+    header.terms = termCount;
+    header.stringSize = (uint32_t)strings.size();
+    header.dataSize = (uint32_t)data.size();
+
+    string out;
+    append(out, header);
+    out += sections;
+    out += symbols;
+    out += relocations;
+    out += terms;
+    out += strings;
+    out += data;
+
+    return writeFileAtomically(fileName, out);
+}
+
+/*
+ * open()
+ *
+ * Nothing is copied: the tables are used right in the mapping, so they are
+ * checked first (see valid()).
+ */
+int ObjectFile::open(const char *fileName, string &error)
+{
+    header = NULL;
+    if(file.open(fileName)==-1)
+    {
+        error = string("File open error: ") + fileName + " (" + strerror(errno) + ")";
+        return -1;
+    }
+
+    string_view text = file.text();
+    const ObjectHeader *head = (const ObjectHeader *)text.data();
+    if((text.size()<sizeof(ObjectHeader)) || (memcmp(head->magic, OBJECT_MAGIC, 4)!=0))
+    {
+        error = string("Not an object file: ") + fileName;
+        return -1;
+    }
+    if(head->byteOrder!=OBJECT_BYTE_ORDER)
+    {
+        error = string("Object file of another byte order: ") + fileName;
+        return -1;
+    }
+
+    uint64_t size = sizeof(ObjectHeader) + (uint64_t)head->sections*sizeof(ObjectSection) + (uint64_t)head->symbols*sizeof(ObjectSymbol) +
+                    (uint64_t)head->relocations*sizeof(ObjectRelocation) + (uint64_t)head->terms*sizeof(ObjectTerm) +
+                    (uint64_t)head->stringSize + head->dataSize;
+    header = head;
+    if((size!=text.size()) || !valid())
+    {
+        header = NULL;
+        error = string("Damaged object file: ") + fileName;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * valid()
+ *
+ * Checks that every offset and index in the tables is in range, and that
+ * every expression is well formed, as Expression::evaluate() trusts its terms.
+ */
+bool ObjectFile::valid() const
+{
+    if((header->stringSize==0) || (header->stringSize%4!=0) || (strings()[header->stringSize-1]!='\0')) // so every name ends within the strings
+        return false;
+
+    for(uint32_t i=0; i<header->sections; i++)
+    {
+        const ObjectSection &section = sections()[i];
+        if(((uint64_t)section.data + section.length > header->dataSize) || (section.address + section.length > MEMORY_SIZE))
+            return false;
+    }
+
+    for(uint32_t i=0; i<header->symbols; i++)
+        if(symbols()[i].name>=header->stringSize)
+            return false;
+
+    for(uint32_t i=0; i<header->relocations; i++)
+    {
+        const ObjectRelocation &relocation = relocations()[i];
+        unsigned int width = (relocation.kind==FIXUP_WORD) ? 2 : 1;
+        if((relocation.kind>FIXUP_BRANCH) || (relocation.file>=header->stringSize) || (relocation.section>=header->sections) ||
+           (relocation.offset + width > sections()[relocation.section].length) ||
+           ((uint64_t)relocation.expr + relocation.terms > header->terms))
+            return false;
+
+        int depth = 0; // of the evaluation stack
+        for(uint32_t t=relocation.expr; t<relocation.expr+relocation.terms; t++)
+        {
+            const ObjectTerm &term = terms()[t];
+            if((term.op==EXPR_NUMBER) || (term.op==EXPR_SYMBOL))
+            {
+                if((term.op==EXPR_SYMBOL) && ((uint32_t)term.value>=header->symbols))
+                    return false;
+                depth++;
+            }
+            else if((term.op==EXPR_NEGATE) || (term.op==EXPR_LOW) || (term.op==EXPR_HIGH))
+            {
+                if(depth<1)
+                    return false;
+            }
+            else if((term.op<=EXPR_SHR) && (depth>=2))
+                depth--;
+            else
+                return false;
+
+            if(depth>EXPR_MAX_DEPTH)
+                return false;
+        }
+        if(depth!=1)
+            return false;
+    }
+    return true;
+}
@@ -0,0 +1,112 @@
+/*
+ *  ObjectFile.h
+ *  6502assembler
+ *
+ *  Assembled modules for the linker.
+ *
+ */
+
+#ifndef OBJECTFILE_H
+#define OBJECTFILE_H
+
+#include <string>
+#include <stdint.h>
+#include "BASSembler6502.h"
+
+/*
+ * The records of an object file. They are written as they are in memory, so
+ * a mapped file is used in place: all of them are fixed size and aligned to
+ * their largest field. A file of the other byte order is rejected.
+ */
+#define OBJECT_MAGIC "BAO1"
+#define OBJECT_BYTE_ORDER 0x01020304
+
+struct ObjectHeader
+{
+    char magic[4];              // OBJECT_MAGIC
+    uint32_t byteOrder;         // OBJECT_BYTE_ORDER
+    uint32_t sections;          // the counts of the tables that follow, in this order
+    uint32_t symbols;
+    uint32_t relocations;
+    uint32_t terms;
+    uint32_t stringSize;        // a multiple of 4, the last byte is 0
+    uint32_t dataSize;          // the bytes of all sections
+};
+
+struct ObjectSection            // a .pc chunk, at its address
+{
+    uint32_t data;              // offset of its bytes in the data
+    uint32_t length;
+    uint16_t address;
+    uint16_t reserved;
+};
+
+#define OBJECT_SYMBOL_DEFINED 1 // otherwise it is only referenced, another module defines it
+
+struct ObjectSymbol
+{
+    uint32_t name;              // offset of the name in the strings, 0 terminated
+    uint16_t address;
+    uint16_t flags;
+};
+
+struct ObjectRelocation         // a reference to a symbol of another module
+{
+    uint32_t expr;              // first of its terms
+    uint32_t line;              // where it is, for error messages
+    uint32_t file;              // offset of the source file name in the strings
+    uint16_t section;
+    uint16_t offset;            // of the patched byte(s) in the section
+    uint8_t kind;               // see FixupKind
+    uint8_t reserved;
+    uint16_t terms;
+};
+
+struct ObjectTerm               // see ExprTerm, an EXPR_SYMBOL is the index of an ObjectSymbol
+{
+    int32_t value;
+    uint8_t op;
+    uint8_t reserved[3];
+};
+
+/*
+ * ObjectFile
+ *
+ * A module assembled with allowExternals(). Its chunks are the sections,
+ * its labels the symbols, and the references to labels that it doesn't
+ * define are the relocations, with their expressions. Labels of the module
+ * itself are already replaced by their addresses in those expressions.
+ *
+ * The file is the header and then the sections, the symbols, the
+ * relocations, the terms, the strings and the data, back to back.
+ */
+class ObjectFile
+{
+    SourceFile file;
+    const ObjectHeader *header;
+
+    bool valid() const;
+
+public:
+    ObjectFile() : header(NULL) {}
+
+    // Writes the result of 'assembler' (the chunks its assemble() returned).
+    // The file is written to a temporary name and renamed into place.
+    // Returns 0, or -1 on error (errno is set).
+    static int write(const std::string &fileName, const BASSembler6502 &assembler, const vector<MemChunk> &chunks);
+
+    // Maps the file and checks that all the tables are in it and all the
+    // offsets and indices in them are in range.
+    // Returns 0, or -1 with the reason in 'error'.
+    int open(const char *fileName, std::string &error);
+
+    const ObjectHeader &info() const { return *header; }
+    const ObjectSection *sections() const { return (const ObjectSection *)(header + 1); }
+    const ObjectSymbol *symbols() const { return (const ObjectSymbol *)(sections() + header->sections); }
+    const ObjectRelocation *relocations() const { return (const ObjectRelocation *)(symbols() + header->symbols); }
+    const ObjectTerm *terms() const { return (const ObjectTerm *)(relocations() + header->relocations); }
+    const char *strings() const { return (const char *)(terms() + header->terms); }
+    const byte *data() const { return (const byte *)(strings() + header->stringSize); }
+};
+
+#endif // OBJECTFILE_H
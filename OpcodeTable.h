@@ -0,0 +1,212 @@
+/*
+ *  OpcodeTable.h
+ *  6502assembler
+ *
+ *  The 6502 instruction set, and what is derived from it at compile time.
+ *
+ */
+
+#ifndef OPCODETABLE_H
+#define OPCODETABLE_H
+
+#include "BASSembler6502.h"
+
+/*
+ * The opcode table
+ *
+ * One row per instruction, the columns hold the instruction code for each
+ * addressing mode (0 = not available). The table and its hash index (see
+ * BASSembler6502::findOpcode()) are built at compile time, so looking up an
+ * instruction costs a multiplication and a compare. The instruction table
+ * below decodes the other way round, from the code to the row.
+ */
+enum OpcodeColumn
+{
+    COLUMN_IMMEDIATE,
+    COLUMN_ZERO_PAGE,
+    COLUMN_ZERO_PAGE_X,
+    COLUMN_ZERO_PAGE_Y,
+    COLUMN_ABSOLUTE,
+    COLUMN_ABSOLUTE_X,
+    COLUMN_ABSOLUTE_Y,
+    COLUMN_INDEXED_INDIRECT,    // ($10,x)
+    COLUMN_INDIRECT_INDEXED,    // ($10),y
+    COLUMN_IMPLIED,             // or the accumulator
+    COLUMN_RELATIVE,
+    COLUMN_INDIRECT             // jmp ($1000), not in the table: the assembler emits it by itself
+};
+
+//                     Imm,  ZP,   ZPX,  ZPY,  ABS,  ABSX, ABSY, INDX, INDY, IMPL, BRA
+inline constexpr Opcode opcodeTable[] =
+{
+    Opcode("ADC", 0x69, 0x65, 0x75, 0x00, 0x6d, 0x7d, 0x79, 0x61, 0x71, 0x00, 0x00),
+    Opcode("AND", 0x29, 0x25, 0x35, 0x00, 0x2d, 0x3d, 0x39, 0x21, 0x31, 0x00, 0x00),
+    Opcode("ASL", 0x00, 0x06, 0x16, 0x00, 0x0e, 0x1e, 0x00, 0x00, 0x00, 0x0a, 0x00),
+    Opcode("BIT", 0x00, 0x24, 0x00, 0x00, 0x2c, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00),
+    Opcode("BPL", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10),
+    Opcode("BMI", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x30),
+    Opcode("BVC", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x50),
+    Opcode("BVS", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x70),
+    Opcode("BCC", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x90),
+    Opcode("BCS", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xb0),
+    Opcode("BNE", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xd0),
+    Opcode("BEQ", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xf0),
+    Opcode("CMP", 0xc9, 0xc5, 0xd5, 0x00, 0xcd, 0xdd, 0xd9, 0xc1, 0xd1, 0x00, 0x00),
+    Opcode("CPX", 0xe0, 0xe4, 0x00, 0x00, 0xec, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00),
+    Opcode("CPY", 0xc0, 0xc4, 0x00, 0x00, 0xcc, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00),
+    Opcode("DEC", 0x00, 0xc6, 0xd6, 0x00, 0xce, 0xde, 0x00, 0x00, 0x00, 0x00, 0x00),
+    Opcode("EOR", 0x49, 0x45, 0x55, 0x00, 0x4d, 0x5d, 0x59, 0x41, 0x51, 0x00, 0x00),
+    Opcode("CLC", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x18, 0x00), //
+    Opcode("SEC", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x38, 0x00), //
+    Opcode("CLI", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x58, 0x00), //
+    Opcode("SEI", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x78, 0x00), //
+    Opcode("CLV", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xb8, 0x00), //
+    Opcode("CLD", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xd8, 0x00), //
+    Opcode("SED", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xf8, 0x00), //
+    Opcode("INC", 0x00, 0xe6, 0xf6, 0x00, 0xee, 0xfe, 0x00, 0x00, 0x00, 0x00, 0x00),
+    Opcode("JMP", 0x00, 0x00, 0x00, 0x00, 0x4c, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00),
+    Opcode("JSR", 0x00, 0x00, 0x00, 0x00, 0x20, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00),
+    Opcode("LDA", 0xa9, 0xa5, 0xb5, 0x00, 0xad, 0xbd, 0xb9, 0xa1, 0xb1, 0x00, 0x00),
+    Opcode("LDX", 0xa2, 0xa6, 0x00, 0xb6, 0xae, 0x00, 0xbe, 0x00, 0x00, 0x00, 0x00),
+    Opcode("LDY", 0xa0, 0xa4, 0xb4, 0x00, 0xac, 0xbc, 0x00, 0x00, 0x00, 0x00, 0x00),
+    Opcode("LSR", 0x00, 0x46, 0x56, 0x00, 0x4e, 0x5e, 0x00, 0x00, 0x00, 0x4a, 0x00),
+    Opcode("NOP", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xea, 0x00), //
+    Opcode("ORA", 0x09, 0x05, 0x15, 0x00, 0x0d, 0x1d, 0x19, 0x01, 0x11, 0x00, 0x00),
+    Opcode("TAX", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xaa, 0x00), //
+    Opcode("TXA", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x8a, 0x00), //
+    Opcode("DEX", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xca, 0x00), //
+    Opcode("INX", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xe8, 0x00), //
+    Opcode("TAY", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xa8, 0x00), //
+    Opcode("TYA", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x98, 0x00), //
+    Opcode("DEY", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x88, 0x00), //
+    Opcode("INY", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xc8, 0x00), //
+    Opcode("ROR", 0x00, 0x66, 0x76, 0x00, 0x6e, 0x7e, 0x00, 0x00, 0x00, 0x6a, 0x00),
+    Opcode("ROL", 0x00, 0x26, 0x36, 0x00, 0x2e, 0x3e, 0x00, 0x00, 0x00, 0x2a, 0x00), //<- temporarily corrupted at xxx,y
+    Opcode("RTI", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x40, 0x00), //
+    Opcode("RTS", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x60, 0x00), //
+    Opcode("SBC", 0xe9, 0xe5, 0xf5, 0x00, 0xed, 0xfd, 0xf9, 0xe1, 0xf1, 0x00, 0x00),
+    Opcode("STA", 0x00, 0x85, 0x95, 0x00, 0x8d, 0x9d, 0x99, 0x81, 0x91, 0x00, 0x00),
+    Opcode("TXS", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x9a, 0x00), //
+    Opcode("TSX", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xba, 0x00), //
+    Opcode("PHA", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x48, 0x00), //
+    Opcode("PLA", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x68, 0x00), //
+    Opcode("PHP", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x08, 0x00), //
+    Opcode("PLP", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x28, 0x00), //
+    Opcode("STX", 0x00, 0x86, 0x00, 0x96, 0x8e, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00),
+    Opcode("STY", 0x00, 0x84, 0x94, 0x00, 0x8c, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00)
+};
+
+#define OPCODE_COUNT ((int)(sizeof(opcodeTable)/sizeof(opcodeTable[0])))
+
+// BRK has no row (an implied code of 0 would mean "not available"), it is only decoded
+inline constexpr Opcode brkOpcode("BRK", 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00);
+
+/*
+ * InstructionInfo
+ *
+ * An instruction code decoded: its row in the opcode table, its addressing
+ * mode, its length and its cycles. Codes that are not in the table (the
+ * illegal opcodes) have no row. The cycles are the base count; an indexed
+ * read that crosses a page takes one more, and so does a branch that is
+ * taken, plus one more if it goes to another page.
+ */
+#define INSTRUCTION_PAGE_PENALTY 1 // an indexed read, +1 cycle when crossing a page
+#define INSTRUCTION_BRANCH       2 // +1 cycle when taken, +2 to another page
+
+struct InstructionInfo
+{
+    const Opcode *opcode;   // NULL if the code is not an instruction
+    word key;               // of the opcode (see Opcode::packMnemonic()), 0 if none
+    byte column;            // see OpcodeColumn
+    byte length;
+    byte cycles;
+    byte flags;
+};
+
+struct InstructionTable
+{
+    InstructionInfo codes[256];
+};
+
+constexpr word mnemonicKey(const char *name)
+{
+    return Opcode::packMnemonic(name[0], name[1], name[2]);
+}
+
+// read-modify-write instructions: they always take the extra cycle of an indexed access
+constexpr bool isReadModifyWrite(word key)
+{
+    return (key==mnemonicKey("ASL")) || (key==mnemonicKey("LSR")) || (key==mnemonicKey("ROL")) ||
+           (key==mnemonicKey("ROR")) || (key==mnemonicKey("INC")) || (key==mnemonicKey("DEC"));
+}
+
+constexpr bool isStore(word key)
+{
+    return (key==mnemonicKey("STA")) || (key==mnemonicKey("STX")) || (key==mnemonicKey("STY"));
+}
+
+constexpr byte instructionLength(int column)
+{
+    return (column==COLUMN_IMPLIED) ? 1 :
+           ((column==COLUMN_ABSOLUTE) || (column==COLUMN_ABSOLUTE_X) || (column==COLUMN_ABSOLUTE_Y) || (column==COLUMN_INDIRECT)) ? 3 : 2;
+}
+
+constexpr byte instructionCycles(word key, int column)
+{
+    bool rmw = isReadModifyWrite(key);
+    switch(column)
+    {
+        case COLUMN_IMMEDIATE:          return 2;
+        case COLUMN_ZERO_PAGE:          return rmw ? 5 : 3;
+        case COLUMN_ZERO_PAGE_X:
+        case COLUMN_ZERO_PAGE_Y:        return rmw ? 6 : 4;
+        case COLUMN_ABSOLUTE:           return (key==mnemonicKey("JMP")) ? 3 : ((key==mnemonicKey("JSR")) || rmw) ? 6 : 4;
+        case COLUMN_ABSOLUTE_X:
+        case COLUMN_ABSOLUTE_Y:         return rmw ? 7 : (isStore(key) ? 5 : 4);
+        case COLUMN_INDEXED_INDIRECT:   return 6;
+        case COLUMN_INDIRECT_INDEXED:   return isStore(key) ? 6 : 5;
+        case COLUMN_RELATIVE:           return 2;
+        case COLUMN_INDIRECT:           return 5;
+        default: // implied
+            if((key==mnemonicKey("PHA")) || (key==mnemonicKey("PHP")))
+                return 3;
+            if((key==mnemonicKey("PLA")) || (key==mnemonicKey("PLP")))
+                return 4;
+            if((key==mnemonicKey("RTS")) || (key==mnemonicKey("RTI")))
+                return 6;
+            if(key==mnemonicKey("BRK"))
+                return 7;
+            return 2;
+    }
+}
+
+constexpr InstructionInfo decodeInstruction(const Opcode &opcode, int column)
+{
+    InstructionInfo info = { &opcode, opcode.key, (byte)column, instructionLength(column), instructionCycles(opcode.key, column), 0 };
+    if(((column==COLUMN_ABSOLUTE_X) || (column==COLUMN_ABSOLUTE_Y) || (column==COLUMN_INDIRECT_INDEXED)) &&
+       !isReadModifyWrite(opcode.key) && !isStore(opcode.key))
+        info.flags |= INSTRUCTION_PAGE_PENALTY;
+    if(column==COLUMN_RELATIVE)
+        info.flags |= INSTRUCTION_BRANCH;
+    return info;
+}
+
+constexpr InstructionTable buildInstructionTable()
+{
+    InstructionTable table = {};
+    for(const Opcode &opcode : opcodeTable)
+        for(int column=COLUMN_IMMEDIATE; column<=COLUMN_RELATIVE; column++)
+            if(opcode.codes[column])
+                table.codes[opcode.codes[column]] = decodeInstruction(opcode, column);
+
+    table.codes[0x00] = decodeInstruction(brkOpcode, COLUMN_IMPLIED);
+    for(const Opcode &opcode : opcodeTable)
+        if(opcode.key==mnemonicKey("JMP"))
+            table.codes[0x6c] = decodeInstruction(opcode, COLUMN_INDIRECT);
+    return table;
+}
+
+// by instruction code
+inline constexpr InstructionTable instructionTable = buildInstructionTable();
+
+#endif // OPCODETABLE_H
@@ -0,0 +1,649 @@
+/*
+ *  SegmentAssembler.cpp
+ *  6502assembler
+ *
+ *  Assembles the .pc segments of a source on several threads.
+ *
+ */
+
+#include "SegmentAssembler.h"
+#include <string.h>
+#include <strings.h> // strncasecmp()
+#include <ctype.h>
+#include <algorithm> // max()
+
+// ----------------------------------------------------------------------------
+SegmentAssembler::SegmentAssembler(BASSembler6502 &master, int threads) : master(master), pool(threads)
+{
+}
+
+// ----------------------------------------------------------------------------
+SegmentAssembler::~SegmentAssembler()
+{
+    for(size_t i=0; i<segments.size(); i++)
+        delete segments[i].assembler;
+}
+
+/*
+ * Mark
+ *
+ * A directive line that matters for splitting, found by scanRange().
+ */
+enum MarkKind
+{
+    MARK_PC,
+    MARK_ASCII,
+    MARK_PETSCII,
+    MARK_SCREEN,
+    MARK_SERIAL     // .include, .macro, .rept, .charset: the source is assembled serially
+};
+
+struct Mark
+{
+    size_t pos;         // start of the line
+    unsigned int line;  // lines before it in the scanned range
+    MarkKind kind;
+};
+
+// ----------------------------------------------------------------------------
+// the directive a line starts with, case insensitively (without the dot)
+static bool isDirective(string_view word, const char *keyword)
+{
+    size_t length = strlen(keyword);
+    return (word.size()==length) && (strncasecmp(word.data(), keyword, length)==0);
+}
+
+/*
+ * scanRange()
+ *
+ * Finds the marks among the lines in [pos, end) of the source, which starts
+ * at a line. Only the first word of the directive lines is looked at,
+ * nothing is tokenized. Returns the number of lines.
+ */
+static unsigned int scanRange(string_view source, size_t pos, size_t end, vector<Mark> &marks)
+{
+    unsigned int lineNumber = 0;
+    while(pos<end)
+    {
+        const char *newline = (const char *)memchr(source.data() + pos, '\n', end-pos);
+        size_t lineEnd = newline ? (size_t)(newline - source.data()) : end;
+
+        size_t i = pos;
+        while((i<lineEnd) && isspace((unsigned char)source[i]))
+            i++;
+        if((i<lineEnd) && (source[i]=='.'))
+        {
+            size_t wordEnd = ++i;
+            while((wordEnd<lineEnd) && (isalnum((unsigned char)source[wordEnd]) || (source[wordEnd]=='_')))
+                wordEnd++;
+            string_view word = source.substr(i, wordEnd-i);
+
+            Mark mark;
+            mark.pos = pos;
+            mark.line = lineNumber;
+            mark.kind = MARK_SERIAL;
+            if(isDirective(word, "pc"))
+                mark.kind = MARK_PC;
+            else if(isDirective(word, "ascii"))
+                mark.kind = MARK_ASCII;
+            else if(isDirective(word, "petscii"))
+                mark.kind = MARK_PETSCII;
+            else if(isDirective(word, "screen"))
+                mark.kind = MARK_SCREEN;
+            if((mark.kind!=MARK_SERIAL) || isDirective(word, "include") || isDirective(word, "macro") || isDirective(word, "rept") || isDirective(word, "charset"))
+                marks.push_back(mark);
+        }
+
+        pos = lineEnd+1;
+        lineNumber++;
+    }
+    return lineNumber;
+}
+
+/*
+ * split()
+ *
+ * Cuts the main source at the lines that start with .pc, keeping track of
+ * the character set each segment starts with. The source is scanned in
+ * ranges on the pool, each starting at a line.
+ * Returns 0, or 1 if the source is better assembled serially.
+ */
+int SegmentAssembler::split()
+{
+    string_view source = master.units[0]->text;
+    if((source.size()<SEGMENT_MIN_SOURCE) || (pool.threads()<2))
+        return 1;
+
+    size_t count = (size_t)pool.threads() * 4;
+    vector<size_t> rangeStart(count+1, source.size());
+    rangeStart[0] = 0;
+    for(size_t r=1; r<count; r++)
+    {
+        size_t pos = std::max(rangeStart[r-1], source.size() * r / count);
+        const char *newline = (pos<source.size()) ? (const char *)memchr(source.data() + pos, '\n', source.size()-pos) : NULL;
+        rangeStart[r] = newline ? (size_t)(newline - source.data()) + 1 : source.size();
+    }
+
+    vector<vector<Mark>> marks(count);
+    vector<unsigned int> lines(count);
+    pool.run((int)count, [&](int r)
+    {
+        lines[r] = scanRange(source, rangeStart[r], rangeStart[r+1], marks[r]);
+    });
+
+    vector<size_t> starts(1, 0); // where each segment starts
+    vector<unsigned int> firstLines(1, 0);
+    vector<const Charset *> charsets(1, &asciiCharset);
+    const Charset *charset = &asciiCharset;
+    unsigned int lineBase = 0;
+    for(size_t r=0; r<count; r++)
+    {
+        for(size_t m=0; m<marks[r].size(); m++)
+        {
+            const Mark &mark = marks[r][m];
+            switch(mark.kind)
+            {
+                case MARK_PC:
+                    starts.push_back(mark.pos);
+                    firstLines.push_back(lineBase + mark.line);
+                    charsets.push_back(charset);
+                    break;
+                case MARK_ASCII:
+                    charset = &asciiCharset;
+                    break;
+                case MARK_PETSCII:
+                    charset = &petsciiCharset;
+                    break;
+                case MARK_SCREEN:
+                    charset = &screenCharset;
+                    break;
+                default:
+                    return 1;
+            }
+        }
+        lineBase += lines[r];
+    }
+
+    if(starts.size()<3) // the lines before the first .pc, and at least two chunks
+        return 1;
+
+    starts.push_back(source.size());
+    segments.resize(starts.size()-1);
+    for(size_t s=0; s<segments.size(); s++)
+    {
+        Segment &segment = segments[s];
+        segment.text = source.substr(starts[s], starts[s+1]-starts[s]);
+        segment.firstLine = firstLines[s];
+        segment.charset = charsets[s];
+        segment.result = 0;
+        segment.importing = false;
+        segment.siteBase = segment.chunkBase = 0;
+
+        // set up like assemble() does, the segment is its main source
+        BASSembler6502 *assembler = new BASSembler6502();
+        assembler->reset();
+        assembler->units.push_back(new SourceUnit());
+        assembler->units[0]->name = master.units[0]->name; // .incbin is relative to it
+        assembler->units[0]->text = segment.text;
+        assembler->units[0]->file = NULL;
+        assembler->units[0]->tokenized = false;
+        segment.assembler = assembler;
+    }
+    return 0;
+}
+
+/*
+ * runSegments()
+ *
+ * Assembles the given segments on the pool, with their imported labels
+ * defined. The first pass records the relaxation sites, the final pass
+ * takes their sizes from the merged layout.
+ */
+void SegmentAssembler::runSegments(const vector<unsigned int> &pending, bool finalPass)
+{
+    pool.run((int)pending.size(), [&](int job)
+    {
+        Segment &segment = segments[pending[job]];
+        BASSembler6502 &assembler = *segment.assembler;
+
+        assembler.asmError = AssemblyError();
+        assembler.asmError.errorLineNumber = 0;
+        for(size_t i=0; i<assembler.units.size(); i++)
+            assembler.units[i]->active = false;
+
+        assembler.startPass();
+        assembler.finalPass = finalPass;
+        if(finalPass)
+        {
+            for(size_t i=0; i<assembler.sites.size(); i++)
+                assembler.sites[i].zeroPage = master.sites[segment.siteBase + i].zeroPage;
+        }
+        else
+        {
+            assembler.sites.clear();
+            assembler.siteTerms.clear();
+            assembler.labelFirstSite.clear();
+            assembler.labelSite.clear();
+        }
+        assembler.charset = segment.charset;
+
+        for(size_t i=0; i<segment.imports.size(); i++) // they get the ids 0..n-1
+        {
+            string name = master.symbols.name(segment.imports[i]);
+            assembler.symbols.define(assembler.symbols.intern(name.data(), (int)name.size()), segment.importValues[i]);
+        }
+
+        segment.result = assembler.assemblePass();
+    });
+}
+
+/*
+ * mergeSymbols()
+ *
+ * Builds the symbol table of the master from the tables of the segments.
+ * Interning them segment by segment, each in the order of its ids, gives
+ * every name the id a serial pass would have given it.
+ * Returns 0, or -1 if a label is defined in two segments.
+ */
+int SegmentAssembler::mergeSymbols()
+{
+    master.symbols.clear();
+    owner.clear();
+
+    for(unsigned int s=0; s<segments.size(); s++)
+    {
+        Segment &segment = segments[s];
+        const SymbolTable &symbols = segment.assembler->symbols;
+        segment.symbolMap.resize(symbols.size());
+        for(SymbolId id=0; id<symbols.size(); id++)
+        {
+            string_view name = symbols.nameView(id);
+            SymbolId merged = master.symbols.intern(name.data(), (int)name.size());
+            segment.symbolMap[id] = merged;
+            if(merged>=owner.size())
+                owner.push_back(-1);
+
+            if((id<segment.imports.size()) || !symbols.isDefined(id)) // imports are defined by their own segment
+                continue;
+            if(owner[merged]!=-1)
+                return -1;
+            owner[merged] = (int)s;
+            master.symbols.define(merged, symbols.address(id));
+        }
+    }
+    return 0;
+}
+
+/*
+ * knownSerially()
+ *
+ * Were all labels of a relaxation site known at its line in a serial pass?
+ * They are if each is defined by an earlier segment, or by this segment
+ * before the site. Then a serial pass had no site there, it took the size
+ * from the value right away.
+ */
+bool SegmentAssembler::knownSerially(unsigned int index, unsigned int site)
+{
+    const Segment &segment = segments[index];
+    const BASSembler6502 &assembler = *segment.assembler;
+    const RelaxSite &relaxSite = assembler.sites[site];
+    for(unsigned int t=0; t<relaxSite.terms; t++)
+    {
+        const ExprTerm &term = assembler.siteTerms[relaxSite.expr + t];
+        if(term.op!=EXPR_SYMBOL)
+            continue;
+        int definedBy = owner[segment.symbolMap[term.value]];
+        if((definedBy<0) || (definedBy>(int)index))
+            return false;
+        if((definedBy==(int)index) && (assembler.labelSite[term.value]>site)) // defined after the site
+            return false;
+    }
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+// does the value of a site fit into zero page, with the addresses of the merged symbol table?
+bool SegmentAssembler::fitsZeroPage(const vector<ExprTerm> &terms, unsigned int expr, unsigned int count, const vector<SymbolId> *symbolMap)
+{
+    vector<ExprTerm> merged(terms.begin() + expr, terms.begin() + expr + count);
+    if(symbolMap!=NULL)
+        for(size_t t=0; t<merged.size(); t++)
+            if(merged[t].op==EXPR_SYMBOL)
+                merged[t].value = (int)(*symbolMap)[merged[t].value];
+
+    int value;
+    string error;
+    if(Expression::evaluate(merged.data(), count, master.symbols, value, error)==-1)
+        return false;
+    return (value>=0) && (value<0x100);
+}
+
+/*
+ * needsImports()
+ *
+ * A site whose labels were all known to a serial pass (see knownSerially())
+ * was assembled as absolute, a serial pass made it zero page if the value
+ * fit. Only then is the segment different, and it has to be assembled with
+ * the labels of the earlier segments defined.
+ */
+bool SegmentAssembler::needsImports(unsigned int index)
+{
+    const BASSembler6502 &assembler = *segments[index].assembler;
+    for(unsigned int i=0; i<assembler.sites.size(); i++)
+    {
+        const RelaxSite &site = assembler.sites[i];
+        if(knownSerially(index, i) && fitsZeroPage(assembler.siteTerms, site.expr, site.terms, &segments[index].symbolMap))
+            return true;
+    }
+    return false;
+}
+
+/*
+ * updateImports()
+ *
+ * Collects the labels of earlier segments that an importing segment refers
+ * to, with their current addresses.
+ * Returns true if the segment has to be assembled again: it failed, or it
+ * was assembled without some of them, or with other addresses.
+ */
+bool SegmentAssembler::updateImports(unsigned int index)
+{
+    Segment &segment = segments[index];
+    const SymbolTable &symbols = segment.assembler->symbols;
+    bool changed = (segment.result==-1);
+
+    size_t known = segment.imports.size();
+    for(size_t i=0; i<known; i++)
+    {
+        word address = master.symbols.address(segment.imports[i]);
+        if(address!=segment.importValues[i])
+        {
+            segment.importValues[i] = address;
+            changed = true;
+        }
+    }
+
+    for(SymbolId id=(SymbolId)known; id<symbols.size(); id++)
+    {
+        if(symbols.isDefined(id))
+            continue;
+        SymbolId merged = segment.symbolMap[id];
+        if((owner[merged]>=0) && (owner[merged]<(int)index))
+        {
+            segment.imports.push_back(merged);
+            segment.importValues.push_back(master.symbols.address(merged));
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+/*
+ * mergeSites()
+ *
+ * Puts the relaxation sites of all segments into the master, in source
+ * order, so relaxLayout() sees the same sites as after a serial first pass.
+ * A site that a serial pass didn't have is pinned to absolute, so it takes
+ * no part in the layout.
+ */
+void SegmentAssembler::mergeSites()
+{
+    knownSites.clear();
+    master.sites.clear();
+    master.siteTerms.clear();
+    master.labelFirstSite.assign(master.symbols.size(), 0);
+    master.labelSite.assign(master.symbols.size(), 0);
+
+    for(size_t s=0; s<segments.size(); s++)
+    {
+        Segment &segment = segments[s];
+        const BASSembler6502 &assembler = *segment.assembler;
+        segment.siteBase = (unsigned int)master.sites.size();
+        unsigned int termBase = (unsigned int)master.siteTerms.size();
+
+        for(unsigned int i=0; i<assembler.sites.size(); i++)
+        {
+            RelaxSite site = assembler.sites[i];
+            site.expr += termBase;
+            if(!segment.importing && knownSerially((unsigned int)s, i)) // absolute, like the serial pass had it
+            {
+                site.pinned = true;
+                knownSites.push_back((unsigned int)master.sites.size());
+            }
+            master.sites.push_back(site);
+        }
+        for(size_t t=0; t<assembler.siteTerms.size(); t++)
+        {
+            ExprTerm term = assembler.siteTerms[t];
+            if(term.op==EXPR_SYMBOL)
+                term.value = (int)segment.symbolMap[term.value];
+            master.siteTerms.push_back(term);
+        }
+
+        const SymbolTable &symbols = assembler.symbols;
+        for(SymbolId id=(SymbolId)segment.imports.size(); id<symbols.size(); id++)
+        {
+            if(!symbols.isDefined(id))
+                continue;
+            SymbolId merged = segment.symbolMap[id];
+            master.labelFirstSite[merged] = assembler.labelFirstSite[id] + segment.siteBase;
+            master.labelSite[merged] = assembler.labelSite[id] + segment.siteBase;
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------
+// do any two non-empty chunks overlap? (what closeChunk() checks as it goes)
+bool SegmentAssembler::overlaps(const vector<MemChunk> &chunks)
+{
+    for(size_t i=1; i<chunks.size(); i++)
+    {
+        if(chunks[i].length==0)
+            continue;
+        for(size_t j=0; j<i; j++)
+            if((chunks[j].length>0) && (chunks[i].startAddress < chunks[j].endAddress()) && (chunks[j].startAddress < chunks[i].endAddress()))
+                return true;
+    }
+    return false;
+}
+
+/*
+ * link()
+ *
+ * Copies the chunks of the segments into the memory image of the master,
+ * resolves all fixups there, and hands the files read by .incbin over to
+ * the master. Chunks are checked for overlaps with both their first pass
+ * and their final sizes, since a serial assembly checks both.
+ * Returns 0, or 1 if something failed.
+ */
+int SegmentAssembler::link(bool finalPass)
+{
+    vector<MemChunk> firstChunks, finalChunks;
+    for(size_t s=0; s<segments.size(); s++)
+    {
+        const vector<MemChunk> &chunks = segments[s].assembler->chunks;
+        if(!chunks.empty())
+        {
+            firstChunks.push_back(segments[s].firstChunk);
+            finalChunks.push_back(chunks[0]);
+        }
+    }
+    if(overlaps(firstChunks) || overlaps(finalChunks))
+        return 1;
+
+    // the place of each segment's part is worked out first, then they are copied at the same time
+    vector<size_t> fixupBase(segments.size()+1, 0), termBase(segments.size()+1, 0);
+    master.chunks.clear();
+    for(size_t s=0; s<segments.size(); s++)
+    {
+        Segment &segment = segments[s];
+        const BASSembler6502 &assembler = *segment.assembler;
+        segment.chunkBase = (unsigned int)master.chunks.size();
+        for(size_t c=0; c<assembler.chunks.size(); c++)
+        {
+            master.chunks.push_back(MemChunk(master.memory, assembler.chunks[c].startAddress));
+            master.chunks.back().length = assembler.chunks[c].length;
+        }
+        fixupBase[s+1] = fixupBase[s] + assembler.fixups.size();
+        termBase[s+1] = termBase[s] + assembler.exprTerms.size();
+    }
+    master.fixups.resize(fixupBase[segments.size()]);
+    master.exprTerms.resize(termBase[segments.size()]);
+
+    pool.run((int)segments.size(), [&](int s)
+    {
+        const Segment &segment = segments[s];
+        const BASSembler6502 &assembler = *segment.assembler;
+        for(size_t c=0; c<assembler.chunks.size(); c++)
+            memcpy(master.chunks[segment.chunkBase + c].data, assembler.chunks[c].data, assembler.chunks[c].length);
+
+        for(size_t f=0; f<assembler.fixups.size(); f++)
+        {
+            Fixup &fixup = master.fixups[fixupBase[s] + f];
+            fixup = assembler.fixups[f];
+            fixup.chunk += segment.chunkBase;
+            fixup.expr += (unsigned int)termBase[s];
+            fixup.line += segment.firstLine;
+        }
+        for(size_t t=0; t<assembler.exprTerms.size(); t++)
+        {
+            ExprTerm &term = master.exprTerms[termBase[s] + t];
+            term = assembler.exprTerms[t];
+            if(term.op==EXPR_SYMBOL)
+                term.value = (int)segment.symbolMap[term.value];
+        }
+    });
+    master.actChunk = master.chunks.empty() ? NULL : &master.chunks.back();
+    master.finalPass = finalPass;
+
+    // a segment got a reference as a fixup that a serial pass might have found wrong right away, with another message
+    if(master.resolveFixups()==-1)
+        return 1;
+
+    // the files are listed in the order a serial pass loads them, each once
+    for(size_t s=0; s<segments.size(); s++)
+    {
+        BASSembler6502 &assembler = *segments[s].assembler;
+        vector<string> keys(assembler.units.size());
+        for(map<string, unsigned int>::iterator it=assembler.unitCache.begin(); it!=assembler.unitCache.end(); it++)
+            keys[it->second] = it->first;
+
+        for(size_t u=1; u<assembler.units.size(); u++)
+        {
+            if(master.unitCache.count(keys[u]))
+            {
+                delete assembler.units[u]->file;
+                delete assembler.units[u];
+                continue;
+            }
+            master.unitCache[keys[u]] = (unsigned int)master.units.size();
+            master.units.push_back(assembler.units[u]);
+        }
+        assembler.units.resize(1);
+        assembler.unitCache.clear();
+    }
+    return 0;
+}
+
+/*
+ * assemble()
+ *
+ * The first pass of all segments, repeated for the ones that need the
+ * labels of earlier segments until those settle. Then the sites are laid
+ * out together, the segments that change are assembled as a final pass
+ * (again until the labels settle), and everything is linked.
+ */
+int SegmentAssembler::assemble()
+{
+    if(split()==1)
+        return 1;
+
+    vector<unsigned int> pending(segments.size());
+    for(unsigned int s=0; s<segments.size(); s++)
+        pending[s] = s;
+
+    // every round settles at least one more segment, since imports only come from earlier ones
+    for(unsigned int round=0; !pending.empty(); round++)
+    {
+        if(round>segments.size())
+            return 1;
+
+        runSegments(pending, false);
+        for(size_t p=0; p<pending.size(); p++)
+        {
+            Segment &segment = segments[pending[p]];
+            if(segment.result==-1)
+            {
+                if(segment.importing) // a real error
+                    return 1;
+                segment.importing = true; // maybe a site that a serial pass would have made zero page
+            }
+        }
+
+        if(mergeSymbols()==-1)
+            return 1;
+
+        pending.clear();
+        for(unsigned int s=0; s<segments.size(); s++)
+        {
+            Segment &segment = segments[s];
+            if(!segment.importing && needsImports(s))
+                segment.importing = true;
+            if(segment.importing && updateImports(s))
+                pending.push_back(s);
+        }
+    }
+
+    for(size_t s=0; s<segments.size(); s++)
+    {
+        const vector<MemChunk> &chunks = segments[s].assembler->chunks;
+        if(!chunks.empty())
+            segments[s].firstChunk = chunks[0];
+    }
+
+    mergeSites();
+    bool finalPass = !master.sites.empty() && master.relaxLayout();
+    if(finalPass)
+    {
+        // the segments with a zero page site, and those whose imports moved (see the addresses relaxLayout() left)
+        for(unsigned int s=0; s<segments.size(); s++)
+        {
+            Segment &segment = segments[s];
+            bool shrinks = false;
+            for(size_t i=0; (i<segment.assembler->sites.size()) && !shrinks; i++)
+                shrinks = master.sites[segment.siteBase + i].zeroPage;
+            bool moved = segment.importing && updateImports(s);
+            if(shrinks || moved)
+                pending.push_back(s);
+        }
+
+        for(unsigned int round=0; !pending.empty(); round++)
+        {
+            if(round>segments.size())
+                return 1;
+
+            runSegments(pending, true);
+            for(size_t p=0; p<pending.size(); p++)
+                if(segments[pending[p]].result==-1)
+                    return 1;
+
+            if(mergeSymbols()==-1)
+                return 1;
+
+            pending.clear();
+            for(unsigned int s=0; s<segments.size(); s++)
+                if(segments[s].importing && updateImports(s))
+                    pending.push_back(s);
+        }
+
+        // a serial final pass takes the sizes of the pinned sites from the final addresses again
+        for(size_t i=0; i<knownSites.size(); i++)
+        {
+            const RelaxSite &site = master.sites[knownSites[i]];
+            if(fitsZeroPage(master.siteTerms, site.expr, site.terms, NULL))
+                return 1;
+        }
+    }
+
+    return link(finalPass);
+}
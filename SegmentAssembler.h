@@ -0,0 +1,103 @@
+/*
+ *  SegmentAssembler.h
+ *  6502assembler
+ *
+ *  Assembles the .pc segments of a source on several threads.
+ *
+ */
+
+#ifndef SEGMENTASSEMBLER_H
+#define SEGMENTASSEMBLER_H
+
+#include <string_view>
+#include <vector>
+#include "BASSembler6502.h"
+#include "ThreadPool.h"
+
+#define SEGMENT_MIN_SOURCE 65536 // smaller sources are assembled on one thread, it's not worth starting any
+
+/*
+ * Segment
+ *
+ * The lines from a .pc directive up to the next one, assembled by an
+ * assembler of its own. The lines before the first .pc are a segment too,
+ * without a chunk.
+ */
+struct Segment
+{
+    string_view text;
+    unsigned int firstLine;         // lines of the source before it
+    const Charset *charset;         // the one in effect where it starts
+    BASSembler6502 *assembler;
+    int result;                     // of its last pass
+
+    // labels of earlier segments, defined before its pass like in a serial pass
+    bool importing;                 // it is assembled with them (see SegmentAssembler)
+    vector<SymbolId> imports;       // their ids in the merged symbol table
+    vector<word> importValues;      // the addresses it was last assembled with
+
+    vector<SymbolId> symbolMap;     // its symbol ids -> ids in the merged symbol table
+    unsigned int siteBase;          // its first site among all sites
+    unsigned int chunkBase;         // its chunk among all chunks
+    MemChunk firstChunk;            // its chunk after the first pass (only the address and the length are used)
+};
+
+/*
+ * SegmentAssembler
+ *
+ * Every .pc starts a chunk of its own, so the source is split at the .pc
+ * lines and the segments are assembled at the same time, each by its own
+ * assembler. A segment only sees its own labels, a label of another
+ * segment is a forward reference to it. The results are then linked into
+ * the master assembler on one thread: the symbols are merged, the zero page
+ * layout is worked out over all relaxation sites (see relaxLayout()), and
+ * the fixups of all segments are resolved together.
+ *
+ * The result is the same as a serial assemble(). A serial pass knows the
+ * labels of earlier segments, which only matters for the size of an
+ * instruction that could be zero page:
+ * - Such an instruction whose value doesn't fit into a byte is absolute
+ *   either way, only its relaxation site is pinned, since a serial pass
+ *   didn't have one there.
+ * - If the value fits (a zero page variable of an earlier segment), or the
+ *   segment failed, it is assembled again with the labels of the earlier
+ *   segments defined. This is repeated until the addresses it got don't
+ *   change any more.
+ * - If some sites go to zero page, the segments that have such sites, or
+ *   that got addresses that moved, are assembled once more as a final pass.
+ *
+ * Whatever it can't reproduce is left to the serial passes: .include,
+ * .macro, .rept and .charset (their state crosses segments), a label
+ * defined in two segments, and any error, so the error message is always
+ * the one of a serial assembly.
+ */
+class SegmentAssembler
+{
+    BASSembler6502 &master;
+    vector<Segment> segments;
+    vector<int> owner;              // by merged symbol id: the segment that defines it, -1 if none
+    vector<unsigned int> knownSites; // merged sites that a serial pass didn't have, see knownSerially()
+    ThreadPool pool;
+
+    int split();
+    void runSegments(const vector<unsigned int> &pending, bool finalPass);
+    int mergeSymbols();
+    bool knownSerially(unsigned int index, unsigned int site);
+    bool fitsZeroPage(const vector<ExprTerm> &terms, unsigned int expr, unsigned int count, const vector<SymbolId> *symbolMap);
+    bool needsImports(unsigned int index);
+    bool updateImports(unsigned int index);
+    void mergeSites();
+    int link(bool finalPass);
+    static bool overlaps(const vector<MemChunk> &chunks);
+
+public:
+    SegmentAssembler(BASSembler6502 &master, int threads);
+    ~SegmentAssembler();
+
+    // Assembles the main source of 'master', which is set up by assemble().
+    // Returns 0 if its results are in 'master', 1 if the source has to be
+    // assembled serially.
+    int assemble();
+};
+
+#endif // SEGMENTASSEMBLER_H
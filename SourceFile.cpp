@@ -0,0 +1,154 @@
+/*
+ *  SourceFile.cpp
+ *  6502assembler
+ *
+ *  Read-only access to a source file without copying it.
+ *
+ */
+
+#include "SourceFile.h"
+#include <atomic>
+#include <stdio.h> // snprintf(), rename()
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+#define READ_BLOCK 65536
+
+// ----------------------------------------------------------------------------
+SourceFile::SourceFile()
+{
+    data = NULL;
+    length = 0;
+    mapped = false;
+}
+
+SourceFile::~SourceFile()
+{
+    close();
+}
+
+// ----------------------------------------------------------------------------
+int SourceFile::open(const char *fileName)
+{
+    close();
+
+    if(strcmp(fileName, "-")==0)
+        return readAll(STDIN_FILENO);
+
+    int fd = ::open(fileName, O_RDONLY);
+    if(fd<0)
+        return -1;
+
+    struct stat st;
+    if(fstat(fd, &st)<0)
+    {
+        int error = errno;
+        ::close(fd);
+        errno = error;
+        return -1;
+    }
+
+    if(S_ISREG(st.st_mode) && (st.st_size>0))
+    {
+        void *mapping = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(mapping!=MAP_FAILED)
+        {
+            madvise(mapping, (size_t)st.st_size, MADV_SEQUENTIAL); // the assembler reads front to back
+            ::close(fd); // the mapping stays valid without the descriptor
+            data = (const char *)mapping;
+            length = (size_t)st.st_size;
+            mapped = true;
+            return 0;
+        }
+    }
+
+    int result = readAll(fd); // not a regular file, or mapping failed
+    int error = errno;
+    ::close(fd);
+    errno = error;
+    return result;
+}
+
+// ----------------------------------------------------------------------------
+// reads everything from a descriptor into the arena (for stdin and pipes)
+int SourceFile::readAll(int fd)
+{
+    arena.clear();
+    size_t used = 0;
+
+    for(;;)
+    {
+        arena.resize(used + READ_BLOCK);
+        ssize_t n = ::read(fd, &arena[used], READ_BLOCK);
+        if(n<0)
+        {
+            if(errno==EINTR)
+                continue;
+            arena.clear();
+            return -1;
+        }
+        if(n==0)
+            break;
+        used += (size_t)n;
+    }
+
+    arena.resize(used);
+    arena.shrink_to_fit();
+    data = arena.data();
+    length = used;
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+void SourceFile::close()
+{
+    if(mapped)
+        munmap((void *)data, length);
+
+    arena.clear();
+    data = NULL;
+    length = 0;
+    mapped = false;
+}
+
+// ----------------------------------------------------------------------------
+int writeFileAtomically(const std::string &fileName, std::string_view data)
+{
+    // a name of its own for every writer, then the file appears at once
+    static std::atomic<unsigned int> serial(0);
+    char suffix[48];
+    snprintf(suffix, sizeof(suffix), ".%d.%u.tmp", (int)getpid(), serial++);
+    std::string temp = fileName + suffix;
+
+    int file = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if(file==-1)
+        return -1;
+
+    size_t written = 0;
+    while(written<data.size())
+    {
+        ssize_t n = ::write(file, data.data() + written, data.size() - written);
+        if((n<0) && (errno==EINTR))
+            continue;
+        if(n<0)
+            break;
+        written += (size_t)n;
+    }
+
+    if((written<data.size()) || (::close(file)==-1) || (rename(temp.c_str(), fileName.c_str())==-1))
+    {
+        int error = errno;
+        if(written<data.size())
+            ::close(file);
+        unlink(temp.c_str());
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
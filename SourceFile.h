@@ -0,0 +1,50 @@
+/*
+ *  SourceFile.h
+ *  6502assembler
+ *
+ *  Read-only access to a source file without copying it.
+ *
+ */
+
+#ifndef SOURCEFILE_H
+#define SOURCEFILE_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+/*
+ * SourceFile
+ *
+ * Regular files are memory-mapped, so the assembler works directly on the
+ * page cache and the file is never copied. Anything that can't be mapped
+ * (stdin, pipes, empty files) is read into a single arena instead.
+ * The text stays valid until the object is closed or destroyed.
+ */
+class SourceFile
+{
+    const char *data;
+    size_t length;
+    bool mapped;            // data points to a mapping that has to be unmapped
+    std::vector<char> arena; // backing store when the file couldn't be mapped
+
+    int readAll(int fd);
+
+public:
+    SourceFile();
+    ~SourceFile();
+
+    // opens and maps (or reads) a file, "-" means stdin.
+    // returns 0 on success, -1 on error (errno is set).
+    int open(const char *fileName);
+    void close();
+
+    std::string_view text() const { return std::string_view(data, length); }
+};
+
+// Writes 'data' to a temporary file next to 'fileName' and renames it into
+// place, so a reader sees the old file or the whole new one, never a part.
+// Returns 0, or -1 on error (errno is set).
+int writeFileAtomically(const std::string &fileName, std::string_view data);
+
+#endif // SOURCEFILE_H
@@ -0,0 +1,128 @@
+/*
+ *  SymbolTable.cpp
+ *  6502assembler
+ *
+ *  Interned symbol table for labels.
+ *
+ */
+
+#include "SymbolTable.h"
+#include <algorithm> // fill()
+
+using namespace std;
+
+#define INITIAL_SLOTS 1024 // must be a power of two
+
+static inline char upper(char c)
+{
+    return ((c>='a') && (c<='z')) ? (char)(c - 'a' + 'A') : c;
+}
+
+// ----------------------------------------------------------------------------
+SymbolTable::SymbolTable()
+{
+    slots.assign(INITIAL_SLOTS, NO_SYMBOL);
+}
+
+// ----------------------------------------------------------------------------
+// FNV-1a over the upper case name
+unsigned int SymbolTable::hashName(const char *name, int length)
+{
+    unsigned int hash = 2166136261u;
+    for(int i=0; i<length; i++)
+    {
+        hash ^= (unsigned char)upper(name[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// ----------------------------------------------------------------------------
+bool SymbolTable::equals(const Symbol &symbol, const char *name, int length) const
+{
+    if(symbol.nameLength!=(unsigned int)length)
+        return false;
+
+    const char *stored = &names[symbol.nameOffset];
+    for(int i=0; i<length; i++)
+        if(stored[i]!=upper(name[i]))
+            return false;
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+SymbolId SymbolTable::find(const char *name, int length) const
+{
+    unsigned int hash = hashName(name, length);
+    unsigned int mask = (unsigned int)slots.size() - 1;
+
+    for(unsigned int i = hash & mask; ; i = (i+1) & mask)
+    {
+        SymbolId id = slots[i];
+        if(id==NO_SYMBOL)
+            return NO_SYMBOL;
+        if((symbols[id].hash==hash) && equals(symbols[id], name, length))
+            return id;
+    }
+}
+
+// ----------------------------------------------------------------------------
+SymbolId SymbolTable::intern(const char *name, int length)
+{
+    unsigned int hash = hashName(name, length);
+    unsigned int mask = (unsigned int)slots.size() - 1;
+
+    unsigned int i;
+    for(i = hash & mask; slots[i]!=NO_SYMBOL; i = (i+1) & mask)
+    {
+        SymbolId id = slots[i];
+        if((symbols[id].hash==hash) && equals(symbols[id], name, length))
+            return id;
+    }
+
+    // not found: add the name to the arena and create the symbol in the empty slot
+    Symbol symbol;
+    symbol.nameOffset = (unsigned int)names.size();
+    symbol.nameLength = (unsigned int)length;
+    symbol.hash = hash;
+    symbol.address = 0;
+    symbol.defined = false;
+
+    for(int c=0; c<length; c++)
+        names.push_back(upper(name[c]));
+
+    SymbolId id = (SymbolId)symbols.size();
+    symbols.push_back(symbol);
+    slots[i] = id;
+
+    if(symbols.size()*2 > slots.size()) // keep the load factor under 50%
+        grow();
+
+    return id;
+}
+
+// ----------------------------------------------------------------------------
+// doubles the hash table and reinserts every symbol (the ids don't change)
+void SymbolTable::grow()
+{
+    slots.assign(slots.size()*2, NO_SYMBOL);
+    unsigned int mask = (unsigned int)slots.size() - 1;
+
+    for(SymbolId id=0; id<(SymbolId)symbols.size(); id++)
+    {
+        unsigned int i = symbols[id].hash & mask;
+        while(slots[i]!=NO_SYMBOL)
+            i = (i+1) & mask;
+        slots[i] = id;
+    }
+}
+
+// ----------------------------------------------------------------------------
+// empties the table but keeps the allocated memory for reuse
+void SymbolTable::clear()
+{
+    names.clear();
+    symbols.clear();
+    fill(slots.begin(), slots.end(), NO_SYMBOL);
+}
@@ -0,0 +1,76 @@
+/*
+ *  SymbolTable.h
+ *  6502assembler
+ *
+ *  Interned symbol table for labels.
+ *
+ */
+
+#ifndef SYMBOLTABLE_H
+#define SYMBOLTABLE_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include "types.h"
+
+typedef unsigned int SymbolId;
+#define NO_SYMBOL 0xffffffff
+
+/*
+ * Symbol
+ *
+ * A single interned name. The name itself lives in the name arena of the
+ * symbol table, the symbol only knows where.
+ */
+struct Symbol
+{
+    unsigned int nameOffset;    // offset of the name in the arena
+    unsigned int nameLength;
+    unsigned int hash;
+    word address;
+    bool defined;               // an address has been assigned (address 0 is a valid address)
+};
+
+/*
+ * SymbolTable
+ *
+ * Every name is interned exactly once and gets a 32-bit id, which is simply
+ * its index in the symbol vector, so per-symbol data (like fixups) can be kept
+ * in flat vectors indexed by the id. Names are case insensitive and stored in
+ * upper case. Lookup is an open addressing hash table with linear probing.
+ */
+class SymbolTable
+{
+    std::vector<char> names;        // name arena: all names back to back
+    std::vector<Symbol> symbols;
+    std::vector<SymbolId> slots;    // hash table, size is a power of two, NO_SYMBOL marks an empty slot
+
+    static unsigned int hashName(const char *name, int length);
+    bool equals(const Symbol &symbol, const char *name, int length) const;
+    void grow();
+
+public:
+    SymbolTable();
+
+    SymbolId intern(const char *name, int length);    // finds or creates the symbol
+    SymbolId find(const char *name, int length) const; // returns NO_SYMBOL if not present
+
+    void define(SymbolId id, word address)
+    {
+        symbols[id].address = address;
+        symbols[id].defined = true;
+    }
+
+    void undefine(SymbolId id) { symbols[id].defined = false; } // the address is kept
+
+    bool isDefined(SymbolId id) const { return symbols[id].defined; }
+    word address(SymbolId id) const { return symbols[id].address; }
+    std::string name(SymbolId id) const { return std::string(&names[symbols[id].nameOffset], symbols[id].nameLength); }
+    std::string_view nameView(SymbolId id) const { return std::string_view(&names[symbols[id].nameOffset], symbols[id].nameLength); } // valid until the next intern()
+    unsigned int size() const { return (unsigned int)symbols.size(); }
+
+    void clear();
+};
+
+#endif // SYMBOLTABLE_H
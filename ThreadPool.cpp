@@ -0,0 +1,83 @@
+/*
+ *  ThreadPool.cpp
+ *  6502assembler
+ *
+ *  Work-stealing thread pool for running independent jobs.
+ *
+ */
+
+#include "ThreadPool.h"
+#include <thread>
+
+using namespace std;
+
+// ----------------------------------------------------------------------------
+ThreadPool::ThreadPool(int threads)
+{
+    if(threads<=0)
+        threads = (int)thread::hardware_concurrency();
+    if(threads<=0) // hardware_concurrency() may not know
+        threads = 1;
+
+    threadCount = threads;
+    queues = vector<WorkQueue>(threads);
+}
+
+// ----------------------------------------------------------------------------
+// takes a job from the worker's own queue, or steals one from another worker
+bool ThreadPool::nextJob(int worker, int &job)
+{
+    {
+        lock_guard<mutex> guard(queues[worker].lock);
+        if(!queues[worker].jobs.empty())
+        {
+            job = queues[worker].jobs.front();
+            queues[worker].jobs.pop_front();
+            return true;
+        }
+    }
+
+    for(int i=1; i<threadCount; i++)
+    {
+        WorkQueue &victim = queues[(worker+i) % threadCount];
+        lock_guard<mutex> guard(victim.lock);
+        if(!victim.jobs.empty())
+        {
+            job = victim.jobs.back(); // the owner works from the front, we take from the other end
+            victim.jobs.pop_back();
+            return true;
+        }
+    }
+
+    return false; // every queue is empty. no new jobs appear while running, so we're done
+}
+
+// ----------------------------------------------------------------------------
+void ThreadPool::work(int worker, const function<void(int)> &job)
+{
+    int actJob;
+    while(nextJob(worker, actJob))
+        job(actJob);
+}
+
+// ----------------------------------------------------------------------------
+void ThreadPool::run(int count, const function<void(int)> &job)
+{
+    for(int i=0; i<count; i++) // deal out the jobs in contiguous runs
+        queues[(int)((long long)i * threadCount / count)].jobs.push_back(i);
+
+    int workers = (count<threadCount) ? count : threadCount;
+    if(workers<=1) // no need for threads
+    {
+        work(0, job);
+        return;
+    }
+
+    vector<thread> pool;
+    for(int i=1; i<workers; i++) // the others steal from the queues that have no thread of their own
+        pool.push_back(thread(&ThreadPool::work, this, i, cref(job)));
+    work(0, job); // the calling thread is worker #0
+
+    for(int i=0; i<(int)pool.size(); i++)
+        pool[i].join();
+}
@@ -0,0 +1,49 @@
+/*
+ *  ThreadPool.h
+ *  6502assembler
+ *
+ *  Work-stealing thread pool for running independent jobs.
+ *
+ */
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+/*
+ * ThreadPool
+ *
+ * Runs a batch of jobs, numbered 0..count-1, on a fixed number of threads.
+ * The jobs are dealt out to the workers' own queues up front. A worker
+ * takes work from the front of its own queue, and once that is empty it
+ * steals from the back of the other queues, so a few slow jobs don't
+ * leave the remaining threads idle.
+ *
+ * The jobs must not depend on each other; run() returns when all are done.
+ */
+class ThreadPool
+{
+    struct WorkQueue
+    {
+        std::mutex lock;
+        std::deque<int> jobs;
+    };
+
+    int threadCount;
+    std::vector<WorkQueue> queues;
+
+    bool nextJob(int worker, int &job);
+    void work(int worker, const std::function<void(int)> &job);
+
+public:
+    ThreadPool(int threads); // 0 means one thread per hardware thread
+
+    int threads() const { return threadCount; }
+    void run(int count, const std::function<void(int)> &job);
+};
+
+#endif // THREADPOOL_H
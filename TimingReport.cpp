@@ -0,0 +1,221 @@
+/*
+ *  TimingReport.cpp
+ *  6502assembler
+ *
+ *  Static cycle counts of the assembled code.
+ *
+ */
+
+#include "TimingReport.h"
+#include "OpcodeTable.h"
+#include <algorithm> // sort(), lower_bound()
+#include <stdio.h> // snprintf()
+#include <string.h> // memcpy()
+
+using std::string;
+
+/*
+ * InstructionTiming
+ *
+ * An instruction of the log, decoded from the final bytes.
+ */
+struct InstructionTiming
+{
+    word address;
+    const InstructionInfo *info;
+    unsigned int operand;   // the value after the code (a byte or a word)
+    unsigned int min, max;  // cycles
+    bool crossing;          // the extra cycles are those of a page crossing
+    const InstructionRecord *record;
+
+    bool operator<(const InstructionTiming &other) const { return address<other.address; }
+};
+
+// ----------------------------------------------------------------------------
+// the instruction as in the source, with its operand in hex
+static string disassemble(const InstructionTiming &instruction)
+{
+    const InstructionInfo &info = *instruction.info;
+    unsigned int value = instruction.operand;
+    if(info.column==COLUMN_RELATIVE) // the target
+        value = (word)(instruction.address + 2 + (signed char)value);
+
+    static const char *formats[] =
+    {
+        "%s #$%02X", "%s $%02X", "%s $%02X,X", "%s $%02X,Y", "%s $%04X", "%s $%04X,X", "%s $%04X,Y",
+        "%s ($%02X,X)", "%s ($%02X),Y", "%s", "%s $%04X", "%s ($%04X)"
+    };
+    char text[32];
+    snprintf(text, sizeof(text), formats[info.column], info.opcode->name, value);
+    return text;
+}
+
+static string cycleRange(unsigned int min, unsigned int max)
+{
+    char text[32];
+    if(min==max)
+        snprintf(text, sizeof(text), "%u", min);
+    else
+        snprintf(text, sizeof(text), "%u-%u", min, max);
+    return text;
+}
+
+// ----------------------------------------------------------------------------
+// decodes the instructions of the log and counts their cycles, in the order of their addresses
+static void countCycles(const vector<MemChunk> &chunks, const vector<InstructionRecord> &log, vector<InstructionTiming> &timings)
+{
+    vector<byte> image(MEMORY_SIZE + 2, 0); // an operand may run past $FFFF
+    for(size_t i=0; i<chunks.size(); i++)
+        memcpy(&image[chunks[i].startAddress], chunks[i].data, chunks[i].length);
+
+    for(size_t i=0; i<log.size(); i++)
+    {
+        word address = log[i].address;
+        const InstructionInfo &info = instructionTable.codes[image[address]];
+        if(info.key==0) // can't happen, the assembler emits only instructions of the table
+            continue;
+
+        InstructionTiming timing;
+        timing.address = address;
+        timing.info = &info;
+        timing.operand = (info.length==3) ? (image[address+1] | (image[address+2] << 8)) : ((info.length==2) ? image[address+1] : 0);
+        timing.min = timing.max = info.cycles;
+        timing.crossing = false;
+        timing.record = &log[i];
+
+        if(info.flags & INSTRUCTION_BRANCH)
+        {
+            word target = (word)(address + 2 + (signed char)timing.operand);
+            timing.crossing = (((address + 2) ^ target) & 0xff00)!=0;
+            timing.max += timing.crossing ? 2 : 1;
+        }
+        else if(info.flags & INSTRUCTION_PAGE_PENALTY)
+        {
+            // $1200,x never leaves the page, ($fb),y depends on the pointer
+            timing.crossing = (info.column==COLUMN_INDIRECT_INDEXED) || ((timing.operand & 0xff)!=0);
+            timing.max += timing.crossing ? 1 : 0;
+        }
+        timings.push_back(timing);
+    }
+    std::sort(timings.begin(), timings.end());
+}
+
+// ----------------------------------------------------------------------------
+static bool endsBlock(const InstructionInfo &info)
+{
+    word key = info.key;
+    return (info.flags & INSTRUCTION_BRANCH) || (key==mnemonicKey("JMP")) || (key==mnemonicKey("RTS")) ||
+           (key==mnemonicKey("RTI")) || (key==mnemonicKey("BRK"));
+}
+
+// ----------------------------------------------------------------------------
+void TimingReport::write(const BASSembler6502 &assembler, const vector<MemChunk> &chunks,
+                         const vector<InstructionRecord> &log, string &out)
+{
+    vector<InstructionTiming> timings;
+    countCycles(chunks, log, timings);
+
+    // the labels by address
+    const SymbolTable &labels = assembler.labels();
+    vector<std::pair<word, SymbolId> > byAddress;
+    for(SymbolId id=0; id<labels.size(); id++)
+        if(labels.isDefined(id))
+            byAddress.push_back(std::make_pair(labels.address(id), id));
+    std::sort(byAddress.begin(), byAddress.end());
+
+    // where the basic blocks start
+    vector<bool> leader(MEMORY_SIZE, false);
+    for(size_t i=0; i<byAddress.size(); i++)
+        leader[byAddress[i].first] = true;
+    for(size_t i=0; i<timings.size(); i++)
+    {
+        const InstructionTiming &timing = timings[i];
+        const InstructionInfo &info = *timing.info;
+        if((i==0) || (timings[i-1].address + timings[i-1].info->length != timing.address)) // after data or another chunk
+            leader[timing.address] = true;
+        if(endsBlock(info) && (i+1<timings.size()))
+            leader[timings[i+1].address] = true;
+        if(info.flags & INSTRUCTION_BRANCH)
+            leader[(word)(timing.address + 2 + (signed char)timing.operand)] = true;
+        else if((info.key==mnemonicKey("JMP")) && (info.column==COLUMN_ABSOLUTE))
+            leader[timing.operand] = true;
+    }
+
+    char line[160];
+    out += "timing (cycles; branches not taken-taken, indexed reads within-across a page):\n";
+
+    out += "labels:\n";
+    for(size_t l=0; l<byAddress.size(); l++)
+    {
+        // up to the next label at a higher address
+        size_t next = l+1;
+        while((next<byAddress.size()) && (byAddress[next].first==byAddress[l].first))
+            next++;
+        unsigned int end = (next<byAddress.size()) ? byAddress[next].first : MEMORY_SIZE;
+
+        InstructionTiming start;
+        start.address = byAddress[l].first;
+        unsigned int count = 0, min = 0, max = 0;
+        for(vector<InstructionTiming>::const_iterator i = std::lower_bound(timings.begin(), timings.end(), start);
+            (i!=timings.end()) && (i->address<end); ++i)
+        {
+            count++;
+            min += i->min;
+            max += i->max;
+        }
+        if(count==0) // data
+            continue;
+
+        snprintf(line, sizeof(line), "  %-24s $%04X  %5u instructions  %s\n", string(labels.nameView(byAddress[l].second)).c_str(),
+                 byAddress[l].first, count, cycleRange(min, max).c_str());
+        out += line;
+    }
+
+    out += "blocks:\n";
+    for(size_t first=0; first<timings.size(); )
+    {
+        size_t last = first;
+        unsigned int min = timings[first].min, max = timings[first].max;
+        while((last+1<timings.size()) && !leader[timings[last+1].address])
+        {
+            last++;
+            min += timings[last].min;
+            max += timings[last].max;
+        }
+
+        word address = timings[first].address;
+        vector<std::pair<word, SymbolId> >::const_iterator label =
+            std::lower_bound(byAddress.begin(), byAddress.end(), std::make_pair(address, (SymbolId)0));
+        string name = ((label!=byAddress.end()) && (label->first==address)) ? string(labels.nameView(label->second)) : "";
+        snprintf(line, sizeof(line), "  $%04X-$%04X  %-24s %5u instructions  %s\n", address,
+                 timings[last].address + timings[last].info->length - 1, name.c_str(), (unsigned int)(last-first+1), cycleRange(min, max).c_str());
+        out += line;
+        first = last+1;
+    }
+
+    out += "page crossings:\n";
+    unsigned int crossings = 0;
+    for(size_t i=0; i<timings.size(); i++)
+    {
+        const InstructionTiming &timing = timings[i];
+        if(!timing.crossing)
+            continue;
+
+        const InstructionInfo &info = *timing.info;
+        string where = assembler.unitName(timing.record->unit) + ":" + std::to_string(timing.record->line);
+        if(info.flags & INSTRUCTION_BRANCH)
+            snprintf(line, sizeof(line), "  %s: $%04X %s crosses a page when taken (%u cycles)\n", where.c_str(), timing.address,
+                     disassemble(timing).c_str(), timing.max);
+        else if(info.column==COLUMN_INDIRECT_INDEXED)
+            snprintf(line, sizeof(line), "  %s: $%04X %s crosses a page if the pointer's low byte + Y > $FF (%u cycles)\n", where.c_str(),
+                     timing.address, disassemble(timing).c_str(), timing.max);
+        else
+            snprintf(line, sizeof(line), "  %s: $%04X %s crosses a page for %c >= $%02X (%u cycles)\n", where.c_str(), timing.address,
+                     disassemble(timing).c_str(), (info.column==COLUMN_ABSOLUTE_X) ? 'X' : 'Y', 0x100 - (timing.operand & 0xff), timing.max);
+        out += line;
+        crossings++;
+    }
+    if(crossings==0)
+        out += "  none\n";
+    out += "\n";
+}
@@ -0,0 +1,41 @@
+/*
+ *  TimingReport.h
+ *  6502assembler
+ *
+ *  Static cycle counts of the assembled code.
+ *
+ */
+
+#ifndef TIMINGREPORT_H
+#define TIMINGREPORT_H
+
+#include <string>
+#include <vector>
+#include "BASSembler6502.h"
+
+/*
+ * TimingReport
+ *
+ * Counts the cycles of every instruction of an assembly from its final
+ * bytes, with the addressing mode the assembler chose (see
+ * instructionTable in OpcodeTable.h). A branch takes its minimum when it is
+ * not taken and its maximum when it is; an indexed read takes its maximum
+ * when the index crosses a page. The sums are given for the code from each
+ * label to the next one, and for each basic block (straight-line code:
+ * it starts at a label, at the target of a branch or a jump, or after one
+ * of those, and ends before the next start).
+ *
+ * Branches that cross a page when taken, and indexed reads that can cross a
+ * page, are listed with their lines: those are the extra cycles that break
+ * the timing of raster code.
+ */
+class TimingReport
+{
+public:
+    // Appends the report to 'out'. 'log' holds the instructions the
+    // assembly recorded (see BASSembler6502::recordInstructions()).
+    static void write(const BASSembler6502 &assembler, const vector<MemChunk> &chunks,
+                      const vector<InstructionRecord> &log, std::string &out);
+};
+
+#endif // TIMINGREPORT_H
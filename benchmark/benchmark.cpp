@@ -0,0 +1,526 @@
+/*
+ *  benchmark.cpp
+ *  6502assembler
+ *
+ *  Assembles synthetic sources and reports where the time goes, as JSON.
+ *
+ *  Build it with the assembler's sources, without main.cpp:
+ *      g++ -O2 -std=c++17 -pthread -o bench benchmark/benchmark.cpp $(ls *.cpp | grep -v main.cpp)
+ *  With -DBASSEMBLER_STATS the assemble phase is broken down into its steps
+ *  too, at the price of timing every line.
+ *
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <atomic>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "../BASSembler6502.h"
+#include "../SourceFile.h"
+#include "../ACFile.hpp"
+#include "../BlockWriter.h"
+
+using namespace std;
+
+// ----------------------------------------------------------------------------
+// every allocation of the process is counted, the report shows those of one run
+static atomic<unsigned long long> allocations(0), allocatedBytes(0);
+
+void *operator new(size_t size)
+{
+    allocations++;
+    allocatedBytes += size;
+    void *p = malloc(size ? size : 1);
+    if(p==NULL)
+        throw bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { operator delete(p); }
+void operator delete(void *p, size_t) noexcept { operator delete(p); }
+void operator delete[](void *p, size_t) noexcept { operator delete(p); }
+
+/*
+ * Mix
+ *
+ * The weight of each kind of line in the corpus: plain instructions, label
+ * definitions with forward references and branches, .byte/.word tables and
+ * .text strings.
+ */
+struct Mix
+{
+    unsigned int instructions, labels, bytes, text;
+};
+
+#define MODULE_MAX_BYTES 56000 // a module has to fit into the 64K address space, with room for its last line
+
+/*
+ * CorpusGenerator
+ *
+ * Writes deterministic sources from a seed. The output of a source is kept
+ * under MODULE_MAX_BYTES, so a large corpus is split into modules that are
+ * assembled one after the other, like separate files. Every forward
+ * reference is defined before the end of its module.
+ */
+class CorpusGenerator
+{
+    uint64_t state;
+    Mix mix;
+    unsigned int labelCount;
+    vector<string> pending;     // referenced, not defined yet
+    string backLabel;           // the last label a branch can reach
+    unsigned int backDistance;  // bytes since it
+
+    uint64_t next()             // xorshift64*
+    {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 2685821657736338717ULL;
+    }
+    unsigned int below(unsigned int limit) { return (unsigned int)(next() % limit); }
+
+    string number(unsigned int value, bool hex);
+    unsigned int instruction(string &line);
+    unsigned int labelLine(string &line);
+    unsigned int dataLine(string &line);
+    unsigned int textLine(string &line);
+
+public:
+    CorpusGenerator(uint64_t seed, const Mix &mix);
+    void generate(unsigned int lines, vector<string> &modules);
+};
+
+CorpusGenerator::CorpusGenerator(uint64_t seed, const Mix &mix)
+{
+    state = seed*0x9e3779b97f4a7c15ULL + 1; // never 0
+    this->mix = mix;
+    labelCount = 0;
+    backDistance = 0;
+}
+
+// ----------------------------------------------------------------------------
+string CorpusGenerator::number(unsigned int value, bool hex)
+{
+    char text[16];
+    snprintf(text, sizeof(text), hex ? "$%02x" : "%u", value);
+    return text;
+}
+
+// ----------------------------------------------------------------------------
+// a random instruction with a numeric operand, returns its largest size
+unsigned int CorpusGenerator::instruction(string &line)
+{
+    static const char *implied[] = { "inx", "iny", "dex", "dey", "clc", "sec", "tax", "tay", "txa", "tya", "pha", "pla", "nop", "asl", "lsr", "rol" };
+    static const char *immediate[] = { "lda", "ldx", "ldy", "cmp", "cpx", "adc", "sbc", "and", "ora", "eor" };
+    static const char *memory[] = { "lda", "sta", "ldx", "stx", "ldy", "sty", "inc", "dec", "adc", "cmp", "asl", "bit" };
+    static const char *indexed[] = { "lda", "sta", "adc", "sbc", "cmp", "and", "ora", "eor" };
+
+    bool hex = below(2);
+    switch(below(6))
+    {
+        case 0:
+            line = string(" ") + implied[below(16)];
+            return 1;
+        case 1:
+            line = string(" ") + immediate[below(10)] + " #" + number(below(256), hex);
+            return 2;
+        case 2:
+            line = string(" ") + memory[below(12)] + " " + number(below(256), hex);
+            return 2;
+        case 3:
+            line = string(" ") + memory[below(12)] + " " + number(0x200 + below(0xd000), true);
+            return 3;
+        case 4:
+            line = string(" ") + indexed[below(8)] + " " + number(0x200 + below(0xd000), true) + (below(2) ? ",x" : ",y");
+            return 3;
+        default:
+            line = string(" ") + indexed[below(8)] + " (" + number(below(256), true) + (below(2) ? "),y" : ",x)");
+            return 2;
+    }
+}
+
+// ----------------------------------------------------------------------------
+// defines a label, refers to one that comes later, or branches back to one
+unsigned int CorpusGenerator::labelLine(string &line)
+{
+    unsigned int choice = below(4);
+    if((choice==0) && !pending.empty()) // define a forward referenced label
+    {
+        unsigned int i = below((unsigned int)pending.size());
+        line = pending[i] + ": lda #" + number(below(256), true);
+        backLabel = pending[i];
+        backDistance = 0;
+        pending[i] = pending.back();
+        pending.pop_back();
+        return 2;
+    }
+    if((choice==1) && !backLabel.empty() && (backDistance<100))
+    {
+        static const char *branches[] = { "bne", "beq", "bcc", "bcs", "bpl", "bmi" };
+        line = string(" ") + branches[below(6)] + " " + backLabel;
+        return 2;
+    }
+    if(choice<=1) // a label that can be branched back to
+    {
+        backLabel = "b" + to_string(labelCount++);
+        backDistance = 0;
+        line = backLabel + ": dex";
+        return 1;
+    }
+
+    // a forward reference
+    string label = "f" + to_string(labelCount++);
+    pending.push_back(label);
+    switch(below(4))
+    {
+        case 0:  line = " jsr " + label; break;
+        case 1:  line = " jmp " + label; break;
+        case 2:  line = " lda " + label + "+" + to_string(below(8)) + ",x"; break;
+        default: line = " ldx #<" + label; return 2;
+    }
+    return 3;
+}
+
+// ----------------------------------------------------------------------------
+unsigned int CorpusGenerator::dataLine(string &line)
+{
+    bool words = below(4)==0;
+    unsigned int count = 4 + below(13);
+    bool hex = below(2);
+    line = words ? " .word " : " .byte ";
+    for(unsigned int i=0; i<count; i++)
+    {
+        if(i)
+            line += ", ";
+        line += number(below(words ? 0x10000 : 0x100), hex);
+    }
+    return words ? count*2 : count;
+}
+
+// ----------------------------------------------------------------------------
+unsigned int CorpusGenerator::textLine(string &line)
+{
+    if(below(16)==0)
+    {
+        static const char *charsets[] = { " .ascii", " .petscii", " .screen" };
+        line = charsets[below(3)];
+        return 0;
+    }
+
+    static const char letters[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ abcdefghijklmnopqrstuvwxyz 0123456789.,!?-";
+    unsigned int length = 8 + below(33);
+    line = " .text \"";
+    for(unsigned int i=0; i<length; i++)
+        line += letters[below(sizeof(letters)-1)];
+    line += "\"";
+    return length;
+}
+
+/*
+ * generate()
+ *
+ * Fills 'modules' with sources of 'lines' lines in total. About one line in
+ * ten is a comment, or has one at its end.
+ */
+void CorpusGenerator::generate(unsigned int lines, vector<string> &modules)
+{
+    unsigned int total = mix.instructions + mix.labels + mix.bytes + mix.text;
+    string source, line;
+    unsigned int size = 0, sourceLines = 0;
+
+    for(unsigned int i=0; i<lines; i++)
+    {
+        if(source.empty())
+        {
+            source = ".pc = $0801\n";
+            size = 0;
+            sourceLines = 1;
+            backLabel.clear();
+            continue;
+        }
+
+        unsigned int pick = below(total), bytes;
+        if(below(20)==0)
+        {
+            line = "; comment " + to_string(i);
+            bytes = 0;
+        }
+        else if(pick<mix.instructions)
+            bytes = instruction(line);
+        else if((pick -= mix.instructions)<mix.labels)
+            bytes = labelLine(line);
+        else if((pick -= mix.labels)<mix.bytes)
+            bytes = dataLine(line);
+        else
+            bytes = textLine(line);
+
+        if((below(20)==0) && (line.compare(0, 7, " .text ")!=0)) // .text can't have a comment
+            line += " ; note";
+        source += line;
+        source += '\n';
+        size += bytes;
+        sourceLines++;
+        backDistance += bytes;
+
+        // close the module: define what is still pending
+        bool last = (i+1==lines);
+        if(last || (size + 3*pending.size() + 64 > MODULE_MAX_BYTES))
+        {
+            for(size_t j=0; j<pending.size(); j++)
+                source += pending[j] + ": rts\n";
+            i += (unsigned int)pending.size();
+            pending.clear();
+            modules.push_back(source);
+            source.clear();
+        }
+    }
+    if(!source.empty())
+        modules.push_back(source);
+}
+
+// ----------------------------------------------------------------------------
+// formats the hex dump and writes the blocks the way bassembler does
+static size_t writeOutput(const vector<MemChunk> &chunks, const string &prefix, string &report)
+{
+    size_t bytes = 0;
+    report.clear();
+    for(size_t i=0; i<chunks.size(); i++)
+    {
+        const MemChunk &chunk = chunks[i];
+        if(chunk.length==0)
+            continue;
+        BlockWriter::hexDump(report, chunk.data, chunk.length);
+        if(BlockWriter::writePrg(prefix + to_string(i) + ".prg", chunk)==-1)
+            cerr << "Cannot write " << prefix << i << ".prg: " << strerror(errno) << endl;
+        bytes += chunk.length;
+    }
+    return bytes;
+}
+
+// ----------------------------------------------------------------------------
+static double milliseconds(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+// removes the sources and the blocks of the runs
+static void removeFiles(const string &dir, const vector<string> &fileNames)
+{
+    for(size_t i=0; i<fileNames.size(); i++)
+    {
+        unlink(fileNames[i].c_str());
+        unlink((dir + "/block" + to_string(i) + "-0.prg").c_str()); // a module is a single block
+    }
+    rmdir(dir.c_str());
+}
+
+static double median(vector<double> values)
+{
+    sort(values.begin(), values.end());
+    return values[values.size()/2];
+}
+
+static int parseMix(const char *text, Mix &mix)
+{
+    if(strcmp(text, "instructions")==0)  mix = { 1, 0, 0, 0 };
+    else if(strcmp(text, "labels")==0)   mix = { 1, 3, 0, 0 };
+    else if(strcmp(text, "bytes")==0)    mix = { 1, 0, 4, 0 };
+    else if(strcmp(text, "text")==0)     mix = { 1, 0, 0, 4 };
+    else if(strcmp(text, "mixed")==0)    mix = { 4, 2, 1, 1 };
+    else if(sscanf(text, "%u,%u,%u,%u", &mix.instructions, &mix.labels, &mix.bytes, &mix.text)!=4)
+        return -1;
+    return (mix.instructions + mix.labels + mix.bytes + mix.text) ? 0 : -1;
+}
+
+static void usage()
+{
+    cout << "Usage: bench [--lines N] [--mix instructions|labels|bytes|text|mixed|I,L,B,T] [--seed N] [--runs N]" << endl;
+    cout << "             [--corpus prefix] (writes the sources as <prefix><n>.asm)" << endl;
+}
+
+/*
+ * The phases of a run:
+ *   read      mapping the source files
+ *   assemble  BASSembler6502::assemble() from the first line to the resolved fixups
+ *   output    the hex dump and the .prg files
+ * Each one is the median of all runs. The steps of the assemble phase are
+ * those of AssemblyStats: 'split' is the assembler's own cutting of the
+ * sources into lines, it goes along with assembling them.
+ */
+int main(int argc, char *argv[])
+{
+    unsigned int lines = 100000, runs = 5;
+    uint64_t seed = 1;
+    Mix mix = { 4, 2, 1, 1 };
+    string corpusPrefix, mixName = "mixed";
+
+    for(int i=1; i<argc; i++)
+    {
+        bool hasValue = i+1<argc;
+        if((strcmp(argv[i], "--lines")==0) && hasValue)
+            lines = (unsigned int)strtoul(argv[++i], NULL, 0);
+        else if((strcmp(argv[i], "--runs")==0) && hasValue)
+            runs = max(1u, (unsigned int)strtoul(argv[++i], NULL, 0));
+        else if((strcmp(argv[i], "--seed")==0) && hasValue)
+            seed = strtoull(argv[++i], NULL, 0);
+        else if((strcmp(argv[i], "--corpus")==0) && hasValue)
+            corpusPrefix = argv[++i];
+        else if((strcmp(argv[i], "--mix")==0) && hasValue && (parseMix(argv[i+1], mix)==0))
+            mixName = argv[++i];
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    vector<string> modules;
+    CorpusGenerator generator(seed, mix);
+    generator.generate(lines, modules);
+
+    // the sources are read from files, like real ones
+    char tempDir[] = "/tmp/bassbenchXXXXXX";
+    if(mkdtemp(tempDir)==NULL)
+    {
+        cerr << "Cannot create a temporary directory: " << strerror(errno) << endl;
+        return 1;
+    }
+    string dir = tempDir;
+    vector<string> fileNames;
+    size_t sourceBytes = 0;
+    for(size_t i=0; i<modules.size(); i++)
+    {
+        fileNames.push_back(dir + "/module" + to_string(i) + ".asm");
+        ACFile file;
+        char *text = &modules[i][0];
+        file.save(fileNames[i], text, (unsigned int)modules[i].size());
+        if(!corpusPrefix.empty())
+            file.save(corpusPrefix + to_string(i) + ".asm", text, (unsigned int)modules[i].size());
+        sourceBytes += modules[i].size();
+    }
+
+    vector<double> readTimes, assembleTimes, outputTimes, totalTimes;
+    vector<double> splitTimes, directiveTimes, labelTimes, lineTimes, fixupTimes, otherTimes;
+    unsigned long long runAllocations = 0, runAllocatedBytes = 0;
+    size_t outputBytes = 0;
+    string report; // the hex dump, it keeps its capacity like the output buffer of a long run would
+    for(unsigned int run=0; run<runs; run++)
+    {
+        double read = 0, assemble = 0, output = 0;
+        uint64_t split = 0, directive = 0, label = 0, instruction = 0, fixup = 0, other = 0;
+        unsigned long long allocationsBefore = allocations, bytesBefore = allocatedBytes;
+        outputBytes = 0;
+
+        for(size_t i=0; i<modules.size(); i++)
+        {
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            SourceFile source;
+            if(source.open(fileNames[i].c_str())==-1)
+            {
+                cerr << "Cannot open " << fileNames[i] << ": " << strerror(errno) << endl;
+                removeFiles(dir, fileNames);
+                return 1;
+            }
+            read += milliseconds(start);
+
+            start = chrono::steady_clock::now();
+            string_view text = source.text();
+            BASSembler6502 assembler;
+            vector<MemChunk> *chunks;
+            AssemblyStats stats;
+            memset(&stats, 0, sizeof(stats));
+#ifdef BASSEMBLER_STATS
+            AssemblyStats *statsWanted = &stats;
+#else
+            AssemblyStats *statsWanted = NULL;
+#endif
+            if(assembler.assemble(text, chunks, fileNames[i], statsWanted))
+            {
+                cerr << "Error: " << assembler.asmError.errorString << " in " << assembler.asmError.fileName << ":"
+                     << assembler.asmError.errorLineNumber << endl << "\"" << assembler.asmError.lineContent << "\"" << endl;
+                removeFiles(dir, fileNames);
+                return 1;
+            }
+            assemble += milliseconds(start);
+            split += stats.splitTime;
+            directive += stats.directiveTime;
+            label += stats.labelTime;
+            instruction += stats.lineTime;
+            fixup += stats.fixupTime;
+            other += stats.otherTime;
+
+            start = chrono::steady_clock::now();
+            outputBytes += writeOutput(*chunks, dir + "/block" + to_string(i) + "-", report);
+            delete chunks;
+            output += milliseconds(start);
+        }
+
+        readTimes.push_back(read);
+        assembleTimes.push_back(assemble);
+        outputTimes.push_back(output);
+        totalTimes.push_back(read + assemble + output);
+        splitTimes.push_back(split/1e6);
+        directiveTimes.push_back(directive/1e6);
+        labelTimes.push_back(label/1e6);
+        lineTimes.push_back(instruction/1e6);
+        fixupTimes.push_back(fixup/1e6);
+        otherTimes.push_back(other/1e6);
+        runAllocations = allocations - allocationsBefore;
+        runAllocatedBytes = allocatedBytes - bytesBefore;
+    }
+
+    removeFiles(dir, fileNames);
+
+    struct rusage resources;
+    getrusage(RUSAGE_SELF, &resources);
+
+    char steps[256] = "";
+#ifdef BASSEMBLER_STATS
+    snprintf(steps, sizeof(steps),
+             "  \"assemble_steps_ms\": { \"split\": %.3f, \"directives\": %.3f, \"labels\": %.3f, \"instructions\": %.3f, \"fixups\": %.3f, \"other\": %.3f },\n",
+             median(splitTimes), median(directiveTimes), median(labelTimes), median(lineTimes), median(fixupTimes), median(otherTimes));
+#endif
+
+    double total = median(totalTimes);
+    char json[2048];
+    snprintf(json, sizeof(json),
+             "{\n"
+             "  \"version\": \"%s\",\n"
+             "  \"seed\": %llu,\n"
+             "  \"lines\": %u,\n"
+             "  \"mix\": { \"name\": \"%s\", \"instructions\": %u, \"labels\": %u, \"bytes\": %u, \"text\": %u },\n"
+             "  \"modules\": %zu,\n"
+             "  \"source_bytes\": %zu,\n"
+             "  \"output_bytes\": %zu,\n"
+             "  \"runs\": %u,\n"
+             "  \"phases_ms\": { \"read\": %.3f, \"assemble\": %.3f, \"output\": %.3f },\n"
+             "%s"
+             "  \"total_ms\": %.3f,\n"
+             "  \"lines_per_sec\": %.0f,\n"
+             "  \"bytes_per_sec\": %.0f,\n"
+             "  \"allocations\": %llu,\n"
+             "  \"allocated_bytes\": %llu,\n"
+             "  \"peak_rss_kb\": %ld\n"
+             "}\n",
+             BASSEMBLER_VERSION, (unsigned long long)seed, lines,
+             mixName.c_str(), mix.instructions, mix.labels, mix.bytes, mix.text,
+             modules.size(), sourceBytes, outputBytes, runs,
+             median(readTimes), median(assembleTimes), median(outputTimes), steps,
+             total, lines / (total/1000), sourceBytes / (total/1000),
+             runAllocations, runAllocatedBytes, resources.ru_maxrss);
+    cout << json;
+    return 0;
+}
@@ -1,86 +1,651 @@
 #include <iostream>
+#include <fstream>
 #include <string>
-#include "ACFile.hpp"
-#include "Bassembler6502.h"
-#include <sstream> // istringstream
+#include "BASSembler6502.h"
+#include "SourceFile.h"
+#include "ThreadPool.h"
+#include "IncrementalAssembler.h"
+#include "AssemblyCache.h"
+#include "BlockWriter.h"
+#include "ObjectFile.h"
+#include "Linker.h"
+#include "Emulator6502.h"
+#include "TimingReport.h"
+#include <sstream> // stringstream
+#include <string.h> // strerror()
+#include <errno.h>
+#include <stdio.h> // snprintf()
+#include <stdlib.h> // strtoull()
+#include <fcntl.h> // open()
+#include <unistd.h> // pwrite(), ftruncate()
+#include <sys/stat.h> // mkdir()
+#include <chrono>
 
 using namespace std;
 
-int main (int argc, char * const argv[])
+// ----------------------------------------------------------------------------
+static void printError(const AssemblyError &error, ostream &out)
 {
-	BASSembler6502 asm6502;
-	vector<MemChunk> *chunks;
-
-    cout << "BASSembler6502 v0.17beta (12.06.2012) -- 6502 cross-assembler\nWritten (c) 2011-2012 by Zoltán Majoros (zoltan@arcanelab.com)" << endl << endl;
-    
-    if(argc<2)
-    {
-        cout << "Please specify a file name." << endl;
-        return 0;
-    }
-    
-	char *buffer;
-	ACFile file(argv[1], buffer);
-	
-	if(asm6502.assemble(buffer, chunks)) // if compliation is unsuccessful...
-	{
-		cout << "Error: " << asm6502.asmError.errorString << " in line " << dec << asm6502.asmError.errorLineNumber << endl;
-		cout << "\"" << asm6502.asmError.lineContent << "\"" << endl;
-		if(asm6502.asmError.errorStringVerbose!="")
-			cout << "\nHint: " << asm6502.asmError.errorStringVerbose << endl;
-		
-		return -1;
+	if(error.errorLineNumber==0) // not about a line of the source
+		out << "Error: " << error.errorString << endl;
+	else
+	{
+		out << "Error: " << error.errorString << " in " << error.fileName << ":" << dec << error.errorLineNumber << endl;
+		out << "\"" << error.lineContent << "\"" << endl;
 	}
-    
-	for(int i=0; i<(int)chunks->size(); i++)
+	if(error.errorStringVerbose!="")
+		out << "\nHint: " << error.errorStringVerbose << endl;
+}
+
+// ----------------------------------------------------------------------------
+// the name of the file a block is written to
+static string blockFileName(const string &outputPrefix, const MemChunk &chunk)
+{
+	stringstream ss;
+	ss << outputPrefix << hex << chunk.startAddress << ".prg";
+	return ss.str();
+}
+
+static bool quiet = false; // --quiet, no hex dump
+
+/*
+ * reportBlocks()
+ *
+ * Writes the blocks of an assembly to '<prefix><address>.prg' and prints
+ * their addresses, lengths and hex dumps. The report is put together in a
+ * single buffer and goes to 'out' in one piece.
+ * Returns 0, or -1 if a block couldn't be written.
+ */
+static int reportBlocks(const vector<MemChunk> &chunks, const string &outputPrefix, ostream &out)
+{
+	int result = 0;
+	string report;
+	for(int i=0; i<(int)chunks.size(); i++)
 	{
-		MemChunk chunk = (*chunks)[i];
-		cout << "block #" << i+1 << ":" << endl;
-		cout << "address = $" << hex << chunk.startAddress << endl;		
-		cout << "length = $" << chunk.length << endl;
-		
+		const MemChunk &chunk = chunks[i];
+		char line[64];
+		snprintf(line, sizeof(line), "block #%d:\naddress = $%x\nlength = $%x\n", i+1, chunk.startAddress, chunk.length);
+		report += line;
+
         if(chunk.length==0)
         {
-            cout << endl;
+            report += '\n';
             continue;
         }
-        
+
         // composing filename for binary
-        stringstream ss;
-        ss << "block-" << hex << chunk.startAddress << ".prg";
-        cout << "filename: " << ss.str() << endl << endl;;
-        string fileName = ss.str();
+        string fileName = blockFileName(outputPrefix, chunk);
+        report += "filename: " + fileName + "\n\n";
+
+		if(!quiet)
+		{
+			BlockWriter::hexDump(report, chunk.data, chunk.length);
+			report += "\n\n";
+		}
+
+		if(BlockWriter::writePrg(fileName, chunk)==-1)
+		{
+			report += "File write error: " + fileName + " (" + strerror(errno) + ")\n";
+			result = -1;
+		}
+	}
+
+	out.write(report.data(), report.size());
+	return result;
+}
+
+// ----------------------------------------------------------------------------
+static void reportStats(const AssemblyStats &stats, ostream &out)
+{
+	static const char *modeNames[ADDR_MODE_COUNT] = { "invalid", "implied", "immediate", "direct", "indexed x", "indexed y",
+	                                                 "indirect", "(zp,x)", "(zp),y" };
+	uint64_t total = stats.splitTime + stats.directiveTime + stats.labelTime + stats.lineTime + stats.fixupTime + stats.otherTime;
+	char times[256];
+	snprintf(times, sizeof(times), "split %.3f, directives %.3f, labels %.3f, instructions %.3f, fixups %.3f, other %.3f, total %.3f",
+	         stats.splitTime/1e6, stats.directiveTime/1e6, stats.labelTime/1e6, stats.lineTime/1e6, stats.fixupTime/1e6, stats.otherTime/1e6,
+	         total/1e6);
+
+	out << dec << "statistics:" << endl;
+	out << "passes: " << stats.passes << ", lines: " << stats.lines << ", tokens: " << stats.tokens
+	    << ", directives: " << stats.directives << ", labels: " << stats.labels << endl;
+	out << "time (ms): " << times << endl;
+	out << "addressing modes:";
+	for(int i=ADDR_IMPLIED; i<ADDR_MODE_COUNT; i++)
+		out << (i==ADDR_IMPLIED ? " " : ", ") << modeNames[i] << " " << stats.modes[i];
+	out << endl;
+	out << "forward references: " << stats.fixups << ", relaxation sites: " << stats.relaxSites << endl;
+	out << "chunks: " << stats.chunks << ", bytes: " << stats.bytes << endl << endl;
+}
+
+// the rewrites of the optimizer (-O), with what they saved
+static void reportOptimizations(const BASSembler6502 &assembler, string &report)
+{
+	const vector<PeepholeRewrite> &rewrites = assembler.optimizations();
+	unsigned int bytes = 0, cycles = 0;
+	stringstream out;
+	out << "optimizations:" << endl;
+	for(size_t i=0; i<rewrites.size(); i++)
+	{
+		const PeepholeRewrite &rewrite = rewrites[i];
+		out << assembler.unitName(rewrite.unit) << ":" << rewrite.line << ": " << rewrite.rule
+		    << " (-" << rewrite.bytes << " bytes, -" << rewrite.cycles << " cycles)" << endl;
+		bytes += rewrite.bytes;
+		cycles += rewrite.cycles;
+	}
+	out << "total: " << rewrites.size() << " rewrites, -" << bytes << " bytes, -" << cycles << " cycles" << endl << endl;
+	report += out.str();
+}
+
+static string cacheDirectory; // --cache, empty if there is no cache
+static bool printStats = false; // --stats
+static bool compileObjects = false; // -c
+static bool printTiming = false; // --timing
+static bool optimizeCode = false; // -O
+
+// the name of a source without its extension
+static string stripExtension(const string &fileName)
+{
+	string name = fileName;
+	size_t dot = name.rfind('.');
+	size_t slash = name.rfind('/');
+	if((dot!=string::npos) && ((slash==string::npos) || (dot>slash)))
+		name.erase(dot);
+	return name;
+}
+
+// the options that change the result, or the reports kept with it in the cache
+static string cacheOptions(bool timing)
+{
+	return string(optimizeCode ? "-O " : "") + (timing ? "--timing" : "");
+}
+
 /*
-        printf("byte prg[] = {");
-        for(int j=0; j<chunk.length; j++)
+ * assembleFile()
+ *
+ * Assembles a single source file, writes its blocks to '<prefix><address>.prg'
+ * and prints the report (or the error) to 'out'. Every call has its own
+ * assembler, so it can run on any thread. With a cache, a source that was
+ * assembled before is not assembled again if neither it nor the files it
+ * includes changed since. 'threads' assemble the .pc segments of the source.
+ * With -c the source is a module: labels it doesn't define are left to the
+ * linker, and the result goes to '<name>.o' instead (not cached).
+ * Returns 0 on success, -1 on error.
+ */
+static int assembleFile(const char *sourceName, const string &outputPrefix, ostream &out, int threads = 1)
+{
+	BASSembler6502 asm6502;
+	asm6502.setThreads(threads);
+	asm6502.allowExternals(compileObjects);
+	asm6502.setOptimize(optimizeCode);
+	vector<InstructionRecord> instructions;
+	if(printTiming)
+		asm6502.recordInstructions(&instructions);
+	vector<MemChunk> *chunks;
+
+	SourceFile source; // mapped, not copied ("-" reads stdin)
+	if(source.open(sourceName)==-1)
+	{
+		out << "File open error:" << sourceName << " (" << strerror(errno) << ")" << endl;
+		return -1;
+	}
+
+	AssemblyCache cache(compileObjects ? "" : cacheDirectory);
+	if(cache.lookup(sourceName, source.text(), cacheOptions(printTiming))==0)
+	{
+		int result = reportBlocks(cache.chunks(), outputPrefix, out);
+		if(printStats)
+			out << "statistics: none, the result was cached" << endl << endl;
+		out.write(cache.report().data(), cache.report().size());
+		return result;
+	}
+
+	AssemblyStats stats;
+	if(asm6502.assemble(source.text(), chunks, sourceName, printStats ? &stats : NULL)) // if compliation is unsuccessful...
+	{
+		printError(asm6502.asmError, out);
+		return -1;
+	}
+
+	if(compileObjects)
+	{
+		string objectName = stripExtension(sourceName) + ".o";
+		int result = ObjectFile::write(objectName, asm6502, *chunks);
+		if(result==-1)
+			out << "File write error: " << objectName << " (" << strerror(errno) << ")" << endl;
+		else
+			out << "object file: " << objectName << endl << endl;
+		delete chunks;
+		return result;
+	}
+
+	string report; // kept with the result in the cache
+	if(optimizeCode)
+		reportOptimizations(asm6502, report);
+	if(printTiming)
+		TimingReport::write(asm6502, *chunks, instructions, report);
+	if(cache.store(asm6502, *chunks, report)==-1) // the result is fine anyway
+		out << "Cache write error: " << cacheDirectory << " (" << strerror(errno) << ")" << endl;
+
+	int result = reportBlocks(*chunks, outputPrefix, out);
+	if(printStats)
+		reportStats(stats, out);
+	out.write(report.data(), report.size());
+
+	delete chunks;
+    return result;
+}
+
+/*
+ * Batch mode
+ *
+ * Every input is assembled by its own assembler on a thread pool. The blocks
+ * of 'dir/name.asm' are written to 'dir/name-<address>.prg', so the inputs
+ * don't overwrite each other's output. The reports are collected and
+ * printed in the order of the inputs, whichever job finishes first.
+ */
+static int assembleBatch(const vector<string> &inputs, int threads)
+{
+	vector<string> reports(inputs.size());
+	vector<int> results(inputs.size());
+
+	ThreadPool pool(threads);
+	pool.run((int)inputs.size(), [&](int i)
+	{
+		stringstream report;
+		results[i] = assembleFile(inputs[i].c_str(), stripExtension(inputs[i]) + "-", report);
+		reports[i] = report.str();
+	});
+
+	int failed = 0;
+	for(int i=0; i<(int)inputs.size(); i++)
+	{
+		cout << inputs[i] << ":" << endl << reports[i];
+		if(results[i]!=0)
+			failed++;
+	}
+
+	if(failed)
+		cout << dec << failed << " of " << inputs.size() << " files failed." << endl;
+
+	return failed ? -1 : 0;
+}
+
+/*
+ * linkObjects()
+ *
+ * Links object files written by -c, and writes the blocks like an assembly.
+ */
+static int linkObjects(const vector<string> &inputs)
+{
+	Linker linker;
+	vector<MemChunk> *chunks;
+	for(size_t i=0; i<inputs.size(); i++)
+	{
+		if(linker.add(inputs[i].c_str())==-1)
 		{
-            if(j==0)
-                printf("0x%.2X", chunk.data[j]);
-            else
-                printf(", 0x%.2X", chunk.data[j]);
-			if((j%16)==15) cout << endl;
+			printError(linker.error, cout);
+			return -1;
 		}
-        printf("};");
-*/
-        
-		for(int j=0; j<chunk.length; j++)
+	}
+
+	if(linker.link(chunks)==-1)
+	{
+		printError(linker.error, cout);
+		return -1;
+	}
+
+	int result = reportBlocks(*chunks, "block-", cout);
+	delete chunks;
+	return result;
+}
+
+/*
+ * runRoutine()
+ *
+ * Assembles a source and runs the routine at a label in the emulator, as
+ * if it was called by a JSR, until it returns, or a BRK, an illegal opcode
+ * or 'budget' cycles stop it. Prints the registers, the cycles and the
+ * bytes the routine changed. No blocks are written. With a cache, the
+ * blocks and the labels of an earlier assembly are used.
+ */
+static int runRoutine(const char *sourceName, const string &label, uint64_t budget)
+{
+	BASSembler6502 asm6502;
+	asm6502.setOptimize(optimizeCode);
+	vector<MemChunk> *chunks = NULL;
+
+	SourceFile source;
+	if(source.open(sourceName)==-1)
+	{
+		cout << "File open error:" << sourceName << " (" << strerror(errno) << ")" << endl;
+		return -1;
+	}
+
+	AssemblyCache cache(cacheDirectory);
+	SymbolTable cachedLabels;
+	const SymbolTable *labelTable = &cachedLabels;
+	if(cache.lookup(sourceName, source.text(), cacheOptions(false))==0)
+		cache.loadLabels(cachedLabels);
+	else
+	{
+		if(asm6502.assemble(source.text(), chunks, sourceName))
 		{
-			//cout << hex << (unsigned int)chunk.data[j];
-			printf("%.2X ", chunk.data[j]);
-			if((j%16)==15) cout << endl;
+			printError(asm6502.asmError, cout);
+			return -1;
 		}
-        
-		cout << endl << endl;
-
-        // creating buffer for binary
-        char *buffer = new char[chunk.length+2];
-        buffer[0] = chunk.startAddress & 0xff; // adding startaddress at beginning
-        buffer[1] = (chunk.startAddress & 0xff00)>>8;
-        memcpy(buffer+2, chunk.data, chunk.length);
-        ACFile file;
-        file.save((const string)fileName, buffer, (unsigned int)chunk.length+2); // writing out data
-        delete [] buffer;
-	}
-	
-    return 0;
+		string report; // what assembleFile() would keep with the same options
+		if(optimizeCode)
+			reportOptimizations(asm6502, report);
+		if(cache.store(asm6502, *chunks, report)==-1) // the result is fine anyway
+			cout << "Cache write error: " << cacheDirectory << " (" << strerror(errno) << ")" << endl;
+		labelTable = &asm6502.labels();
+	}
+
+	const SymbolTable &labels = *labelTable;
+	SymbolId id = labels.find(label.data(), (int)label.size());
+	if((id==NO_SYMBOL) || !labels.isDefined(id))
+	{
+		cout << "Error: Label not found: " << label << endl;
+		delete chunks;
+		return -1;
+	}
+
+	Emulator6502 *cpu = new Emulator6502(); // 64K, not for the stack
+	cpu->load((chunks!=NULL) ? *chunks : cache.chunks());
+	delete chunks;
+	::byte *before = new ::byte[MEMORY_SIZE]; // not std::byte
+	memcpy(before, cpu->memory, MEMORY_SIZE);
+
+	static const char *stops[] = { "returned", "stopped at a BRK", "ran out of cycles", "stopped at an illegal opcode" };
+	int stop = cpu->run(labels.address(id), budget);
+
+	char line[128];
+	string report;
+	snprintf(line, sizeof(line), "%s ($%04X) %s after %llu cycles, %llu instructions\n", label.c_str(), labels.address(id), stops[stop],
+	         (unsigned long long)cpu->cycles, (unsigned long long)cpu->instructions);
+	report += line;
+	snprintf(line, sizeof(line), "A=$%02X X=$%02X Y=$%02X S=$%02X P=$%02X PC=$%04X\n", cpu->a, cpu->x, cpu->y, cpu->s, cpu->p, cpu->pc);
+	report += line;
+
+	vector<MemoryChange> changed;
+	cpu->changes(before, changed);
+	report += changed.empty() ? "no memory changed\n" : "changed memory:\n";
+	for(size_t i=0; i<changed.size(); i++)
+	{
+		snprintf(line, sizeof(line), "$%04X:\n", changed[i].address);
+		report += line;
+		BlockWriter::hexDump(report, cpu->memory + changed[i].address, changed[i].length);
+		report += "\n";
+	}
+
+	cout.write(report.data(), report.size());
+	delete [] before;
+	delete cpu;
+	return (stop==EMULATOR_RETURNED) ? 0 : -1;
+}
+
+// ----------------------------------------------------------------------------
+// reads a manifest: one source file name per line, empty lines are skipped
+static int readManifest(const char *fileName, vector<string> &inputs)
+{
+	ifstream manifest(fileName);
+	if(!manifest)
+	{
+		cout << "File open error:" << fileName << endl;
+		return -1;
+	}
+
+	string line;
+	while(getline(manifest, line))
+	{
+		size_t first = line.find_first_not_of(" \t\r");
+		if(first==string::npos)
+			continue;
+		size_t last = line.find_last_not_of(" \t\r");
+		inputs.push_back(line.substr(first, last-first+1));
+	}
+	return 0;
+}
+
+/*
+ * Daemon mode
+ *
+ * Assembles a single file and keeps it in memory. Then diffs of the file
+ * are read from stdin, in the normal format of diff(1), each one ended by an
+ * empty line. Only the bytes a diff changed are written into the block files.
+ * 'reload' reads the file again, 'quit' (or the end of the input) ends it.
+ * Every diff is answered by a single line, or by an error report.
+ */
+static void writeBlocks(const vector<MemChunk> &chunks)
+{
+	for(size_t i=0; i<chunks.size(); i++)
+		if((chunks[i].length>0) && (BlockWriter::writePrg(blockFileName("block-", chunks[i]), chunks[i])==-1))
+			cout << "File write error: " << blockFileName("block-", chunks[i]) << " (" << strerror(errno) << ")" << endl;
+}
+
+static void writePatches(const vector<MemChunk> &chunks, const vector<Patch> &patches)
+{
+	int file = -1;
+	unsigned int fileChunk = 0;
+	for(size_t i=0; i<=patches.size(); i++)
+	{
+		if((file!=-1) && ((i==patches.size()) || (patches[i].chunk!=fileChunk))) // done with this block
+		{
+			if(ftruncate(file, chunks[fileChunk].length+2)==-1)
+				cout << "File write error: " << blockFileName("block-", chunks[fileChunk]) << " (" << strerror(errno) << ")" << endl;
+			close(file);
+			file = -1;
+		}
+		if(i==patches.size())
+			break;
+
+		const MemChunk &chunk = chunks[patches[i].chunk];
+		if(file==-1)
+		{
+			fileChunk = patches[i].chunk;
+			file = open(blockFileName("block-", chunk).c_str(), O_WRONLY | O_CREAT, 0644);
+			char header[2] = { (char)(chunk.startAddress & 0xff), (char)(chunk.startAddress >> 8) }; // in case the block is new
+			if((file==-1) || (pwrite(file, header, 2, 0)!=2))
+			{
+				cout << "File write error: " << blockFileName("block-", chunk) << " (" << strerror(errno) << ")" << endl;
+				if(file!=-1)
+					close(file);
+				file = -1;
+				continue;
+			}
+		}
+		if(pwrite(file, chunk.data + patches[i].offset, patches[i].length, patches[i].offset+2)!=(ssize_t)patches[i].length)
+			cout << "File write error: " << blockFileName("block-", chunk) << " (" << strerror(errno) << ")" << endl;
+	}
+}
+
+static int loadDaemonSource(IncrementalAssembler &incremental, const char *sourceName)
+{
+	SourceFile source;
+	if(source.open(sourceName)==-1)
+	{
+		cout << "File open error:" << sourceName << " (" << strerror(errno) << ")" << endl;
+		return -1;
+	}
+	if(incremental.load(source.text(), sourceName)==-1)
+	{
+		printError(incremental.error(), cout);
+		return -1;
+	}
+	writeBlocks(incremental.chunks());
+	cout << "assembled " << sourceName << endl;
+	return 0;
+}
+
+static int runDaemon(const char *sourceName)
+{
+	IncrementalAssembler incremental;
+	loadDaemonSource(incremental, sourceName); // a source with an error may be fixed by the next diff
+
+	string line, diff;
+	while(getline(cin, line))
+	{
+		if(line=="quit")
+			break;
+		if(line=="reload")
+		{
+			loadDaemonSource(incremental, sourceName);
+			continue;
+		}
+		if(!line.empty())
+		{
+			diff += line;
+			diff += '\n';
+			continue;
+		}
+		if(diff.empty())
+			continue;
+
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		vector<Patch> patches;
+		int result = incremental.update(diff, patches);
+		diff.clear();
+		if(result==-1)
+		{
+			printError(incremental.error(), cout);
+			continue;
+		}
+
+		unsigned int bytes = 0;
+		if(result==1)
+			writeBlocks(incremental.chunks());
+		else
+		{
+			writePatches(incremental.chunks(), patches);
+			for(size_t i=0; i<patches.size(); i++)
+				bytes += patches[i].length;
+		}
+
+		double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+		if(result==1)
+			cout << "reassembled in " << ms << " ms" << endl;
+		else
+			cout << "patched " << dec << bytes << " bytes in " << ms << " ms" << endl;
+	}
+	return 0;
+}
+
+int main (int argc, char * const argv[])
+{
+    cout << "BASSembler6502 " BASSEMBLER_VERSION " -- 6502 cross-assembler\nWritten (c) 2011-2012 by Zoltán Majoros (zoltan@arcanelab.com)" << endl << endl;
+
+    if(argc<2)
+    {
+        cout << "Please specify a file name." << endl;
+        cout << "Usage: bassembler [-j threads] [--cache dir] [--stats] [--timing] [-O] [--quiet] [-c] file.asm [file2.asm ...] [@manifest]" << endl;
+        cout << "       bassembler --link [--quiet] file.o [file2.o ...]" << endl;
+        cout << "       bassembler --daemon file.asm (reads diffs of the file from stdin)" << endl;
+        cout << "       bassembler --run label [--cycles n] [--cache dir] [-O] file.asm (runs the routine at the label)" << endl;
+        return 0;
+    }
+
+    // parse the command line: '-j N' sets the number of threads, '--cache dir' keeps results in 'dir',
+    // '--stats' reports what each assembly did, '--quiet' leaves out the hex dumps, '@file' reads a list of inputs,
+    // '-c' writes object files instead of blocks, '--link' links object files,
+    // '--run label' runs a routine in the emulator, for at most '--cycles n' cycles,
+    // '--timing' reports the cycles of the code, '-O' optimizes it
+    vector<string> inputs;
+    int threads = 0;
+    bool batch = false;
+    bool daemon = false;
+    bool link = false;
+    string runLabel; // --run
+    uint64_t cycleBudget = 100000000;
+    for(int i=1; i<argc; i++)
+    {
+        if(strcmp(argv[i], "--daemon")==0)
+            daemon = true;
+        else if(strcmp(argv[i], "--link")==0)
+            link = true;
+        else if((strcmp(argv[i], "--run")==0) && (i+1<argc))
+            runLabel = argv[++i];
+        else if((strcmp(argv[i], "--cycles")==0) && (i+1<argc))
+            cycleBudget = strtoull(argv[++i], NULL, 0);
+        else if(strcmp(argv[i], "-c")==0)
+            compileObjects = true;
+        else if(strcmp(argv[i], "--timing")==0)
+            printTiming = true;
+        else if(strcmp(argv[i], "-O")==0)
+            optimizeCode = true;
+        else if(strcmp(argv[i], "--quiet")==0)
+            quiet = true;
+        else if(strcmp(argv[i], "--stats")==0)
+        {
+#ifdef BASSEMBLER_STATS
+            printStats = true;
+#else
+            cout << "Statistics are not compiled in, build with -DBASSEMBLER_STATS." << endl;
+            return -1;
+#endif
+        }
+        else if((strcmp(argv[i], "--cache")==0) && (i+1<argc))
+        {
+            cacheDirectory = argv[++i];
+            if((mkdir(cacheDirectory.c_str(), 0755)==-1) && (errno!=EEXIST))
+            {
+                cout << "Cache directory error: " << cacheDirectory << " (" << strerror(errno) << ")" << endl;
+                return -1;
+            }
+        }
+        else if((strncmp(argv[i], "-j", 2)==0) && (argv[i][2] || (i+1<argc)))
+        {
+            threads = atoi(argv[i][2] ? argv[i]+2 : argv[++i]);
+            batch = true;
+        }
+        else if(argv[i][0]=='@')
+        {
+            if(readManifest(argv[i]+1, inputs)==-1)
+                return -1;
+            batch = true;
+        }
+        else
+            inputs.push_back(argv[i]);
+    }
+
+    if(inputs.empty())
+    {
+        cout << "Please specify a file name." << endl;
+        return 0;
+    }
+
+    if(daemon)
+    {
+        if(batch || (inputs.size()>1))
+        {
+            cout << "The daemon works on a single file." << endl;
+            return -1;
+        }
+        return runDaemon(inputs[0].c_str());
+    }
+
+    if(!runLabel.empty())
+    {
+        if(batch || (inputs.size()>1))
+        {
+            cout << "--run works on a single file." << endl;
+            return -1;
+        }
+        return runRoutine(inputs[0].c_str(), runLabel, cycleBudget);
+    }
+
+    if(link)
+    {
+        if(compileObjects)
+        {
+            cout << "-c and --link don't go together, link the object files in a second run." << endl;
+            return -1;
+        }
+        return linkObjects(inputs);
+    }
+
+    if(inputs.size()>1)
+        return assembleBatch(inputs, threads);
+
+    // a single input writes 'block-<address>.prg' either way, -j gives the threads to its .pc segments
+    return assembleFile(inputs[0].c_str(), "block-", cout, batch ? threads : 1);
 }